@@ -13,9 +13,13 @@
  * You will need to have the appropriate firmware loaded in order to use the
  * device.
  *
- * There is no averaging, smoothing or temperature compensation performed by
- * this driver yet. The user space 'estrella' implementation offers a few more
- * features at that point.
+ * Scans to average (USB2EPP_IOCTL_SCANSTOAVG) are taken back to back by the
+ * driver and added up in integer accumulators, so a single read() returns
+ * the average. Boxcar smoothing (USB2EPP_IOCTL_XSMOOTH) is applied to the
+ * final frame, the window shrinks towards the edges of the spectrum. Frames
+ * read() returns while streaming are single scans, smoothed. There is no
+ * temperature compensation performed by this driver yet, the user space
+ * 'estrella' implementation offers that.
  *
  * The device is configured through a hand full of ioctl commands. Those are
  * quite self explanatory, have a look at the usb2epp_ioctl() function for
@@ -24,10 +28,59 @@
  * Measurement results are read directly from the device node in devfs. this
  * should return the usual 2051*sizeof(float) number of bytes for a single
  * measurement. Non-blocking I/O is supported as well, in which case you will
- * get -EBUSY for scans in progress.
+ * get -EAGAIN for scans in progress. A non-blocking read on an idle device
+ * starts a scan, poll() then reports POLLIN once its results can be read.
+ *
+ * USB2EPP_IOCTL_STREAM (arg 1) puts the device into streaming mode. The
+ * driver then keeps integrations running back to back, reads the results
+ * with an asynchronous bulk URB and queues them in a ring of
+ * USB2EPP_RING_FRAMES raw frames which read() drains. Frames arriving while
+ * the ring is full are dropped and counted, USB2EPP_IOCTL_OVERRUNS copies that
+ * count to the unsigned long arg points to. USB2EPP_IOCTL_STREAM (arg 0)
+ * returns to scanning on demand.
+ *
+ * Instead of read()ing converted frames, the ring can be mmap()ed. The first
+ * page of the mapping is a struct usb2epp_ring control page, the raw frames
+ * (little endian words, header word first) follow. Consumers read frames in
+ * place and advance 'tail' when done with them, so the device has to be
+ * opened O_RDWR for a shared writable mapping. Don't mix read() and a
+ * mapped consumer on the same stream. The control page also holds a struct
+ * usb2epp_frameinfo per frame with its sequence number and timestamps.
+ *
+ * With USB2EPP_IOCTL_RECORDS (arg 1) read() returns struct usb2epp_record
+ * instead of bare samples, the frame information followed by the samples.
+ * While streaming, a single read() then returns as many queued records as
+ * fit into the buffer, blocking for the first one only. readv() carries on
+ * with the next buffer once one has been filled up and more frames are
+ * queued, it too blocks for the first frame only. Scanning on demand,
+ * readv() returns a single frame in the first buffer. Buffers must have
+ * room for at least a frame or record, -EINVAL otherwise.
+ *
+ * Readers don't spin while integration is in progress. The device is asked
+ * for completion from a delayed work item which first sleeps until the scan
+ * is about to complete and then polls every USB2EPP_POLL_INTERVAL ms. Readers
+ * and pollers sleep on a wait queue until the work item has seen the scan
+ * complete.
  *
  */
 
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/module.h>
+#include <linux/kref.h>
+#include <asm/uaccess.h>
+#include <linux/usb.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+
 #include "usb2epp.h"
 
 /*
@@ -54,12 +107,35 @@
 /* This is how many bytes we get from the device for a single scan */
 #define USB2EPP_BULK_IN_SIZE            (4096)
 
+/* Start asking the device for completion USB2EPP_POLL_GUARD ms before
+ * integration is expected to complete, every USB2EPP_POLL_INTERVAL ms. A scan
+ * taking longer than (rate + USB2EPP_SCAN_DELAY) ms has timed out, unless we're
+ * waiting for a trigger. */
+#define USB2EPP_POLL_GUARD              (2)
+#define USB2EPP_POLL_INTERVAL           (1)
+#define USB2EPP_SCAN_DELAY              (100)
+
+/* Number of samples per scan, the first word of a raw frame is a header */
+#define USB2EPP_SAMPLES                 (2047)
+
+/* Upper limit for scans to average. Smoothing adds up to 33 samples of the
+ * accumulator, that sum must not overflow 32 bits. */
+#define USB2EPP_SCANSTOAVG_MAX          (1000)
+
+/* Number of frames in the streaming ring, must be a power of 2 */
+#define USB2EPP_RING_FRAMES             (16)
+
+/* Size of the ring including its control page */
+#define USB2EPP_RING_SIZE               (PAGE_SIZE + USB2EPP_RING_FRAMES*USB2EPP_BULK_IN_SIZE)
+
 #define to_usb2epp_dev(d) container_of(d, struct usb_usb2epp, kref)
 
 /* Device states */
 typedef enum {
         USB2EPP_STATE_IDLE      =       (0),
         USB2EPP_STATE_SCANNING,
+        USB2EPP_STATE_COMPLETE,
+        USB2EPP_STATE_READING,
         USB2EPP_STATE_TYPES,
 } usb2epp_state_t;
 
@@ -72,16 +148,35 @@ struct usb_usb2epp {
         struct usb_interface    *interface;             /* the interface for this device */
         unsigned char           *bulk_in_buffer;        /* BULK_IN_SIZE bytes for the measurement results */
         int                     *result_buffer;         /* result buffer */
+        u32                     *acc_buffer;            /* scans added up, USB2EPP_SAMPLES */
         size_t                  bulk_in_size;           /* the size of the receive buffer */
         int                     errors;                 /* the last request tanked */
         int                     open_count;             /* count the number of openers */
         struct kref             kref;                   /* object reference counter */
         struct mutex            io_mutex;               /* synchronize I/O */
+        wait_queue_head_t       wait;                   /* readers and pollers waiting for a scan */
+        struct delayed_work     poll_work;              /* asks the device for completion */
 
         /*
          * Session data
          */
         usb2epp_state_t         state;                  /* Device state */
+        int                     scan_rc;                /* Outcome of the last scan */
+        unsigned long           scan_deadline;          /* Scan times out then (jiffies) */
+        int                     averaged;               /* Scans in acc_buffer so far */
+        ktime_t                 scan_start;             /* Last scan has been started */
+        ktime_t                 scan_complete;          /* Last scan has completed */
+        struct usb2epp_frameinfo info;                  /* Frame read() returns next */
+        __u32                   sequence;               /* Next frame's sequence number */
+        int                     dropped;                /* Frames lost since the last one */
+        int                     records;                /* read() returns records */
+
+        /*
+         * Streaming
+         */
+        int                     streaming;              /* Integrations run back to back */
+        struct urb              *bulk_urb;              /* reads a frame into bulk_in_buffer */
+        struct usb2epp_ring     *ring;                  /* completed frames, raw, mmap()able */
         int                     rate;                   /* Integration time */
         usb2epp_xtrate_t        xtrate;                 /* Resolution */
         usb2epp_xtmode_t        xtmode;                 /* External trigger mode */
@@ -100,7 +195,9 @@ static int usb2epp_open(struct inode *inode, struct file *file);
 static int usb2epp_release(struct inode *inode, struct file *file);
 static int usb2epp_flush(struct file *file, fl_owner_t id);
 static ssize_t usb2epp_read(struct file *file, char *buffer, size_t count, loff_t *ppos);
+static ssize_t usb2epp_aio_read(struct kiocb *iocb, const struct iovec *iov, unsigned long nr_segs, loff_t pos);
 static ssize_t usb2epp_write(struct file *file, const char *user_buffer, size_t count, loff_t *ppos);
+static unsigned int usb2epp_poll(struct file *file, poll_table *wait);
 static long usb2epp_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
 /* Kernel interface */
@@ -115,6 +212,20 @@ static int usb2epp_post_reset(struct usb_interface *intf);
 static int usb2epp_scan_setup(struct usb_usb2epp *dev);
 static int usb2epp_scan_start(struct usb_usb2epp *dev);
 static int usb2epp_scan_iscomplete(struct usb_usb2epp *dev);
+static int usb2epp_scan_begin(struct usb_usb2epp *dev);
+static void usb2epp_poll_work(struct work_struct *work);
+static int usb2epp_stream_start(struct usb_usb2epp *dev);
+static void usb2epp_stream_stop(struct usb_usb2epp *dev);
+static void usb2epp_stream_callback(struct urb *urb);
+static ssize_t usb2epp_stream_read(struct usb_usb2epp *dev, int nonblock, char *buffer, size_t count);
+static size_t usb2epp_frame_size(struct usb_usb2epp *dev);
+static int usb2epp_bulk_read(struct usb_usb2epp *dev);
+static void usb2epp_accumulate(struct usb_usb2epp *dev, const unsigned char *data, int first);
+static ssize_t usb2epp_result(struct usb_usb2epp *dev, int count, const struct usb2epp_frameinfo *info, char *buffer);
+static void usb2epp_frameinfo(struct usb_usb2epp *dev, struct usb2epp_frameinfo *info);
+static int usb2epp_mmap(struct file *file, struct vm_area_struct *vma);
+static unsigned char *usb2epp_ring_frame(struct usb_usb2epp *dev, __u32 n);
+static int usb2epp_ring_empty(struct usb_usb2epp *dev);
 
 /* Safe setter functions for user data */
 static int usb2epp_session_set_rate(struct usb_usb2epp *dev, int rate);
@@ -141,7 +252,10 @@ static struct usb_device_id usb2epp_table [] = {
 static const struct file_operations usb2epp_fops = {
         .owner =                THIS_MODULE,
         .read =                 usb2epp_read,
+        .aio_read =             usb2epp_aio_read,
         .write =                usb2epp_write,
+        .poll =                 usb2epp_poll,
+        .mmap =                 usb2epp_mmap,
         .open =                 usb2epp_open,
         .release =              usb2epp_release,
         .flush =                usb2epp_flush,
@@ -178,10 +292,15 @@ static void usb2epp_delete(struct kref *kref)
 
         usb_put_dev(dev->udev);
 
+        usb_free_urb(dev->bulk_urb);
+        if (dev->ring)
+                vfree(dev->ring);
         if (dev->bulk_in_buffer)
                 kfree(dev->bulk_in_buffer);
         if (dev->result_buffer)
                 kfree(dev->result_buffer);
+        if (dev->acc_buffer)
+                kfree(dev->acc_buffer);
                 
         kfree(dev);
 }
@@ -259,8 +378,22 @@ static long usb2epp_ioctl(struct file *file, unsigned int cmd, unsigned long arg
                 goto exit;
         }
 
+        /* These are fine while scanning or streaming */
+        if (cmd == USB2EPP_IOCTL_OVERRUNS) {
+                unsigned long overruns = ACCESS_ONCE(dev->ring->overruns);
+
+                if (put_user(overruns, (unsigned long __user *)arg))
+                        rc = -EFAULT;
+                goto exit;
+        }
+
+        if ((cmd == USB2EPP_IOCTL_STREAM) && (arg == 0)) {
+                usb2epp_stream_stop(dev);
+                goto exit;
+        }
+
         /* Make sure we're not scanning right now */
-        if (dev->state != USB2EPP_STATE_IDLE) {
+        if ((dev->state != USB2EPP_STATE_IDLE) || dev->streaming) {
                 rc = -EBUSY;
                 goto exit;
         }
@@ -286,6 +419,12 @@ static long usb2epp_ioctl(struct file *file, unsigned int cmd, unsigned long arg
                 case USB2EPP_IOCTL_SCANSTOAVG:
                         rc = usb2epp_session_set_scanstoavg(dev, (int)arg);
                         break;
+                case USB2EPP_IOCTL_STREAM:
+                        rc = usb2epp_stream_start(dev);
+                        break;
+                case USB2EPP_IOCTL_RECORDS:
+                        dev->records = (arg != 0);
+                        break;
                 default:
                         rc = -EINVAL;
                         break;
@@ -305,8 +444,18 @@ static int usb2epp_release(struct inode *inode, struct file *file)
         if (dev == NULL)
                 return -ENODEV;
 
+        /* Stop streaming, no more frames are to be read */
+        mutex_lock(&dev->io_mutex);
+        usb2epp_stream_stop(dev);
+        mutex_unlock(&dev->io_mutex);
+
+        /* Abandon a scan which is still in progress. The work item takes the
+         * I/O lock itself, so don't hold it while waiting for the work. */
+        cancel_delayed_work_sync(&dev->poll_work);
+
         /* Allow the device to be autosuspended */
         mutex_lock(&dev->io_mutex);
+        dev->state = USB2EPP_STATE_IDLE;
         if (!--dev->open_count && dev->interface)
                 usb_autopm_put_interface(dev->interface);
         mutex_unlock(&dev->io_mutex);
@@ -341,8 +490,6 @@ static ssize_t usb2epp_read(struct file *file, char *buffer, size_t count, loff_
 {
         int rc;
         struct usb_usb2epp *dev;
-        int bytes_read, bytes_total;
-        int i;
 
         /* Get our session and lock I/O */
         dev = (struct usb_usb2epp*)file->private_data;
@@ -354,41 +501,122 @@ static ssize_t usb2epp_read(struct file *file, char *buffer, size_t count, loff_
                 goto exit;
         }
 
-        /* Start a scan if we're currently idle */
+        /* A frame or record doesn't fit */
+        if (count < usb2epp_frame_size(dev)) {
+                rc = -EINVAL;
+                goto exit;
+        }
+
+        /* Frames are already on their way while streaming */
+        if (dev->streaming) {
+                rc = usb2epp_stream_read(dev, file->f_flags & O_NONBLOCK, buffer, count);
+                goto exit;
+        }
+
+        /* Start a scan if we're currently idle. The work item reads it and
+         * takes as many more as we're supposed to average. */
         if (dev->state == USB2EPP_STATE_IDLE) {
-                rc = usb2epp_scan_start(dev);
+                dev->averaged = 0;
+                rc = usb2epp_scan_begin(dev);
 
                 /* Exit on error */
                 if (rc != 0)
                         goto exit;
+        }
 
-                /* Exit if non blocking I/O has been requested */
-                if ((file->f_flags & O_NONBLOCK) > 0)
+        /* Wait for the work item to see the scan complete. We must not hold
+         * the I/O lock while sleeping, the work item needs it. */
+        while (dev->state != USB2EPP_STATE_COMPLETE) {
+                /* Non-blocking readers come back later, or poll() */
+                if ((file->f_flags & O_NONBLOCK) > 0) {
+                        rc = -EAGAIN;
                         goto exit;
+                }
 
-                dev->state = USB2EPP_STATE_SCANNING;
-        }
+                mutex_unlock(&dev->io_mutex);
+                rc = wait_event_interruptible(dev->wait,
+                                (dev->state != USB2EPP_STATE_SCANNING) || !dev->interface);
+                if (rc != 0)
+                        return -ERESTARTSYS;
+                mutex_lock(&dev->io_mutex);
 
-        /* Check for completion of the scan. If we're in blocking I/O mode we busy loop here. This
-         * might not be a very good idea. */
-        rc = 0;
-        for(;;) {
-                /* Exit the loop if complete */
-                rc = usb2epp_scan_iscomplete(dev);
-                if (rc == 0)
-                        break;
+                /* disconnect() was called meanwhile */
+                if (!dev->interface) {
+                        rc = -ENODEV;
+                        goto exit;
+                }
 
-                /* Perform only a single query in non-blocking I/O mode */
-                if ((file->f_flags & O_NONBLOCK) > 0) {
-                        rc = -EBUSY; 
-                        break;
+                /* The device has been reset meanwhile, the scan is gone */
+                if (dev->state == USB2EPP_STATE_IDLE) {
+                        rc = -EIO;
+                        goto exit;
                 }
         }
 
-        /* Scan is not complete */
+        /* Whatever the outcome, the scan is over */
+        dev->state = USB2EPP_STATE_IDLE;
+
+        /* A scan failed, timed out or could not be read */
+        rc = dev->scan_rc;
         if (rc != 0)
                 goto exit;
 
+        rc = usb2epp_result(dev, dev->averaged, &dev->info, buffer);
+exit:
+        /* Release our I/O lock and return */
+        mutex_unlock(&dev->io_mutex);
+        return rc;
+}
+
+static ssize_t usb2epp_aio_read(struct kiocb *iocb, const struct iovec *iov, unsigned long nr_segs, loff_t pos)
+{
+        ssize_t rc;
+        size_t total = 0;
+        unsigned long seg;
+        struct file *file = iocb->ki_filp;
+        struct usb_usb2epp *dev;
+
+        /* Get our session and lock I/O */
+        dev = (struct usb_usb2epp*)file->private_data;
+        mutex_lock(&dev->io_mutex);
+
+        /* Scanning on demand there's a single frame to be had, read() it
+         * into the first buffer */
+        if (!dev->streaming || !dev->interface) {
+                mutex_unlock(&dev->io_mutex);
+                return usb2epp_read(file, iov[0].iov_base, iov[0].iov_len, &iocb->ki_pos);
+        }
+
+        /* Fill the buffers in turn. Only the first frame is waited for, we
+         * stop at a buffer which doesn't fit or can't be filled up. */
+        rc = -EINVAL;
+        for (seg = 0; seg < nr_segs; seg++) {
+                if (iov[seg].iov_len < usb2epp_frame_size(dev))
+                        break;
+
+                rc = usb2epp_stream_read(dev, (total > 0) || (file->f_flags & O_NONBLOCK),
+                                iov[seg].iov_base, iov[seg].iov_len);
+                if (rc < 0)
+                        break;
+
+                total += rc;
+                if ((size_t)rc < iov[seg].iov_len)
+                        break;
+        }
+
+        /* Release our I/O lock, report what we've got before a failure */
+        mutex_unlock(&dev->io_mutex);
+        if (total > 0)
+                return total;
+
+        return rc;
+}
+
+static int usb2epp_bulk_read(struct usb_usb2epp *dev)
+{
+        int rc;
+        int bytes_read, bytes_total;
+
         /* We'll now try to get USB2EPP_BULK_IN_SIZE bytes from the device */
         bytes_total = 0;
         do {
@@ -399,50 +627,228 @@ static ssize_t usb2epp_read(struct file *file, char *buffer, size_t count, loff_
                                 min(dev->bulk_in_size, (size_t)USB2EPP_BULK_IN_SIZE),
                                 &bytes_read, 5000);
                 if (rc < 0)
-                        break;
+                        return rc;
 
                 bytes_total += bytes_read;
         } while (bytes_total < USB2EPP_BULK_IN_SIZE); 
 
-        /* usb_bulk_msg() screwed up */
-        if (rc < 0)
-                goto exit;
+        return 0;
+}
 
-        /* We got the scan results, return to idle state */
-        dev->state = USB2EPP_STATE_IDLE;
+static void usb2epp_accumulate(struct usb_usb2epp *dev, const unsigned char *data, int first)
+{
+        int i;
+        const __le16 *raw;
 
-        /* Fill the buffer and send back */
-        for (i=2; i<4096;i+=2) {
-                unsigned int val = 0;
-                val |= dev->bulk_in_buffer[i+1];
-                val = (val << 8);
-                val |= dev->bulk_in_buffer[i];
+        /* Samples are little endian words, the first one is skipped */
+        raw = (const __le16 *)&data[2];
 
-                dev->result_buffer[(i-2)/2] = (int)val;
+        if (first) {
+                for (i=0; i<USB2EPP_SAMPLES; i++)
+                        dev->acc_buffer[i] = le16_to_cpu(raw[i]);
+        } else {
+                for (i=0; i<USB2EPP_SAMPLES; i++)
+                        dev->acc_buffer[i] += le16_to_cpu(raw[i]);
         }
-        for (i=2047;i<2051;i++)
-                dev->result_buffer[i] = 0.0;
+}
 
-        /* Copy the data to userspace */
-        rc = copy_to_user(buffer, (const void *)dev->result_buffer, 2051*sizeof(int));
+static ssize_t usb2epp_result(struct usb_usb2epp *dev, int count, const struct usb2epp_frameinfo *info, char *buffer)
+{
+        int i, lo, hi, half;
+        u32 sum, div;
+        u32 *acc = dev->acc_buffer;
+
+        /* Half the boxcar width for each xsmooth setting */
+        static const int smooth_half[USB2EPP_XSMOOTH_TYPES] = {0, 2, 4, 8, 16};
+
+        half = smooth_half[dev->xsmooth];
+
+        /* Turn the accumulator into prefix sums, acc[i] holds the sum of
+         * samples 0..i then. Windows are differences of two of those. */
+        if (half > 0) {
+                for (i=1; i<USB2EPP_SAMPLES; i++)
+                        acc[i] += acc[i-1];
+        }
+
+        /* Divide once per sample by the number of scans times the window
+         * width, rounding to the nearest count */
+        for (i=0; i<USB2EPP_SAMPLES; i++) {
+                if (half > 0) {
+                        lo = max(i - half, 0);
+                        hi = min(i + half, USB2EPP_SAMPLES - 1);
+                        sum = acc[hi] - ((lo > 0) ? acc[lo-1] : 0);
+                        div = (u32)count*(u32)(hi - lo + 1);
+                } else {
+                        sum = acc[i];
+                        div = (u32)count;
+                }
+
+                dev->result_buffer[i] = (int)((sum + div/2)/div);
+        }
+        memset(&dev->result_buffer[USB2EPP_SAMPLES], 0, 4*sizeof(int));
+
+        /* Copy the data to userspace, return either an error code or the
+         * number of bytes copied. Records carry the frame information up
+         * front. */
+        if (!dev->records) {
+                if (copy_to_user(buffer, (const void *)dev->result_buffer, 2051*sizeof(int)) != 0)
+                        return -EFAULT;
+
+                return 2051*sizeof(int);
+        }
+
+        if (copy_to_user(buffer, (const void *)info, sizeof(*info)) != 0)
+                return -EFAULT;
+        if (copy_to_user(buffer + offsetof(struct usb2epp_record, data),
+                                (const void *)dev->result_buffer, 2051*sizeof(int)) != 0)
+                return -EFAULT;
+
+        return sizeof(struct usb2epp_record);
+}
+
+static ssize_t usb2epp_stream_read(struct usb_usb2epp *dev, int nonblock, char *buffer, size_t count)
+{
+        int rc;
+        __u32 tail;
+        size_t total = 0;
+        struct usb2epp_frameinfo info;
+
+        /* Wait for a frame. The I/O lock is held on entry and on return but
+         * not while sleeping, the work item needs it to keep the stream
+         * going. */
+        while (usb2epp_ring_empty(dev)) {
+                if (nonblock)
+                        return -EAGAIN;
+
+                mutex_unlock(&dev->io_mutex);
+                rc = wait_event_interruptible(dev->wait,
+                                !usb2epp_ring_empty(dev) || !dev->streaming || !dev->interface);
+                mutex_lock(&dev->io_mutex);
+                if (rc != 0)
+                        return -ERESTARTSYS;
+
+                /* disconnect() was called meanwhile */
+                if (!dev->interface)
+                        return -ENODEV;
+
+                /* The stream died, report why */
+                if (!dev->streaming && usb2epp_ring_empty(dev))
+                        return dev->errors ? dev->errors : -EIO;
+        }
+
+        /* Convert frames in place and hand their slots back. Records are
+         * returned as long as there are more and they fit, a bare frame at
+         * a time otherwise. */
+        do {
+                tail = ACCESS_ONCE(dev->ring->tail);
+                memcpy(&info, &dev->ring->info[tail % USB2EPP_RING_FRAMES], sizeof(info));
+                usb2epp_accumulate(dev, usb2epp_ring_frame(dev, tail), 1);
+                rc = usb2epp_result(dev, 1, &info, buffer + total);
+                if (rc < 0)
+                        break;
+
+                smp_mb();
+                dev->ring->tail = tail + 1;
+                total += rc;
+        } while (dev->records && (count - total >= sizeof(struct usb2epp_record)) &&
+                 !usb2epp_ring_empty(dev));
+
+        /* Report what we've got before a fault */
+        if (total > 0)
+                return total;
 
-        /* return either an error code or the number ob bytes copied */
-        if (rc != 0)
-                rc = -EFAULT;
-        else
-                rc = 2051*sizeof(int);
-exit:
-        /* Release our I/O lock and return */
-        mutex_unlock(&dev->io_mutex);
         return rc;
 }
 
+static size_t usb2epp_frame_size(struct usb_usb2epp *dev)
+{
+        /* What a single frame takes in a read() buffer */
+        if (dev->records)
+                return sizeof(struct usb2epp_record);
+
+        return 2051*sizeof(int);
+}
+
+static void usb2epp_frameinfo(struct usb_usb2epp *dev, struct usb2epp_frameinfo *info)
+{
+        /* The start of the frame is filled in by the caller, averaged frames
+         * start with their first scan */
+        info->complete = ktime_to_ns(dev->scan_complete);
+        info->received = ktime_to_ns(ktime_get());
+        info->sequence = dev->sequence++;
+        info->flags = 0;
+
+        if (dev->dropped)
+                info->flags |= USB2EPP_FRAME_DROPPED;
+        if (dev->xtmode == USB2EPP_XTMODE_TRIGGER)
+                info->flags |= USB2EPP_FRAME_TRIGGER;
+
+        dev->dropped = 0;
+}
+
+static unsigned char *usb2epp_ring_frame(struct usb_usb2epp *dev, __u32 n)
+{
+        return (unsigned char *)dev->ring + PAGE_SIZE + (n % USB2EPP_RING_FRAMES)*USB2EPP_BULK_IN_SIZE;
+}
+
+static int usb2epp_ring_empty(struct usb_usb2epp *dev)
+{
+        int empty;
+
+        empty = (ACCESS_ONCE(dev->ring->head) == ACCESS_ONCE(dev->ring->tail));
+
+        /* Don't read a frame before we've seen its head update */
+        smp_rmb();
+
+        return empty;
+}
+
+static int usb2epp_mmap(struct file *file, struct vm_area_struct *vma)
+{
+        struct usb_usb2epp *dev;
+
+        dev = (struct usb_usb2epp*)file->private_data;
+        if (dev == NULL)
+                return -ENODEV;
+
+        /* The whole ring or a part of it, starting at the control page */
+        if ((vma->vm_pgoff != 0) || (vma->vm_end - vma->vm_start > PAGE_ALIGN(USB2EPP_RING_SIZE)))
+                return -EINVAL;
+
+        return remap_vmalloc_range(vma, dev->ring, 0);
+}
+
 static ssize_t usb2epp_write(struct file *file, const char *user_buffer, size_t count, loff_t *ppos)
 {
         /* There's no data to be transferred _to_ the device really */
         return 0;
 }
 
+static unsigned int usb2epp_poll(struct file *file, poll_table *wait)
+{
+        struct usb_usb2epp *dev;
+        unsigned int mask = 0;
+
+        dev = (struct usb_usb2epp*)file->private_data;
+        if (dev == NULL)
+                return POLLERR;
+
+        poll_wait(file, &dev->wait, wait);
+
+        /* Readable once a scan has completed. An idle device has nothing to
+         * report, a non-blocking read() starts the next scan. */
+        mutex_lock(&dev->io_mutex);
+        if (!dev->interface)
+                mask |= POLLERR | POLLHUP;
+        else if (dev->streaming && !usb2epp_ring_empty(dev))
+                mask |= POLLIN | POLLRDNORM;
+        else if (!dev->streaming && (dev->state == USB2EPP_STATE_COMPLETE))
+                mask |= POLLIN | POLLRDNORM;
+        mutex_unlock(&dev->io_mutex);
+
+        return mask;
+}
+
 static int usb2epp_probe(struct usb_interface *interface, const struct usb_device_id *id)
 {
         struct usb_usb2epp *dev = NULL;
@@ -461,6 +867,8 @@ static int usb2epp_probe(struct usb_interface *interface, const struct usb_devic
         /* Init the reference counter and I/O lock */
         kref_init(&dev->kref);
         mutex_init(&dev->io_mutex);
+        init_waitqueue_head(&dev->wait);
+        INIT_DELAYED_WORK(&dev->poll_work, usb2epp_poll_work);
 
         /* Attach this driver to the device */
         dev->udev = usb_get_dev(interface_to_usbdev(interface));
@@ -503,6 +911,28 @@ static int usb2epp_probe(struct usb_interface *interface, const struct usb_devic
                 err("Could not allocate bulk_in_buffer");
                 goto error;
         }
+        dev->acc_buffer = (u32*)kmalloc(USB2EPP_SAMPLES*sizeof(u32), GFP_KERNEL);
+        if (!dev->acc_buffer) {
+                err("Could not allocate acc_buffer");
+                goto error;
+        }
+
+        /* Streaming needs a URB and the ring. The ring is going to be mapped
+         * to user space, so it must be zeroed. */
+        dev->bulk_urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!dev->bulk_urb) {
+                err("Could not allocate bulk_urb");
+                goto error;
+        }
+        dev->ring = (struct usb2epp_ring*)vmalloc_user(USB2EPP_RING_SIZE);
+        if (!dev->ring) {
+                err("Could not allocate ring");
+                goto error;
+        }
+        BUILD_BUG_ON(sizeof(struct usb2epp_ring) +
+                        USB2EPP_RING_FRAMES*sizeof(struct usb2epp_frameinfo) > PAGE_SIZE);
+        dev->ring->frames = USB2EPP_RING_FRAMES;
+        dev->ring->frame_size = USB2EPP_BULK_IN_SIZE;
 
         /* Save our data pointer in this interface device */
         usb_set_intfdata(interface, dev);
@@ -556,9 +986,14 @@ static void usb2epp_disconnect(struct usb_interface *interface)
 
         /* prevent more I/O from starting */
         mutex_lock(&dev->io_mutex);
+        usb2epp_stream_stop(dev);
         dev->interface = NULL;
         mutex_unlock(&dev->io_mutex);
 
+        /* Stop asking the device and wake up whoever is waiting for it */
+        cancel_delayed_work_sync(&dev->poll_work);
+        wake_up_interruptible_all(&dev->wait);
+
         /* decrement our usage count */
         kref_put(&dev->kref, usb2epp_delete);
 
@@ -581,6 +1016,9 @@ static int usb2epp_pre_reset(struct usb_interface *intf)
 
         mutex_lock(&dev->io_mutex);
 
+        /* The stream doesn't survive a reset */
+        usb2epp_stream_stop(dev);
+
         return 0;
 }
 
@@ -591,8 +1029,9 @@ static int usb2epp_post_reset(struct usb_interface *intf)
         /* we are sure no URBs are active - no locking needed */
         dev->errors = -EPIPE;
 
-        /* Back to idle state after reset */
+        /* Back to idle state after reset, a scan in progress is lost */
         dev->state = USB2EPP_STATE_IDLE;
+        wake_up_interruptible_all(&dev->wait);
 
         mutex_unlock(&dev->io_mutex);
 
@@ -659,9 +1098,11 @@ static int usb2epp_session_set_xtmode(struct usb_usb2epp *dev, int xtmode)
 
 static int usb2epp_session_set_scanstoavg(struct usb_usb2epp *dev, int scanstoavg)
 {
-        if (scanstoavg <= 0)
+        if ((scanstoavg <= 0) || (scanstoavg > USB2EPP_SCANSTOAVG_MAX))
                 return -EINVAL;
 
+        dev->scanstoavg = scanstoavg;
+
         return 0;
 }
 
@@ -716,6 +1157,214 @@ exit:
         return rc;
 }
 
+static int usb2epp_scan_begin(struct usb_usb2epp *dev)
+{
+        int rc;
+        unsigned long delay = 0;
+
+        rc = usb2epp_scan_start(dev);
+        if (rc != 0)
+                return rc;
+
+        dev->scan_start = ktime_get();
+        dev->state = USB2EPP_STATE_SCANNING;
+        dev->scan_rc = 0;
+        dev->scan_deadline = jiffies + msecs_to_jiffies(dev->rate + USB2EPP_SCAN_DELAY);
+
+        /* There's no point in asking the device before integration is almost
+         * done. In trigger mode we don't know when integration starts. */
+        if ((dev->xtmode != USB2EPP_XTMODE_TRIGGER) && (dev->rate > USB2EPP_POLL_GUARD))
+                delay = msecs_to_jiffies(dev->rate - USB2EPP_POLL_GUARD);
+
+        schedule_delayed_work(&dev->poll_work, delay);
+
+        return 0;
+}
+
+static void usb2epp_poll_work(struct work_struct *work)
+{
+        int rc;
+        struct usb_usb2epp *dev;
+
+        dev = container_of(work, struct usb_usb2epp, poll_work.work);
+
+        mutex_lock(&dev->io_mutex);
+
+        /* The device is gone */
+        if (!dev->interface)
+                goto exit;
+
+        /* While streaming the next integration starts as soon as the last
+         * frame has been read */
+        if (dev->streaming && (dev->state == USB2EPP_STATE_READING)) {
+                dev->state = USB2EPP_STATE_IDLE;
+                rc = usb2epp_scan_begin(dev);
+                if (rc != 0)
+                        goto error;
+                goto exit;
+        }
+
+        /* Scan has been abandoned */
+        if (dev->state != USB2EPP_STATE_SCANNING)
+                goto exit;
+
+        rc = usb2epp_scan_iscomplete(dev);
+        if (rc == -EBUSY) {
+                /* Ask again in a bit, unless we've been waiting for too long */
+                if ((dev->xtmode == USB2EPP_XTMODE_TRIGGER) ||
+                    time_before(jiffies, dev->scan_deadline)) {
+                        schedule_delayed_work(&dev->poll_work,
+                                        msecs_to_jiffies(USB2EPP_POLL_INTERVAL));
+                        goto exit;
+                }
+
+                rc = -ETIMEDOUT;
+        }
+
+        dev->scan_complete = ktime_get();
+
+        /* While streaming, have the frame read asynchronously.
+         * usb2epp_stream_callback() takes it from there. */
+        if (dev->streaming) {
+                if (rc != 0)
+                        goto error;
+
+                usb_fill_bulk_urb(dev->bulk_urb, dev->udev,
+                                usb_rcvbulkpipe(dev->udev, USB2EPP_BULK_IN_ENDPOINT),
+                                dev->bulk_in_buffer, USB2EPP_BULK_IN_SIZE,
+                                usb2epp_stream_callback, dev);
+
+                dev->state = USB2EPP_STATE_READING;
+                rc = usb_submit_urb(dev->bulk_urb, GFP_KERNEL);
+                if (rc != 0)
+                        goto error;
+                goto exit;
+        }
+
+        /* Read the scan and add it up. Start the next one right away until
+         * we've got as many as we're supposed to average. */
+        if (rc == 0)
+                rc = usb2epp_bulk_read(dev);
+
+        if (rc == 0) {
+                if (dev->averaged == 0)
+                        dev->info.start = ktime_to_ns(dev->scan_start);
+
+                usb2epp_accumulate(dev, dev->bulk_in_buffer, dev->averaged == 0);
+                dev->averaged++;
+
+                if (dev->averaged < dev->scanstoavg) {
+                        rc = usb2epp_scan_begin(dev);
+                        if (rc == 0)
+                                goto exit;
+                }
+        }
+
+        /* All scans are in, or one of them failed */
+        if (rc == 0)
+                usb2epp_frameinfo(dev, &dev->info);
+        dev->scan_rc = rc;
+        dev->state = USB2EPP_STATE_COMPLETE;
+        wake_up_interruptible(&dev->wait);
+        goto exit;
+
+error:
+        /* The stream dies, readers learn why */
+        dev->errors = rc;
+        dev->streaming = 0;
+        dev->state = USB2EPP_STATE_IDLE;
+        wake_up_interruptible(&dev->wait);
+
+exit:
+        mutex_unlock(&dev->io_mutex);
+}
+
+static void usb2epp_stream_callback(struct urb *urb)
+{
+        struct usb_usb2epp *dev = (struct usb_usb2epp*)urb->context;
+        struct usb2epp_ring *ring = dev->ring;
+        struct usb2epp_frameinfo *info;
+        __u32 head;
+
+        /* Killed by usb2epp_stream_stop() or disconnect, nothing to do */
+        if ((urb->status == -ENOENT) || (urb->status == -ECONNRESET) ||
+            (urb->status == -ESHUTDOWN))
+                return;
+
+        /* Queue the frame unless the ring is full. Short or failed transfers
+         * are dropped. We're the only one writing head, the consumer may
+         * write tail any time. */
+        if ((urb->status == 0) && (urb->actual_length == USB2EPP_BULK_IN_SIZE)) {
+                head = ring->head;
+                if (head - ACCESS_ONCE(ring->tail) < USB2EPP_RING_FRAMES) {
+                        /* The slot may only be reused once the consumer has
+                         * advanced tail past it */
+                        smp_mb();
+                        memcpy(usb2epp_ring_frame(dev, head), dev->bulk_in_buffer,
+                                        USB2EPP_BULK_IN_SIZE);
+
+                        info = &ring->info[head % USB2EPP_RING_FRAMES];
+                        info->start = ktime_to_ns(dev->scan_start);
+                        usb2epp_frameinfo(dev, info);
+
+                        /* Publish the frame after its data */
+                        smp_wmb();
+                        ring->head = head + 1;
+                } else {
+                        /* The frame is lost, so is its sequence number */
+                        ring->overruns++;
+                        dev->sequence++;
+                        dev->dropped = 1;
+                }
+        } else {
+                dev->sequence++;
+                dev->dropped = 1;
+        }
+
+        wake_up_interruptible(&dev->wait);
+
+        /* We can't talk to the device from here, the work item starts the
+         * next integration */
+        schedule_delayed_work(&dev->poll_work, 0);
+}
+
+static int usb2epp_stream_start(struct usb_usb2epp *dev)
+{
+        int rc;
+
+        /* No URB is in flight, the ring is ours */
+        dev->ring->head = 0;
+        dev->ring->tail = 0;
+        dev->ring->overruns = 0;
+
+        dev->sequence = 0;
+        dev->dropped = 0;
+        dev->errors = 0;
+        dev->streaming = 1;
+
+        rc = usb2epp_scan_begin(dev);
+        if (rc != 0)
+                dev->streaming = 0;
+
+        return rc;
+}
+
+static void usb2epp_stream_stop(struct usb_usb2epp *dev)
+{
+        if (!dev->streaming && (dev->state != USB2EPP_STATE_READING))
+                return;
+
+        /* Called with the I/O lock held. The URB callback doesn't need it, so
+         * we can wait for the URB here. A pending work item finds the device
+         * idle and returns. Frames still in the ring are dropped with the
+         * next start. */
+        dev->streaming = 0;
+        usb_kill_urb(dev->bulk_urb);
+        dev->state = USB2EPP_STATE_IDLE;
+
+        wake_up_interruptible_all(&dev->wait);
+}
+
 static int usb2epp_scan_setup(struct usb_usb2epp *dev)
 {
         int rc;
@@ -9,15 +9,12 @@
  *
  */
 
-#include <linux/kernel.h>
-#include <linux/errno.h>
-#include <linux/init.h>
-#include <linux/slab.h>
-#include <linux/module.h>
-#include <linux/kref.h>
-#include <asm/uaccess.h>
-#include <linux/usb.h>
-#include <linux/mutex.h>
+/* This header is shared with user space, it must not pull in anything but
+ * <linux/types.h>. Kernel only includes go to usb2epp.c. */
+#ifndef USB2EPP_H
+#define USB2EPP_H
+
+#include <linux/types.h>
 
 /* Supported ioctls */
 enum usb2epp_ioctls {
@@ -26,6 +23,9 @@ enum usb2epp_ioctls {
         USB2EPP_IOCTL_XTMODE,
         USB2EPP_IOCTL_XSMOOTH,
         USB2EPP_IOCTL_SCANSTOAVG,
+        USB2EPP_IOCTL_STREAM,
+        USB2EPP_IOCTL_OVERRUNS,
+        USB2EPP_IOCTL_RECORDS,
         USB2EPP_IOCTL_TYPES,
 };
 
@@ -61,3 +61,38 @@ typedef enum {
         USB2EPP_XTRATE_TYPES,
 } usb2epp_xtrate_t;
 
+/* Frame flags */
+#define USB2EPP_FRAME_DROPPED           (0x01)  /* frames have been lost before this one */
+#define USB2EPP_FRAME_TRIGGER           (0x02)  /* acquired in trigger mode */
+
+/* Per frame information. Times are CLOCK_MONOTONIC ns. For averaged frames
+ * 'start' is the start of the first scan, the others refer to the last one. */
+struct usb2epp_frameinfo {
+        __u64   start;          /* integration has been started */
+        __u64   complete;       /* device reported completion */
+        __u64   received;       /* data has arrived */
+        __u32   sequence;       /* frame number, gaps mean frames were lost */
+        __u32   flags;          /* USB2EPP_FRAME_* */
+};
+
+/* Record as returned by read() with USB2EPP_IOCTL_RECORDS enabled */
+struct usb2epp_record {
+        struct usb2epp_frameinfo info;
+        __s32   data[2051];
+};
+
+/* Control page of the frame ring, see usb2epp_mmap(). The driver writes
+ * frames at 'head' and advances it, the consumer reads frames at 'tail' and
+ * advances that. Both are free running, frame n lives at offset
+ * PAGE_SIZE + (n % frames)*frame_size of the mapping. */
+struct usb2epp_ring {
+        __u32   head;           /* next frame the driver writes */
+        __u32   tail;           /* next frame the consumer reads */
+        __u32   frames;         /* number of frames in the ring */
+        __u32   frame_size;     /* raw frame size in bytes */
+        __u32   overruns;       /* frames dropped, ring was full */
+        __u32   reserved;
+        struct usb2epp_frameinfo info[0]; /* 'frames' entries, one per frame */
+};
+
+#endif /* USB2EPP_H */
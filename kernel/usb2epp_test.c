@@ -1,18 +1,199 @@
 #include <stdio.h>
+#include <string.h>
+#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <gpif.h>
 #include <unistd.h>
 
+#include "usb2epp.h"
+
 #define SHOWCASE
 
+/* Frames to take through each of the streaming interfaces */
+#define STREAM_FRAMES   (32)
+
+static struct usb2epp_record records[4];
+
+static int check_sequence(const struct usb2epp_frameinfo *info, __u32 *expected)
+{
+        /* Gaps are fine as long as the frame says so */
+        if ((info->sequence != *expected) && !(info->flags & USB2EPP_FRAME_DROPPED)) {
+                printf("Frame %u unexpected, %u is missing\n", info->sequence, *expected);
+                return 1;
+        }
+        if ((info->start > info->complete) || (info->complete > info->received)) {
+                printf("Frame %u has inconsistent timestamps\n", info->sequence);
+                return 1;
+        }
+
+        *expected = info->sequence + 1;
+        return 0;
+}
+
+static int stream_test(int usbfd)
+{
+        int rc, i, n;
+        long pagesize;
+        size_t size;
+        __u32 expected, head, tail;
+        unsigned long overruns;
+        struct usb2epp_ring *ring;
+        struct pollfd pfd;
+        struct iovec iov[2];
+
+        pagesize = sysconf(_SC_PAGESIZE);
+
+        /* A single record on demand */
+        rc = ioctl(usbfd, USB2EPP_IOCTL_RECORDS, 1);
+        if (rc != 0) {
+                perror("ioctl RECORDS");
+                return 1;
+        }
+        rc = read(usbfd, records, sizeof(records));
+        if (rc != sizeof(struct usb2epp_record)) {
+                printf("read returned %d, expected a single record\n", rc);
+                return 1;
+        }
+        expected = records[0].info.sequence;
+        if (check_sequence(&records[0].info, &expected) != 0)
+                return 1;
+
+        /* Map the control page to learn the ring geometry, then all of it */
+        ring = mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_SHARED, usbfd, 0);
+        if (ring == MAP_FAILED) {
+                perror("mmap");
+                return 1;
+        }
+        size = pagesize + ring->frames*ring->frame_size;
+        munmap(ring, pagesize);
+
+        ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, usbfd, 0);
+        if (ring == MAP_FAILED) {
+                perror("mmap");
+                return 1;
+        }
+
+        /* Streaming, drained by read() a few records at a time */
+        rc = ioctl(usbfd, USB2EPP_IOCTL_STREAM, 1);
+        if (rc != 0) {
+                perror("ioctl STREAM");
+                goto error;
+        }
+
+        expected = 0;
+        for (n = 0; n < STREAM_FRAMES; ) {
+                rc = read(usbfd, records, sizeof(records));
+                if ((rc <= 0) || (rc % sizeof(struct usb2epp_record) != 0)) {
+                        printf("read returned %d while streaming\n", rc);
+                        goto error;
+                }
+                for (i = 0; i < rc/(int)sizeof(struct usb2epp_record); i++, n++) {
+                        if (check_sequence(&records[i].info, &expected) != 0)
+                                goto error;
+                }
+        }
+
+        /* readv() waits for the first record only and stops at a buffer it
+         * can't fill up */
+        iov[0].iov_base = &records[0];
+        iov[0].iov_len = 2*sizeof(struct usb2epp_record);
+        iov[1].iov_base = &records[2];
+        iov[1].iov_len = 2*sizeof(struct usb2epp_record);
+        rc = readv(usbfd, iov, 2);
+        if ((rc <= 0) || (rc % sizeof(struct usb2epp_record) != 0)) {
+                printf("readv returned %d while streaming\n", rc);
+                goto error;
+        }
+        for (i = 0; i < rc/(int)sizeof(struct usb2epp_record); i++) {
+                if (check_sequence(&records[i].info, &expected) != 0)
+                        goto error;
+        }
+
+        /* Now consume frames in place */
+        pfd.fd = usbfd;
+        pfd.events = POLLIN;
+        for (n = 0; n < STREAM_FRAMES; ) {
+                rc = poll(&pfd, 1, 1000);
+                if ((rc != 1) || !(pfd.revents & POLLIN)) {
+                        printf("poll returned %d, revents 0x%x\n", rc, pfd.revents);
+                        goto error;
+                }
+
+                head = ring->head;
+                __sync_synchronize();
+                for (tail = ring->tail; tail != head; tail++, n++) {
+                        if (check_sequence(&ring->info[tail % ring->frames], &expected) != 0)
+                                goto error;
+                }
+
+                __sync_synchronize();
+                ring->tail = tail;
+        }
+
+        /* Leave the ring alone until it overflows */
+        overruns = 0;
+        for (i = 0; (i < 100) && (overruns == 0); i++) {
+                usleep(100000);
+                rc = ioctl(usbfd, USB2EPP_IOCTL_OVERRUNS, &overruns);
+                if (rc != 0) {
+                        perror("ioctl OVERRUNS");
+                        goto error;
+                }
+        }
+        if (overruns == 0) {
+                printf("Ring didn't overflow\n");
+                goto error;
+        }
+
+        /* Once the old frames are gone, the next one must tell about the
+         * loss */
+        for (i = 0; ; i++) {
+                rc = read(usbfd, records, sizeof(records[0]));
+                if (rc != sizeof(records[0])) {
+                        printf("read returned %d while streaming\n", rc);
+                        goto error;
+                }
+                if (records[0].info.flags & USB2EPP_FRAME_DROPPED)
+                        break;
+                if (i > (int)ring->frames) {
+                        printf("Frames lost without notice\n");
+                        goto error;
+                }
+        }
+
+        /* Back to scanning on demand */
+        rc = ioctl(usbfd, USB2EPP_IOCTL_STREAM, 0);
+        if (rc != 0) {
+                perror("ioctl STREAM");
+                goto error;
+        }
+        rc = read(usbfd, records, sizeof(records));
+        if (rc != sizeof(struct usb2epp_record)) {
+                printf("read returned %d, expected a single record\n", rc);
+                goto error;
+        }
+
+        printf("%d frames streamed, %lu overruns\n", 2*STREAM_FRAMES, overruns);
+        munmap(ring, size);
+        return 0;
+
+error:
+        ioctl(usbfd, USB2EPP_IOCTL_STREAM, 0);
+        munmap(ring, size);
+        return 1;
+}
+
 int main (int argc, char *argv[])
 {
         int rc;
         int i;
         int usbfd;
+        int streaming;
         size_t len;
         int buffer[2051];
         char buf[256];
@@ -26,23 +207,32 @@ int main (int argc, char *argv[])
         };
 
         if (argc <= 1) {
-                printf("Incorrect number of arguments\n");
+                printf("Usage: %s <device> [stream]\n", argv[0]);
                 return 1;
         }
 
-        usbfd = open(argv[1], O_RDONLY);
+        /* The ring is mapped writable, the consumer advances its tail */
+        streaming = (argc > 2) && (strcmp(argv[2], "stream") == 0);
+        usbfd = open(argv[1], streaming ? O_RDWR : O_RDONLY);
         if (usbfd < 0) {
                 perror("open");
                 return 1;
         }
 
-        rc = ioctl(usbfd, 0, 20);
+        rc = ioctl(usbfd, USB2EPP_IOCTL_RATE, 20);
         if (rc != 0) {
                 perror("ioctl");
                 close(usbfd);
                 return 1;
         }
 
+        /* Check the streaming interfaces instead of plotting a scan */
+        if (streaming) {
+                rc = stream_test(usbfd);
+                close(usbfd);
+                return rc;
+        }
+
         /* This is for the thesis presentation only, trigger the data generator once to
          * get a readout */
 #ifdef SHOWCASE
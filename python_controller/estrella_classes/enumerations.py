@@ -51,6 +51,8 @@ ESTRNOMEM = c_int(3)
 ESTRTIMEOUT = c_int(4)
 ESTRNOTIMPL = c_int(5)
 ESTRALREADY = c_int(6)
+ESTRBUSY = c_int(7)
+ESTRCANCEL = c_int(8)
 
 # values for enumeration 'estr_xtmode_t'
 ESTR_XTMODE_NORMAL = c_int(0)
@@ -76,6 +78,20 @@ ESTR_TEMPCOMP_OFF = c_int(0)
 ESTR_TEMPCOMP_ON = c_int(1)
 ESTR_TEMPCOMP_TYPES = c_int(2)
 
+# values for enumeration 'estr_avgmode_t'
+ESTR_AVGMODE_SEQUENTIAL = c_int(0)
+ESTR_AVGMODE_PIPELINED = c_int(1)
+ESTR_AVGMODE_TYPES = c_int(2)
+
 # values for enumeration 'estrella_devicetype_t'
 ESTRELLA_DEV_USB = c_int(0)
 ESTRELLA_DEV_LPT = c_int(1)
+ESTRELLA_DEV_SIM = c_int(2)
+
+# maximum number of peaks in a simulated spectrum
+ESTRELLA_SIM_PEAKS = c_int(4)
+
+# values for enumeration 'estr_simpeak_t'
+ESTR_SIMPEAK_GAUSS = c_int(0)
+ESTR_SIMPEAK_LORENTZ = c_int(1)
+ESTR_SIMPEAK_TYPES = c_int(2)
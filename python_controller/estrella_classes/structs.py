@@ -31,7 +31,7 @@
 # Python Controller, structures.
 # 
 
-from ctypes import c_ubyte, c_ushort, c_uint, c_int, c_char, c_char_p, c_void_p, c_size_t, Structure, Union, POINTER
+from ctypes import c_ubyte, c_ushort, c_uint, c_int, c_long, c_ulong, c_ulonglong, c_float, c_char, c_char_p, c_void_p, c_size_t, Structure, Union, POINTER
 
 #########################################
 # Specific enumetations for the Classes #
@@ -41,7 +41,9 @@ estr_xtmode_t = c_int
 estr_xtrate_t = c_int
 estr_xsmooth_t = c_int
 estr_tempcomp_t = c_int
+estr_avgmode_t = c_int
 estrella_devicetype_t = c_int
+estr_simpeak_t = c_int
 estr_lock_t = c_int
 
 ################################################
@@ -74,9 +76,25 @@ estrella_usbdev_t._fields_ = [('bus', c_char * 256),
                               ('product', c_char * 128),
                               ('serialnumber', c_char * 32),]
 
+class estr_simpeak_spec_t(Structure):
+	_fields_ = [('shape', estr_simpeak_t),
+	            ('position', c_float),
+	            ('width', c_float),
+	            ('height', c_float)]
+
+class estrella_simdev_t(Structure):
+	_fields_ = [('index', c_int),
+	            ('seed', c_ulong),
+	            ('dark', c_float),
+	            ('noise', c_float),
+	            ('trigger', c_int),
+	            ('peaks', c_int),
+	            ('peak', estr_simpeak_spec_t * 4)]
+
 class estrella_dev_t_u(Union):
 	pass
-estrella_dev_t_u._fields_ = [('usb', estrella_usbdev_t)]
+estrella_dev_t_u._fields_ = [('usb', estrella_usbdev_t),
+                             ('sim', estrella_simdev_t)]
 
 class estrella_dev_t(Structure):
 	pass
@@ -89,7 +107,54 @@ usb_dev_handle._fields_ = []
 
 class estrella_session_t_u(Union):
 	pass
-estrella_session_t_u._fields_ = [('usb_dev_handle', POINTER(usb_dev_handle))]
+estrella_session_t_u._fields_ = [('usb_dev_handle', POINTER(usb_dev_handle)),
+                                 ('sim', c_void_p)]
+
+class estr_waitpolicy_t(Structure):
+	_fields_ = [('guard', c_int),
+	            ('interval', c_int),
+	            ('maxinterval', c_int),
+	            ('backoff', c_int)]
+
+class estr_triggerwait_t(Structure):
+	_fields_ = [('timeout', c_int),
+	            ('maxinterval', c_int)]
+
+class estr_triggerstats_t(Structure):
+	_fields_ = [('triggers', c_ulong),
+	            ('timeouts', c_ulong),
+	            ('cancels', c_ulong),
+	            ('last', c_ulong),
+	            ('min', c_ulong),
+	            ('max', c_ulong),
+	            ('total', c_ulonglong)]
+
+class timespec(Structure):
+	_fields_ = [('tv_sec', c_long),
+	            ('tv_nsec', c_long)]
+
+class estr_frametime_t(Structure):
+	_fields_ = [('start', c_ulonglong),
+	            ('complete', c_ulonglong),
+	            ('received', c_ulonglong)]
+
+class estr_hist_t(Structure):
+	_fields_ = [('bucket', c_ulong * 24)]
+
+class estr_stats_t(Structure):
+	_fields_ = [('frames', c_ulong),
+	            ('timeouts', c_ulong),
+	            ('cancels', c_ulong),
+	            ('errors', c_ulong),
+	            ('polls', c_ulong),
+	            ('bulkbytes', c_ulonglong),
+	            ('start', estr_hist_t),
+	            ('wait', estr_hist_t),
+	            ('bulk', estr_hist_t)]
+
+class estrella_usbbuf_t(Structure):
+	_fields_ = [('setup', c_ubyte * 6),
+	            ('status', c_ubyte * 2)]
 
 class estrella_session_t(Structure):
 	pass
@@ -99,9 +164,23 @@ estrella_session_t._fields_ = [('rate', c_int),
                                ('xtrate', estr_xtrate_t),
                                ('xsmooth', estr_xsmooth_t),
                                ('tempcomp', estr_tempcomp_t),
+                               ('avgmode', estr_avgmode_t),
                                ('dev', estrella_dev_t),
                                ('spec', estrella_session_t_u),
-                               ('lock', estr_lock_t)]
+                               ('lock', estr_lock_t),
+                               ('usbbuf', estrella_usbbuf_t),
+                               ('stream', c_void_p),
+                               ('waitpolicy', estr_waitpolicy_t),
+                               ('scanstart', timespec),
+                               ('polls', c_ulong),
+                               ('totalpolls', c_ulong),
+                               ('triggerwait', estr_triggerwait_t),
+                               ('triggerstats', estr_triggerstats_t),
+                               ('lastbusy', timespec),
+                               ('cancels', c_ulong),
+                               ('cancelmark', c_ulong),
+                               ('frametime', estr_frametime_t),
+                               ('stats', estr_stats_t)]
 
 ###################################################
 # Structs for ESTRELLA USB Classes (python shape) #
@@ -27,10 +27,16 @@
 */
 
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "estrella.h"
 #include "estrella_usb.h"
+#include "estrella_sim.h"
 #include "estrella_private.h" 
+#include "estrella_registry.h"
+#include "estrella_firmware.h"
+#include "estrella_dsp.h"
 
 /* ######################################################################### */
 /*                            TODO / Notes                                   */
@@ -44,6 +50,19 @@
 /*                           Private interface (Module)                      */
 /* ######################################################################### */
 
+static int prv_async_result(estrella_session_t *session, float *buffer, uint16_t *raw);
+
+static void prv_clock_anchor_init(void);
+
+/* Realtime and monotonic clock, read at the same time once per process */
+static unsigned long long prv_anchor_realtime = 0;
+static unsigned long long prv_anchor_monotonic = 0;
+static int prv_anchor_rc = ESTRERR;
+static pthread_once_t prv_anchor_once = PTHREAD_ONCE_INIT;
+
+/* Half window width for every ESTR_XSMOOTH* setting */
+static const int prv_xsmooth_half[ESTR_XSMOOTH_TYPES] = {0, 2, 4, 8, 16};
+
 /* ######################################################################### */
 /*                           Implementation                                  */
 /* ######################################################################### */
@@ -52,43 +71,56 @@ int estrella_find_devices(dll_list_t *devices)
 {
     int rc;
 
-    /* Find USB connected devices and add the to the list */
-    rc = estrella_usb_find_devices(devices);
+    if (!devices)
+        return ESTRINV;
+
+    /* Rediscover devices and hand out a copy of the registry */
+    rc = estrella_registry_refresh();
     if (rc != ESTROK)
         return ESTRERR;
 
-    /* We might now try to find LPT devices... */
+    rc = estrella_registry_list(devices);
+    if (rc != ESTROK)
+        return rc;
 
     return ESTROK;
 }
 
-int estrella_num_devices(int *num)
+int estrella_upload_firmware(dll_list_t *reports)
 {
     int rc;
-    unsigned int listsize;
-    dll_list_t devices;
 
-    if (!num)
+    if (!reports)
         return ESTRINV;
 
-    rc = dll_init(&devices);
-    if (rc != EDLLOK)
-        return ESTRERR;
+    rc = estrella_usb_upload(reports);
 
-    rc = estrella_find_devices(&devices);
-    if (rc != ESTROK) {
-        dll_clear(&devices);
-        return ESTRERR;
-    }
+    /* Devices have probably reenumerated */
+    estrella_registry_invalidate();
 
-    rc = dll_count(&devices, &listsize);
-    if (rc != EDLLOK) {
-        dll_clear(&devices);
-        return ESTRERR;
-    }
+    return rc;
+}
 
-    *num = (int)listsize;
-    dll_clear(&devices);
+int estrella_firmware_image(const char *path)
+{
+    return estrella_fw_select(path);
+}
+
+int estrella_refresh_devices(void)
+{
+    return estrella_registry_refresh();
+}
+
+int estrella_num_devices(int *num)
+{
+    int rc;
+
+    if (!num)
+        return ESTRINV;
+
+    rc = estrella_registry_count(num);
+    if (rc != ESTROK)
+        return ESTRERR;
 
     return ESTROK;
 }
@@ -96,44 +128,46 @@ int estrella_num_devices(int *num)
 int estrella_get_device(estrella_dev_t *dev, int num)
 {
     int rc;
-    unsigned int listsize;
-    dll_list_t devices;
-    void *devtmp;
 
     if (!dev)
         return ESTRINV;
 
-    rc = dll_init(&devices);
-    if (rc != EDLLOK)
-        return ESTRERR;
+    rc = estrella_registry_get(dev, num);
 
-    rc = estrella_find_devices(&devices);
-    if (rc != ESTROK) {
-        dll_clear(&devices);
-        return ESTRERR;
-    }
+    /* A device might have been plugged in since the registry was built, so
+     * rediscover once before giving up. */
+    if (rc == ESTRINV) {
+        rc = estrella_registry_refresh();
+        if (rc != ESTROK)
+            return ESTRERR;
 
-    rc = dll_count(&devices, &listsize);
-    if (rc != EDLLOK) {
-        dll_clear(&devices);
-        return ESTRERR;
+        rc = estrella_registry_get(dev, num);
     }
 
-    if ((num >= (int)listsize) || (num < 0)) {
-        dll_clear(&devices);
+    return rc;
+}
+
+int estrella_get_device_by_serial(estrella_dev_t *dev, const char *serial)
+{
+    int rc;
+
+    if (!dev)
         return ESTRINV;
-    }
 
-    rc = dll_get(&devices, (void**)&devtmp, NULL, num);
-    if (rc != EDLLOK) {
-        dll_clear(&devices);
-        return ESTRERR;
-    }
+    if (!serial)
+        return ESTRINV;
 
-    memcpy(dev, (estrella_dev_t*)devtmp, sizeof(estrella_dev_t));
-    dll_clear(&devices);
+    rc = estrella_registry_serial(dev, serial);
 
-    return ESTROK;
+    if (rc == ESTRINV) {
+        rc = estrella_registry_refresh();
+        if (rc != ESTROK)
+            return ESTRERR;
+
+        rc = estrella_registry_serial(dev, serial);
+    }
+
+    return rc;
 }
 
 int estrella_init(estrella_session_t *session, estrella_dev_t *dev)
@@ -153,6 +187,8 @@ int estrella_init(estrella_session_t *session, estrella_dev_t *dev)
     /* Initialize device and session here */
     if (dev->devicetype == ESTRELLA_DEV_USB)
         rc = estrella_usb_init(session, dev);
+    else if (dev->devicetype == ESTRELLA_DEV_SIM)
+        rc = estrella_sim_init(session, dev);
     else
         rc = ESTRNOTIMPL;
 
@@ -168,6 +204,12 @@ int estrella_init(estrella_session_t *session, estrella_dev_t *dev)
     session->xsmooth = ESTR_XSMOOTH_NONE;
     session->tempcomp = ESTR_TEMPCOMP_OFF;
     session->xtmode = ESTR_XTMODE_NORMAL;
+    session->waitpolicy.guard = 5;
+    session->waitpolicy.interval = 500;
+    session->waitpolicy.maxinterval = 2000;
+    session->waitpolicy.backoff = 150;
+    session->triggerwait.timeout = -1;
+    session->triggerwait.maxinterval = 10000;
     estrella_unlock(&session->lock);
 
     return ESTROK;
@@ -180,11 +222,17 @@ int estrella_close(estrella_session_t *session)
     /* Some very basic sanity checking */
     if (!session)
         return ESTRINV;
+
+    /* Don't leave an acquisition thread behind */
+    if (session->stream)
+        estrella_stream_stop(session);
     
     /* Detach this session's device */
     if (session->dev.devicetype == ESTRELLA_DEV_USB)
         rc = estrella_usb_close(session);
-    else 
+    else if (session->dev.devicetype == ESTRELLA_DEV_SIM)
+        rc = estrella_sim_close(session);
+    else
         rc = ESTRNOTIMPL;
 
     if (rc == ESTRNOTIMPL)
@@ -208,6 +256,173 @@ int estrella_mode(estrella_session_t *session, estr_xtmode_t xtmode)
     return ESTROK;
 }
 
+int estrella_avgmode(estrella_session_t *session, estr_avgmode_t avgmode)
+{
+    if (!session)
+        return ESTRINV;
+
+    if ((avgmode >= ESTR_AVGMODE_TYPES) || (avgmode < 0))
+        return ESTRINV;
+
+    session->avgmode = avgmode;
+
+    return ESTROK;
+}
+
+int estrella_waitpolicy(estrella_session_t *session, const estr_waitpolicy_t *policy)
+{
+    if (!session)
+        return ESTRINV;
+
+    if (!policy)
+        return ESTRINV;
+
+    if ((policy->guard < 0) || (policy->guard > 65500))
+        return ESTRINV;
+
+    if ((policy->interval < 1) || (policy->interval > 1000*1000))
+        return ESTRINV;
+
+    if ((policy->maxinterval < policy->interval) || (policy->maxinterval > 1000*1000))
+        return ESTRINV;
+
+    if ((policy->backoff < 100) || (policy->backoff > 1000))
+        return ESTRINV;
+
+    memcpy(&session->waitpolicy, policy, sizeof(estr_waitpolicy_t));
+
+    return ESTROK;
+}
+
+int estrella_triggerwait(estrella_session_t *session, const estr_triggerwait_t *wait)
+{
+    if (!session)
+        return ESTRINV;
+
+    if (!wait)
+        return ESTRINV;
+
+    if (wait->timeout > 3600*1000)
+        return ESTRINV;
+
+    if ((wait->maxinterval < 1) || (wait->maxinterval > 1000*1000))
+        return ESTRINV;
+
+    memcpy(&session->triggerwait, wait, sizeof(estr_triggerwait_t));
+
+    return ESTROK;
+}
+
+int estrella_cancel(estrella_session_t *session)
+{
+    if (!session)
+        return ESTRINV;
+
+    /* Stays pending until a scan waiting for its data picks it up */
+    __atomic_add_fetch(&session->cancels, 1, __ATOMIC_SEQ_CST);
+
+    return ESTROK;
+}
+
+int estrella_trigger_stats(estrella_session_t *session, estr_triggerstats_t *stats, int reset)
+{
+    if (!session)
+        return ESTRINV;
+
+    if (!stats)
+        return ESTRINV;
+
+    memcpy(stats, &session->triggerstats, sizeof(estr_triggerstats_t));
+
+    if (reset)
+        memset(&session->triggerstats, 0, sizeof(estr_triggerstats_t));
+
+    return ESTROK;
+}
+
+void prv_clock_anchor_init(void)
+{
+    struct timespec mono1, real, mono2;
+
+    /* Take the monotonic time halfway between two readings, so both clocks
+     * are read at the same time as far as possible */
+    if ((clock_gettime(CLOCK_MONOTONIC, &mono1) != 0) ||
+        (clock_gettime(CLOCK_REALTIME, &real) != 0) ||
+        (clock_gettime(CLOCK_MONOTONIC, &mono2) != 0))
+        return;
+
+    prv_anchor_realtime = estrella_timestamp_ns(&real);
+    prv_anchor_monotonic = estrella_timestamp_ns(&mono1)/2 + estrella_timestamp_ns(&mono2)/2;
+    prv_anchor_rc = ESTROK;
+}
+
+int estrella_clock_anchor(unsigned long long *realtime, unsigned long long *monotonic)
+{
+    if (!realtime)
+        return ESTRINV;
+
+    if (!monotonic)
+        return ESTRINV;
+
+    pthread_once(&prv_anchor_once, prv_clock_anchor_init);
+    if (prv_anchor_rc != ESTROK)
+        return ESTRERR;
+
+    *realtime = prv_anchor_realtime;
+    *monotonic = prv_anchor_monotonic;
+
+    return ESTROK;
+}
+
+int estrella_stats_get(estrella_session_t *session, estr_stats_t *stats)
+{
+    if (!session)
+        return ESTRINV;
+
+    if (!stats)
+        return ESTRINV;
+
+    memcpy(stats, &session->stats, sizeof(estr_stats_t));
+
+    return ESTROK;
+}
+
+int estrella_stats_reset(estrella_session_t *session)
+{
+    if (!session)
+        return ESTRINV;
+
+    memset(&session->stats, 0, sizeof(estr_stats_t));
+
+    return ESTROK;
+}
+
+int estrella_frametime(estrella_session_t *session, estr_frametime_t *time)
+{
+    if (!session)
+        return ESTRINV;
+
+    if (!time)
+        return ESTRINV;
+
+    memcpy(time, &session->frametime, sizeof(estr_frametime_t));
+
+    return ESTROK;
+}
+
+int estrella_polls(estrella_session_t *session, unsigned long *last, unsigned long *total)
+{
+    if (!session)
+        return ESTRINV;
+
+    if (last)
+        *last = session->polls;
+    if (total)
+        *total = session->totalpolls;
+
+    return ESTROK;
+}
+
 int estrella_rate(estrella_session_t *session, int rate, estr_xtrate_t xtrate)
 {
     int rc;
@@ -224,11 +439,17 @@ int estrella_rate(estrella_session_t *session, int rate, estr_xtrate_t xtrate)
     if ((rate < 2) || (rate > 65500))
         return ESTRINV;
 
+    /* The acquisition thread owns the device while streaming */
+    if (session->stream)
+        return ESTRERR;
+
     /* Talk to the device and set the rate. In the original driver xtrate only
      * get's set when you set the rate. So we have created a compound command
      * here which makes sure the device knows about rate and xtrate at any time. */
     if (session->dev.devicetype == ESTRELLA_DEV_USB)
         rc = estrella_usb_rate(session, rate, xtrate);
+    else if (session->dev.devicetype == ESTRELLA_DEV_SIM)
+        rc = estrella_sim_rate(session, rate, xtrate);
     else
         rc = ESTRNOTIMPL;
 
@@ -251,49 +472,42 @@ int estrella_async_scan(estrella_session_t *session)
     if (!session)
         return ESTRINV;
 
-    /* If this session is locked another async scan is currently in progress */
-    if (estrella_islocked(&session->lock) == 1)
+    /* Lock this session until results have been fetched. If it is locked
+     * already another scan is currently in progress */
+    if (estrella_lock(&session->lock) != ESTROK)
         return ESTRERR;
 
-    if (session->dev.devicetype == ESTRELLA_DEV_USB)
-        rc = estrella_usb_scan_init(session);
-    else
-        rc = ESTRNOTIMPL;
+    rc = estrella_start(session);
+
+    /* There's nothing to fetch if the scan did not start */
+    if (rc != ESTROK)
+        estrella_unlock(&session->lock);
 
     if (rc == ESTRNOTIMPL)
         return rc;
     else if (rc != ESTROK)
         return ESTRERR;
 
-    /* Lock this session until results have been fetched */
-    estrella_lock(&session->lock);
-
     return ESTROK;
 }
 
-int estrella_async_result(estrella_session_t *session, float *buffer)
+int prv_async_result(estrella_session_t *session, float *buffer, uint16_t *raw)
 {
     int rc;
 
-    if (!session)
-        return ESTRINV;
-
-    if (!buffer)
-        return ESTRINV;
-
     /* If this session is not locked no async scan has been started */
     if (estrella_islocked(&session->lock) == 0)
         return ESTRERR;
 
-    if (session->dev.devicetype == ESTRELLA_DEV_USB) {
-        rc = estrella_usb_scan_result(session, buffer);
+    if (buffer)
+        rc = estrella_result(session, buffer);
+    else
+        rc = estrella_result_raw(session, raw);
 
-        /* No matter if success or error we need to unlock the session again */
-        estrella_unlock(&session->lock);
-    } else
-        rc = ESTRNOTIMPL;
+    /* No matter if success or error we need to unlock the session again */
+    estrella_unlock(&session->lock);
 
-    if (rc == ESTRNOTIMPL)
+    if ((rc == ESTRNOTIMPL) || (rc == ESTRTIMEOUT) || (rc == ESTRCANCEL))
         return rc;
     else if (rc != ESTROK)
         return ESTRERR;
@@ -301,58 +515,88 @@ int estrella_async_result(estrella_session_t *session, float *buffer)
     return ESTROK;
 }
 
-int estrella_scan(estrella_session_t *session, float *buffer)
+int estrella_async_result(estrella_session_t *session, float *buffer)
 {
-    int rc, i;
-    float tmpbuf[2051];
+    if (!session)
+        return ESTRINV;
 
-    /* TODO: xsmooth and tempcomp still need to be implemented */
+    if (!buffer)
+        return ESTRINV;
+
+    return prv_async_result(session, buffer, NULL);
+}
 
+int estrella_async_result_raw(estrella_session_t *session, uint16_t *buffer)
+{
     if (!session)
         return ESTRINV;
 
     if (!buffer)
         return ESTRINV;
 
+    return prv_async_result(session, NULL, buffer);
+}
+
+int estrella_scan(estrella_session_t *session, float *buffer)
+{
+    int rc, i, sum;
+    uint16_t raw[ESTRELLA_RAW_WORDS];
+    uint32_t acc[ESTRELLA_SAMPLES];
+    float dark;
+
+    if (!session)
+        return ESTRINV;
+
+    if (!buffer)
+        return ESTRINV;
+
+    /* Don't interfere with a running async scan or stream */
+    if (estrella_lock(&session->lock) != ESTROK)
+        return ESTRERR;
+
     rc = ESTROK;
 
-    /* Start a scan */
+    /* If we have to average across multiple scans, smooth or compensate the
+     * result the raw counts are summed up in integer and divided only once in
+     * the end. */
+    sum = ((session->scanstoavg > 1) ||
+           (session->xsmooth != ESTR_XSMOOTH_NONE) ||
+           (session->tempcomp != ESTR_TEMPCOMP_OFF));
+    if (sum)
+        memset(acc, 0, sizeof(acc));
+
     for (i=0;i<session->scanstoavg;i++) {
-        int j;
-        float *mybuf;
-
-        /* We ususally write to buffer directly, tmbbuf is only used if we have
-         * to average across multiple scans */
-        if (i == 0)
-            mybuf = buffer;
-        else
-            mybuf = tmpbuf;
-
-        if (session->dev.devicetype == ESTRELLA_DEV_USB) {
-            rc = estrella_usb_scan_init(session);
-            if (rc == ESTROK)
-                rc = estrella_usb_scan_result(session, mybuf);
-        } else
-            rc = ESTRNOTIMPL;
+        int pipelined = (session->avgmode == ESTR_AVGMODE_PIPELINED);
+
+        /* Start a scan, unless it is already running in pipelined mode */
+        if ((i == 0) || !pipelined)
+            rc = estrella_start(session);
+        if (rc == ESTROK)
+            rc = estrella_result_raw(session, raw);
 
         /* Break on error */
         if (rc != ESTROK)
             break;
 
-        /* No average handling on the first run */
-        if (i == 0)
-            continue;
+        /* The detector is idle as soon as its data has been read. Have it
+         * integrate the next frame while we're taking care of this one. */
+        if (pipelined && (i+1 < session->scanstoavg))
+            rc = estrella_start(session);
 
-        /* If we have to perform multiple scans the results are added to buffer.
-         * The averaging happens only when all scans are complete. Which of
-         * course poses a problem regarding the float value range. */
-        for (j=0;j<2051;j++)
-            buffer[j] += mybuf[j];
+        if (sum)
+            estrella_accumulate(acc, raw);
+
+        if (rc != ESTROK)
+            break;
     }
 
+    estrella_unlock(&session->lock);
+
     switch(rc) {
         case ESTRTIMEOUT:
             return rc;
+        case ESTRCANCEL:
+            return rc;
         case ESTRNOTIMPL:
             return rc;
         case ESTROK:
@@ -362,11 +606,56 @@ int estrella_scan(estrella_session_t *session, float *buffer)
             break;
     }
 
+    /* The dark level is taken off while averaging, no extra pass needed */
+    dark = 0.0;
+    if (session->tempcomp == ESTR_TEMPCOMP_ON)
+        dark = estrella_dark(acc, session->scanstoavg);
+
     /* Now check if we need to average or not. This is not necessary if there
-     * was only one scan to perform anyway. */
-    if (session->scanstoavg > 1)
-        for (i=0;i<2051;i++)
-            buffer[i] =  buffer[i]/(float)session->scanstoavg;
+     * was only one scan to perform anyway. Smoothing averages too. */
+    if (session->xsmooth != ESTR_XSMOOTH_NONE)
+        estrella_smooth(acc, session->scanstoavg, prv_xsmooth_half[session->xsmooth], dark, buffer);
+    else if (sum)
+        estrella_average(acc, session->scanstoavg, dark, buffer);
+    else
+        estrella_unpack(raw, buffer);
+
+    return ESTROK;
+}
+
+int estrella_scan_raw(estrella_session_t *session, uint16_t *buffer)
+{
+    int rc;
+
+    if (!session)
+        return ESTRINV;
+
+    if (!buffer)
+        return ESTRINV;
+
+    /* Don't interfere with a running async scan or stream */
+    if (estrella_lock(&session->lock) != ESTROK)
+        return ESTRERR;
+
+    rc = estrella_start(session);
+    if (rc == ESTROK)
+        rc = estrella_result_raw(session, buffer);
+
+    estrella_unlock(&session->lock);
+
+    switch(rc) {
+        case ESTRTIMEOUT:
+            return rc;
+        case ESTRCANCEL:
+            return rc;
+        case ESTRNOTIMPL:
+            return rc;
+        case ESTROK:
+            break;
+        default:
+            return ESTRERR;
+            break;
+    }
 
     return ESTROK;
 }
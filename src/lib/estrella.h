@@ -38,6 +38,9 @@
  * been written with Linux as a target OS in mind but porting to any libusb
  * supported platform should be easy. If it takes any effort at all.
  *
+ * Estrella can be built against either libusb-0.1 (the default) or the
+ * asynchronous libusb-1.0 API, see INSTALL.txt.
+ *
  * Estrella can only handle USB devices at the moment but should be easily
  * extensible to drive LPT connected equipment. Provided the IEEE-1284
  * communications protocol is known of course.
@@ -50,7 +53,9 @@
 #define _ESTRELLA_H
 
 #include <stddef.h>
-#include <usb.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <time.h>
 #include <dll_list.h>
 
 /* ######################################################################### */
@@ -73,6 +78,10 @@
 /* Maximum path string length */
 #define ESTRELLA_PATH_MAX   (256)
 
+/* Number of 16 bit words in a raw scan, a header word followed by 2047
+ * samples */
+#define ESTRELLA_RAW_WORDS  (2048)
+
 /* Library error codes */
 #define ESTROK              (0) 
 #define ESTRERR             (1)
@@ -81,11 +90,15 @@
 #define ESTRTIMEOUT         (4)
 #define ESTRNOTIMPL         (5)
 #define ESTRALREADY         (6)
+#define ESTRBUSY            (7)
+#define ESTRCANCEL          (8)
 
-/* This is not a thread safe locking mechanism but for our simple purposes
- * (locking sessions during async scans) it should be enough, at least for now
- * and for my purposes;) */
-typedef int estr_lock_t;
+/* Session lock, taken while a scan or stream is in progress. It is only ever
+ * accessed atomically. A mutex won't do here because an async scan may well
+ * be started and collected by different threads. */
+typedef struct {
+    int state;
+} estr_lock_t;
 
 /* NOTE: The *_TYPES entry must always be last in the following enums. */
 
@@ -113,6 +126,15 @@ typedef enum {
     ESTR_TEMPCOMP_TYPES
 } estr_tempcomp_t;
 
+/** Averaging across multiple scans. ESTR_AVGMODE_PIPELINED starts the next
+ * scan as soon as the data of the previous one has been read, while that data
+ * is still being processed. */
+typedef enum {
+    ESTR_AVGMODE_SEQUENTIAL = (0),
+    ESTR_AVGMODE_PIPELINED,
+    ESTR_AVGMODE_TYPES
+} estr_avgmode_t;
+
 /** Xtiming resolution parameters */
 typedef enum {
     ESTR_XRES_LOW         = (0),
@@ -121,14 +143,103 @@ typedef enum {
     ESTR_XRES_TYPES
 } estr_xtrate_t;
 
+/** Completion wait policy.
+ *
+ * The integration time is known in advance, so there is no point in asking the
+ * device whether it is done right after a scan has been started. Instead we
+ * sleep until 'guard' ms before the scan is expected to complete and only then
+ * start polling. The polling interval starts out at 'interval' us and grows by
+ * 'backoff' percent with every unsuccessful poll until it reaches
+ * 'maxinterval' us. In trigger mode the start of integration is unknown and
+ * polling starts right away. */
+typedef struct {
+    int guard;
+    int interval;
+    int maxinterval;
+    int backoff;
+} estr_waitpolicy_t;
+
+/** Trigger wait settings.
+ *
+ * In trigger mode a scan completes whenever the trigger pulse arrives. We give
+ * up after 'timeout' ms, negative values wait forever. Polling follows the
+ * completion wait policy but the interval keeps growing up to 'maxinterval'
+ * us, so an idle device waiting for its trigger costs next to nothing. The
+ * price is latency, data may sit on the device for up to 'maxinterval' us
+ * before we notice. */
+typedef struct {
+    int timeout;
+    int maxinterval;
+} estr_triggerwait_t;
+
+/** Trigger statistics, see estrella_trigger_stats().
+ *
+ * The latency is the time from the trigger pulse to the data being available
+ * to the caller. The pulse itself can't be observed, so this is an upper bound:
+ * the integration time plus the time since the last poll which found the
+ * device still waiting. Latencies are in us. */
+typedef struct {
+    unsigned long triggers;
+    unsigned long timeouts;
+    unsigned long cancels;
+    unsigned long last;
+    unsigned long min;
+    unsigned long max;
+    unsigned long long total;
+} estr_triggerstats_t;
+
+/** Timing of a single scan.
+ *
+ * All times are CLOCK_MONOTONIC in ns, so they don't jump when the system
+ * clock is adjusted. See estrella_clock_anchor() for getting wall clock time.
+ * 'start' is when the device acknowledged the start request, 'complete' when
+ * we found it done integrating and 'received' when the data was in. Fields are
+ * 0 if the scan didn't get that far. */
+typedef struct {
+    unsigned long long start;
+    unsigned long long complete;
+    unsigned long long received;
+} estr_frametime_t;
+
+/* Number of buckets of a latency histogram */
+#define ESTRELLA_HIST_BUCKETS   (24)
+
+/** Latency histogram.
+ *
+ * Bucket i counts latencies of 2^i to 2^(i+1)-1 us. Bucket 0 also holds
+ * everything below 1us, the last bucket everything beyond. */
+typedef struct {
+    unsigned long bucket[ESTRELLA_HIST_BUCKETS];
+} estr_hist_t;
+
+/** Performance counters of a session, see estrella_stats_get().
+ *
+ * 'start' is the time it takes to issue the scan start request, 'wait' the
+ * time from then on until the device reports completion and 'bulk' the time
+ * from completion until the data has been received. */
+typedef struct {
+    unsigned long frames;
+    unsigned long timeouts;
+    unsigned long cancels;
+    unsigned long errors;
+    unsigned long polls;
+    unsigned long long bulkbytes;
+    estr_hist_t start;
+    estr_hist_t wait;
+    estr_hist_t bulk;
+} estr_stats_t;
+
 /** Indicates the device type.
  *
  * Spectrometers may be connected to the computer through USB or the parallel
  * port. While at the moment this driver can only handle USB connected devices,
- * it should be fairly easy to implement IEEE-1284 EPP mode communications */
+ * it should be fairly easy to implement IEEE-1284 EPP mode communications.
+ * ESTRELLA_DEV_SIM is a device which only exists in software, see
+ * estrella_sim_device(). */
 typedef enum {
     ESTRELLA_DEV_USB,
-    ESTRELLA_DEV_LPT
+    ESTRELLA_DEV_LPT,
+    ESTRELLA_DEV_SIM
 } estrella_devicetype_t;
 
 /** USB device information. */
@@ -144,6 +255,48 @@ typedef struct {
     char serialnumber[32];
 } estrella_usbdev_t;
 
+/** Maximum number of peaks in a simulated spectrum */
+#define ESTRELLA_SIM_PEAKS      (4)
+
+/** Peak shapes of simulated spectra */
+typedef enum {
+    ESTR_SIMPEAK_GAUSS    = (0),
+    ESTR_SIMPEAK_LORENTZ,
+    ESTR_SIMPEAK_TYPES
+} estr_simpeak_t;
+
+/** A peak in a simulated spectrum.
+ *
+ * 'position' is the pixel the peak is centered on (0 being the first sample
+ * following the header word) and 'width' its full width at half maximum in
+ * pixels. 'height' is given in counts per ms of integration time, so peaks
+ * grow with the rate just like they do on real hardware. */
+typedef struct {
+    estr_simpeak_t shape;
+    float position;
+    float width;
+    float height;
+} estr_simpeak_spec_t;
+
+/** Simulated device information.
+ *
+ * Every sample reads 'dark' counts plus the peaks plus gaussian noise with a
+ * standard deviation of 'noise' counts. The first 16 samples are masked
+ * pixels, which temperature compensation reads the dark level from, and never
+ * see any peaks. 'seed' seeds the noise, so two sessions
+ * with the same seed produce the same spectra. In trigger mode integration
+ * starts on the next pulse of a free running trigger with a period of
+ * 'trigger' ms, 0 meaning that no trigger ever arrives. */
+typedef struct {
+    int index;
+    unsigned long seed;
+    float dark;
+    float noise;
+    int trigger;
+    int peaks;
+    estr_simpeak_spec_t peak[ESTRELLA_SIM_PEAKS];
+} estrella_simdev_t;
+
 /** Generic device information.
  *
  * This type encapsulates USB as well as EPP devices. */
@@ -151,10 +304,26 @@ typedef struct {
     estrella_devicetype_t devicetype;
     union {
         estrella_usbdev_t usb;
+        estrella_simdev_t sim;
         /* Add IEEE-1284 specifics here. */
     } spec;
 } estrella_dev_t;
 
+/* USB device handles. Which one is being used depends on the USB backend
+ * estrella has been built with (libusb-0.1 or libusb-1.0). */
+struct usb_dev_handle;
+struct estrella_usb1_s;
+
+/* Simulated device state */
+struct estrella_sim_s;
+
+/** Streaming state, opaque to the client. See estrella_stream_start(). */
+typedef struct estrella_stream_s estrella_stream_t;
+
+/** Synchronized acquisition group, opaque to the client. See
+ * estrella_group_create(). */
+typedef struct estrella_group_s estrella_group_t;
+
 /** Session type.
  *
  * A session is always associated with a specifc device and holds pretty much
@@ -166,17 +335,82 @@ typedef struct {
     estr_xtrate_t xtrate;
     estr_xsmooth_t xsmooth;
     estr_tempcomp_t tempcomp;
+    estr_avgmode_t avgmode;
 
     estrella_dev_t dev;
     union {
         struct usb_dev_handle *usb_dev_handle; 
+        struct estrella_usb1_s *usb1;
+        struct estrella_sim_s *sim;
         /* Add IEEE-1284 handle here */
     } spec;
 
     /* Used to lock sessions during asynchronous scannning operations */
     estr_lock_t lock;
+
+    /* USB request payloads. These live in the session rather than in static
+     * storage so that independent sessions can be driven from different
+     * threads. */
+    struct {
+        unsigned char setup[6];
+        unsigned char status[2];
+    } usbbuf;
+
+    /* Continuous acquisition state, NULL if no stream is running */
+    estrella_stream_t *stream;
+
+    /* Completion wait policy, start time of the current scan and the number
+     * of status polls it took to complete the last one and all scans so far */
+    estr_waitpolicy_t waitpolicy;
+    struct timespec scanstart;
+    unsigned long polls;
+    unsigned long totalpolls;
+
+    /* Trigger wait settings and statistics. lastbusy is the time of the last
+     * poll which found the device still busy. */
+    estr_triggerwait_t triggerwait;
+    estr_triggerstats_t triggerstats;
+    struct timespec lastbusy;
+
+    /* Cancellation requests, see estrella_cancel(). Requests up to
+     * 'cancelmark' have been dealt with, any beyond cancel the next wait. */
+    unsigned long cancels;
+    unsigned long cancelmark;
+
+    /* Timing of the last scan, see estrella_frametime() */
+    estr_frametime_t frametime;
+
+    /* Performance counters, see estrella_stats_get() */
+    estr_stats_t stats;
 } estrella_session_t;
 
+/** A single frame delivered by a stream.
+ *
+ * The sequence number is incremented with every scan the acquisition thread
+ * performs. Frames which had to be dropped (see estrella_stream_status()) leave
+ * a gap in the sequence. The timestamp is the wall clock time the data was
+ * received, 'time' has the details. */
+typedef struct {
+    unsigned long sequence;
+    struct timeval timestamp;
+    estr_frametime_t time;
+    float data[2051];
+} estrella_frame_t;
+
+/** Result of a firmware upload to a single device */
+typedef struct {
+    /** Bus and device number of the device before reenumeration */
+    char bus[ESTRELLA_PATH_MAX];
+    unsigned char devnum;
+    /** ESTROK if the firmware has been uploaded successfully */
+    int result;
+    /** Index of the failed upload request, -1 if none or opening the device
+     * failed */
+    int failed;
+    /** Time taken (ms) */
+    unsigned long elapsed;
+} estrella_upload_t;
+
 /* ######################################################################### */
 /*                           Public interface                                */
 /* ######################################################################### */
@@ -198,12 +432,55 @@ typedef struct {
  */
 int estrella_find_devices(dll_list_t *devices);
 
+/** Upload firmware to uninitialized devices
+ *
+ * estrella_find_devices() does this transparently but doesn't tell about
+ * failures. Uploads to several devices run concurrently. Once all of them are
+ * done we wait for the devices to reenumerate and the device registry is
+ * refreshed on the next lookup.
+ *
+ * @param reports       An initialized dll_list_t which is to be populated with
+ *                      one estrella_upload_t per device which needed firmware
+ *
+ * @return ESTROK       No errors occured, see reports for individual results
+ * @return ESTRINV      Invalid parameter
+ * @return ESTRNOMEM    Out of memory
+ * @return ESTRERR      Device discovery failed
+ */
+int estrella_upload_firmware(dll_list_t *reports);
+
+/** Select the firmware image for uploads
+ *
+ * By default the image built into the library is used. Any Intel HEX image
+ * suitable for fxload can be used instead.
+ *
+ * @param path          Intel HEX file, NULL to revert to the built in image
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRERR      Unable to read the file
+ * @return ESTRNOMEM    Out of memory
+ * @return ESTRINV      Malformed file
+ * @return ESTRNOTIMPL  Unsupported record type
+ */
+int estrella_firmware_image(const char *path);
+
+/** Rediscover devices connected to the host
+ *
+ * Device lookups are served from a registry which is built on first use. Call
+ * this after devices have been plugged in or removed. Devices which are
+ * already known are not opened again, so this is cheap even with many
+ * detectors connected. estrella_find_devices() implies a refresh.
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRERR      Device discovery failed
+ */
+int estrella_refresh_devices(void);
+
 /** Find out about the number of spectrometer devices in the system
  *
- * This function basically just calls estrella_find_devices() and returns the
- * size of the list. It's provided for convenience in environments where it's
- * difficult to handle dll_list_t items. In regular C/C++ code we should be
- * using estrella_find_devices() to minimize overhead.
+ * Returns the size of the device registry without rescanning the busses. It's
+ * provided for convenience in environments where it's difficult to handle
+ * dll_list_t items.
  *
  * @param num           Returns the number of devices found
  *
@@ -215,19 +492,53 @@ int estrella_num_devices(int *num);
 
 /** Get a device
  *
- * Like estrella_num_devices() this is just a convenience function. It calls
- * estrella_find_devices() under the hood and returns device 'num' from the list.
+ * Like estrella_num_devices() this is just a convenience function. It returns
+ * device 'num' from the device registry. If there is no such device the
+ * registry is refreshed once before giving up.
  *
  * @param dev           Pointer to an estrella_device_t struct which is to be
  *                      populated with device information
  * @param num           The requested device number
  *
  * @return ESTROK       No errors occured
- * @return ESTRINV      Invalid parameter
- * @return ESTRERR      Device not found
+ * @return ESTRINV      Invalid parameter or no such device
+ * @return ESTRERR      Device discovery failed
  */
 int estrella_get_device(estrella_dev_t *dev, int num);
 
+/** Get a device by its serial number
+ *
+ * Device numbers depend on enumeration order, serial numbers don't. If there
+ * is no such device the registry is refreshed once before giving up.
+ *
+ * @param dev           Pointer to an estrella_device_t struct which is to be
+ *                      populated with device information
+ * @param serial        Serial number as in estrella_usbdev_t
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      Invalid parameter or no such device
+ * @return ESTRERR      Device discovery failed
+ */
+int estrella_get_device_by_serial(estrella_dev_t *dev, const char *serial);
+
+/** Describe a simulated device
+ *
+ * Simulated devices are not part of the device registry. This populates 'dev'
+ * with a default configuration: a couple of peaks on top of a dark level and
+ * some noise. Adjust dev->spec.sim as needed before passing it to
+ * estrella_init(). Sessions on simulated devices behave like sessions on real
+ * ones, including integration timing, trigger mode and streaming, which makes
+ * them useful for benchmarks and tests on machines without a spectrometer.
+ *
+ * @param dev           Pointer to an estrella_device_t struct which is to be
+ *                      populated with device information
+ * @param index         Device index, also used to derive the noise seed
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ */
+int estrella_sim_device(estrella_dev_t *dev, int index);
+
 /** Initialize a session on a device
  *
  * 'Session' is pretty much what 'channel' is for the windows driver. At least
@@ -275,7 +586,7 @@ int estrella_close(estrella_session_t *session);
  *
  * @return ESTROK       No errors occured
  * @return ESTRINV      A supplied input argument is invalid
- * @return ESTRERR      Could not set rate
+ * @return ESTRERR      Could not set rate or a stream is running
  * @return ESTRNOTIMPL  Function has not been implemented for this device
  */
 int estrella_rate(estrella_session_t *session, int rate, estr_xtrate_t xtrate);
@@ -285,7 +596,8 @@ int estrella_rate(estrella_session_t *session, int rate, estr_xtrate_t xtrate);
  * In normal operation mode estrella_scan() will return ESTRTIMEOUT if it does not
  * receive any reply from the spectrometer device in time. When controlling
  * operations using a trigger input estrella will wait until it receives any
- * data from the device, no matter how long that might take.
+ * data from the device, unless estrella_triggerwait() sets a timeout or the
+ * wait is cut short with estrella_cancel().
  *
  * The manufacturer's documentation on this topic is rather sparse. This is what
  * I know:
@@ -303,6 +615,150 @@ int estrella_rate(estrella_session_t *session, int rate, estr_xtrate_t xtrate);
  */
 int estrella_mode(estrella_session_t *session, estr_xtmode_t xtmode);
 
+/** Set the averaging mode
+ *
+ * Only matters if estrella_update() has been told to average across multiple
+ * scans. In ESTR_AVGMODE_PIPELINED the device is told to start integrating the
+ * next frame right after the previous one has been read, the host processes
+ * data meanwhile. The default is ESTR_AVGMODE_SEQUENTIAL where every scan is
+ * completely processed before the next one is started.
+ *
+ * The time saved per frame is the host side processing time of a frame, which
+ * is small with integer accumulation. test/estrella_avg_bench compares both.
+ *
+ * @param session       Session
+ * @param avgmode       ESTR_AVGMODE_SEQUENTIAL or ESTR_AVGMODE_PIPELINED
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ */
+int estrella_avgmode(estrella_session_t *session, estr_avgmode_t avgmode);
+
+/** Set the completion wait policy
+ *
+ * Controls how estrella_scan() and estrella_async_result() wait for the device
+ * to finish integrating, see estr_waitpolicy_t. The defaults start polling 5ms
+ * before the end of integration every 500us, backing off by 50% up to 2ms.
+ *
+ * @param session       Session
+ * @param policy        The new policy. 'guard' must be 0-65500 ms, 'interval'
+ *                      1-1000000 us, 'maxinterval' no less than 'interval' and
+ *                      at most 1000000 us, 'backoff' 100-1000 percent.
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ */
+int estrella_waitpolicy(estrella_session_t *session, const estr_waitpolicy_t *policy);
+
+/** Set the trigger wait settings
+ *
+ * Controls how long and how often estrella_scan() and estrella_async_result()
+ * poll for the trigger pulse in ESTR_XTMODE_TRIGGER, see estr_triggerwait_t.
+ * The defaults wait forever and back off up to 10ms between polls.
+ *
+ * @param session       Session
+ * @param wait          The new settings. 'timeout' must be negative or 0-3600000
+ *                      ms, 'maxinterval' 1-1000000 us.
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ */
+int estrella_triggerwait(estrella_session_t *session, const estr_triggerwait_t *wait);
+
+/** Cancel waiting for a scan
+ *
+ * May be called from any thread. A scan waiting for its trigger or for the
+ * device to complete gives up within a polling interval and returns
+ * ESTRCANCEL. If no scan is in progress the request is held back and cancels
+ * the next scan as soon as it has to wait, so a scan started on another thread
+ * is cancelled no matter which of the two calls comes first. Requests
+ * made while a scan is running never carry over to the scans after it.
+ *
+ * @param session       Session
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ */
+int estrella_cancel(estrella_session_t *session);
+
+/** Get trigger statistics
+ *
+ * Counts the scans completed, timed out and cancelled in trigger mode along
+ * with their latencies, see estr_triggerstats_t.
+ *
+ * @param session       Session
+ * @param stats         Returns the statistics
+ * @param reset         Start over after reading if non-zero
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ */
+int estrella_trigger_stats(estrella_session_t *session, estr_triggerstats_t *stats, int reset);
+
+/** Get the timing of the last scan
+ *
+ * For averaged scans this is the last of the scans. Frames delivered by a
+ * stream carry their own timing.
+ *
+ * @param session       Session
+ * @param time          Returns the timing, see estr_frametime_t
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ */
+int estrella_frametime(estrella_session_t *session, estr_frametime_t *time);
+
+/** Get the performance counters of a session
+ *
+ * Counts every scan the session performs, including those of streams and
+ * groups. The counters are updated by whichever thread scans and are not
+ * read atomically, so take them while the session is idle for exact figures.
+ *
+ * @param session       Session
+ * @param stats         Returns the counters, see estr_stats_t
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ */
+int estrella_stats_get(estrella_session_t *session, estr_stats_t *stats);
+
+/** Reset the performance counters of a session
+ *
+ * @param session       Session
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ */
+int estrella_stats_reset(estrella_session_t *session);
+
+/** Relate library time to wall clock time
+ *
+ * Returns a pair of readings of CLOCK_REALTIME and CLOCK_MONOTONIC taken at
+ * the same time, once per process. A monotonic time t from estr_frametime_t
+ * corresponds to the wall clock time realtime + (t - monotonic).
+ *
+ * @param realtime      Returns the CLOCK_REALTIME reading in ns since the epoch
+ * @param monotonic     Returns the CLOCK_MONOTONIC reading in ns
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ * @return ESTRERR      The clocks could not be read
+ */
+int estrella_clock_anchor(unsigned long long *realtime, unsigned long long *monotonic);
+
+/** Get the number of status polls spent waiting for scans to complete
+ *
+ * @param session       Session
+ * @param last          Returns the number of polls the last scan took. May be
+ *                      NULL.
+ * @param total         Returns the number of polls since the session has been
+ *                      initialized. May be NULL.
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ */
+int estrella_polls(estrella_session_t *session, unsigned long *last, unsigned long *total);
+
 /** Acquire a spectral scan
  *
  * @param session       Session
@@ -310,12 +766,34 @@ int estrella_mode(estrella_session_t *session, estr_xtmode_t xtmode);
  *
  * @return ESTROK       No errors occured
  * @return ESTRINV      A supplied input argument is invalid
- * @return ESTRTIMEOUT  Scan timed out (in normal operations mode)
+ * @return ESTRTIMEOUT  Scan timed out, in trigger mode only if the trigger wait
+ *                      has a timeout
+ * @return ESTRCANCEL   Cancelled by estrella_cancel()
  * @return ESTRNOTIMPL  Function has not been implemented for this device
- * @return ESTRERR      Scan failed
+ * @return ESTRERR      Scan failed or an async scan/stream is in progress
  */
 int estrella_scan(estrella_session_t *session, float *buffer);
 
+/** Acquire a raw spectral scan
+ *
+ * Delivers the 16 bit detector counts in host byte order without converting
+ * them to float. Element 0 is the header word estrella_scan() leaves out,
+ * elements 1 to 2047 are what estrella_scan() returns in 0 to 2046. No
+ * averaging or any other processing is done, scanstoavg is ignored.
+ *
+ * @param session       Session
+ * @param buffer        Array of uint16_t, ESTRELLA_RAW_WORDS elements wide
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ * @return ESTRTIMEOUT  Scan timed out, in trigger mode only if the trigger wait
+ *                      has a timeout
+ * @return ESTRCANCEL   Cancelled by estrella_cancel()
+ * @return ESTRNOTIMPL  Function has not been implemented for this device
+ * @return ESTRERR      Scan failed or an async scan/stream is in progress
+ */
+int estrella_scan_raw(estrella_session_t *session, uint16_t *buffer);
+
 /** Acquire a spectral scan asynchronously
  *
  * estrella_async_scan() will just tell the spectrometer to start scanning but
@@ -349,15 +827,39 @@ int estrella_async_scan(estrella_session_t *session);
  *
  * @return ESTROK       No errors occured
  * @return ESTRINV      A supplied input argument is invalid
- * @return ESTRTIMEOUT  Scan timed out (in normal operations mode)
+ * @return ESTRTIMEOUT  Scan timed out, in trigger mode only if the trigger wait
+ *                      has a timeout
+ * @return ESTRCANCEL   Cancelled by estrella_cancel()
  * @return ESTRNOTIMPL  Operation has not been implemented for this device
  * @return ESTRERR      Scan failed
  */
 int estrella_async_result(estrella_session_t *session, float *buffer);
 
+/** Query raw results for an asynchronously started scan
+ *
+ * Like estrella_async_result() but delivers the detector counts as they are,
+ * see estrella_scan_raw().
+ *
+ * @param session       Session
+ * @param buffer        Array of uint16_t, ESTRELLA_RAW_WORDS elements wide
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ * @return ESTRTIMEOUT  Scan timed out, in trigger mode only if the trigger wait
+ *                      has a timeout
+ * @return ESTRCANCEL   Cancelled by estrella_cancel()
+ * @return ESTRNOTIMPL  Operation has not been implemented for this device
+ * @return ESTRERR      Scan failed
+ */
+int estrella_async_result_raw(estrella_session_t *session, uint16_t *buffer);
+
 /** Set data processing configuration
  *
- * TODO: xsmoothing and temperature compensation have not yet been implemented
+ * Averaging, smoothing and temperature compensation apply to estrella_scan()
+ * only. Smoothing is a boxcar filter across ESTR_XSMOOTH* pixels, near the
+ * edges of the array the window shrinks to the pixels available. Temperature
+ * compensation subtracts the mean of the optically masked pixels at the start
+ * of the array from every sample, results may become negative.
  *
  * @oaram session       Session
  * @param scanstoavg    Scans to perform and average (1-99)
@@ -369,5 +871,188 @@ int estrella_async_result(estrella_session_t *session, float *buffer);
  */
 int estrella_update(estrella_session_t *session, int scanstoavg, estr_xsmooth_t xsmooth, estr_tempcomp_t tempcomp);
 
+/** Start continuous acquisition
+ *
+ * Spawns an acquisition thread which keeps the detector busy with back to back
+ * scans. Results are written straight into frames of a preallocated pool of
+ * 'frames' frames and queued up for the consumer. The next scan is being
+ * started as soon as the data of the previous one has been fetched from the
+ * device, before the frame is handed to the consumer.
+ *
+ * The queue is a single producer/single consumer ring, so only one thread
+ * should be calling estrella_stream_read() or estrella_frame_acquire() for a
+ * given session. Frames stay out of the pool while they are queued or leased.
+ * If there is no free frame when a scan completes the scan is dropped and
+ * counted as an overrun.
+ *
+ * The session is locked while the stream is running, estrella_scan(),
+ * estrella_async_scan() and estrella_rate() will fail until
+ * estrella_stream_stop() has been called. No averaging is being performed on
+ * streamed frames.
+ *
+ * @param session       Session
+ * @param frames        Number of frames the ring can hold (>= 2)
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ * @return ESTRALREADY  A stream or async scan is already running on this session
+ * @return ESTRNOMEM    Couldn't allocate the frame ring
+ * @return ESTRNOTIMPL  Function has not been implemented for this device
+ * @return ESTRERR      Failed to start acquisition
+ */
+int estrella_stream_start(estrella_session_t *session, int frames);
+
+/** Fetch the oldest frame from a running stream
+ *
+ * @param session       Session
+ * @param frame         Frame to be filled
+ * @param timeout       Time in ms to wait for a frame if none is available. Pass
+ *                      0 to return immediately, negative values wait forever.
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid or no stream is
+ *                      running on this session, or it was stopped meanwhile
+ * @return ESTRTIMEOUT  No frame became available in time
+ * @return ESTRBUSY     All frames of the pool are leased, see
+ *                      estrella_frame_acquire()
+ * @return ESTRERR      Acquisition has stopped due to a device error
+ */
+int estrella_stream_read(estrella_session_t *session, estrella_frame_t *frame, int timeout);
+
+/** Lease the oldest frame from a running stream
+ *
+ * Like estrella_stream_read() but without copying. The frame is handed out as
+ * it is in the pool along with a single reference. It stays valid and
+ * untouched until the last reference has been dropped with
+ * estrella_frame_release(), even beyond estrella_stream_stop(). Stages which
+ * keep the frame around take a reference of their own with
+ * estrella_frame_retain().
+ *
+ * Leased frames are not available to the acquisition thread. Once clients hold
+ * all frames of the pool ESTRBUSY is returned right away, since no frame could
+ * ever arrive before some are released.
+ *
+ * @param session       Session
+ * @param frame         Returns the frame
+ * @param timeout       Time in ms to wait for a frame if none is available. Pass
+ *                      0 to return immediately, negative values wait forever.
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid or no stream is
+ *                      running on this session, or it was stopped meanwhile
+ * @return ESTRTIMEOUT  No frame became available in time
+ * @return ESTRBUSY     All frames of the pool are leased
+ * @return ESTRERR      Acquisition has stopped due to a device error
+ */
+int estrella_frame_acquire(estrella_session_t *session, estrella_frame_t **frame, int timeout);
+
+/** Take an additional reference to a leased frame
+ *
+ * @param frame         Frame obtained from estrella_frame_acquire()
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ */
+int estrella_frame_retain(estrella_frame_t *frame);
+
+/** Drop a reference to a leased frame
+ *
+ * The frame goes back to the pool once the last reference is gone and must
+ * not be touched anymore.
+ *
+ * @param frame         Frame obtained from estrella_frame_acquire()
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ */
+int estrella_frame_release(estrella_frame_t *frame);
+
+/** Query stream health
+ *
+ * @param session       Session
+ * @param overruns      Returns the number of frames dropped because the ring
+ *                      was full. May be NULL.
+ * @param timeouts      Returns the number of scans that timed out. May be NULL.
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid or no stream is
+ *                      running on this session
+ */
+int estrella_stream_status(estrella_session_t *session, unsigned long *overruns, unsigned long *timeouts);
+
+/** Stop continuous acquisition
+ *
+ * Waits for the acquisition thread to finish the scan in progress and unlocks
+ * the session. Frames not yet read are discarded, clients waiting for a frame
+ * on other threads give up with ESTRINV. The frame pool is freed once all
+ * leased frames have been released.
+ *
+ * @param session       Session
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid or no stream is
+ *                      running on this session
+ */
+int estrella_stream_stop(estrella_session_t *session);
+
+/** Create a synchronized acquisition group
+ *
+ * A group scans with several devices at the same time, for instance to have
+ * them sample the same event. Every session of the group is driven by a thread
+ * of its own, so the scan start requests of all devices are issued in
+ * parallel instead of one USB round trip after the other.
+ *
+ * The sessions must stay open while the group exists. Settings such as rate
+ * and mode are taken from the sessions as they are at the time of the scan.
+ *
+ * @param group         Returns the group
+ * @param sessions      Array of 'count' initialized sessions, each of them at
+ *                      most once
+ * @param count         Number of sessions (>= 1)
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ * @return ESTRNOMEM    Out of memory
+ * @return ESTRERR      Failed to start the group's threads
+ */
+int estrella_group_create(estrella_group_t **group, estrella_session_t **sessions, int count);
+
+/** Scan with all devices of a group
+ *
+ * Starts a scan on every session of the group at the same time and waits for
+ * all of them to complete. Like with streams no averaging is being performed.
+ * All sessions are locked during the scan.
+ *
+ * The start spread is the time between the first and the last device
+ * acknowledging its start request, as far as the host can tell. Only sessions
+ * which completed their scan are taken into account.
+ *
+ * @param group         Group
+ * @param buffers       Array of result buffers, one array of 2051 floats per
+ *                      session in the order the sessions have been passed to
+ *                      estrella_group_create()
+ * @param results       Returns the result of every session's scan, ESTROK,
+ *                      ESTRTIMEOUT, ESTRCANCEL, ESTRNOTIMPL or another error
+ *                      code. May be NULL.
+ * @param spread        Returns the start spread in us. May be NULL.
+ *
+ * @return ESTROK       All scans completed
+ * @return ESTRINV      A supplied input argument is invalid
+ * @return ESTRERR      A session was busy or at least one scan failed, see
+ *                      'results'
+ */
+int estrella_group_scan(estrella_group_t *group, float **buffers, int *results, unsigned long *spread);
+
+/** Destroy a synchronized acquisition group
+ *
+ * Stops the group's threads. The sessions are left open.
+ *
+ * @param group         Group
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid
+ */
+int estrella_group_destroy(estrella_group_t *group);
+
 #endif /* _ESTRELLA_H */
 
@@ -0,0 +1,425 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+#include <pthread.h>
+
+#include "estrella.h"
+#include "estrella_private.h"
+#include "estrella_dsp.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PRV_X86
+#include <immintrin.h>
+#endif
+
+/* ######################################################################### */
+/*                            TODO / Notes                                   */
+/* ######################################################################### */
+
+/* ######################################################################### */
+/*                            Types & Defines                                */
+/* ######################################################################### */
+
+/* ######################################################################### */
+/*                           Private interface (Module)                      */
+/* ######################################################################### */
+
+static void prv_dsp_init(void);
+static void prv_unpack_tail(const uint16_t *raw, float *buffer, int from);
+static void prv_accumulate_tail(uint32_t *acc, const uint16_t *raw, int from);
+static void prv_average_tail(const uint32_t *acc, int count, float dark, float *buffer, int from);
+static void prv_smooth_prepare(const uint32_t *acc, int count, int half, float dark, float *buffer, uint32_t *prefix);
+static void prv_smooth_tail(const uint32_t *prefix, double div, int half, float dark, float *buffer, int from);
+
+static void prv_unpack_scalar(const uint16_t *raw, float *buffer);
+static void prv_accumulate_scalar(uint32_t *acc, const uint16_t *raw);
+static void prv_average_scalar(const uint32_t *acc, int count, float dark, float *buffer);
+static void prv_smooth_scalar(const uint32_t *acc, int count, int half, float dark, float *buffer);
+
+#ifdef PRV_X86
+static void prv_unpack_sse2(const uint16_t *raw, float *buffer);
+static void prv_accumulate_sse2(uint32_t *acc, const uint16_t *raw);
+static void prv_average_sse2(const uint32_t *acc, int count, float dark, float *buffer);
+static void prv_smooth_sse2(const uint32_t *acc, int count, int half, float dark, float *buffer);
+static void prv_unpack_avx2(const uint16_t *raw, float *buffer);
+static void prv_accumulate_avx2(uint32_t *acc, const uint16_t *raw);
+static void prv_average_avx2(const uint32_t *acc, int count, float dark, float *buffer);
+static void prv_smooth_avx2(const uint32_t *acc, int count, int half, float dark, float *buffer);
+#endif
+
+static const estrella_dsp_t prv_dsp_scalar = {
+    prv_unpack_scalar, prv_accumulate_scalar, prv_average_scalar,
+    prv_smooth_scalar};
+
+#ifdef PRV_X86
+static const estrella_dsp_t prv_dsp_sse2 = {
+    prv_unpack_sse2, prv_accumulate_sse2, prv_average_sse2,
+    prv_smooth_sse2};
+static const estrella_dsp_t prv_dsp_avx2 = {
+    prv_unpack_avx2, prv_accumulate_avx2, prv_average_avx2,
+    prv_smooth_avx2};
+#endif
+
+/* Kernels are selected once according to what the CPU supports */
+static pthread_once_t prv_dsp_once = PTHREAD_ONCE_INIT;
+static const estrella_dsp_t *prv_dsp = &prv_dsp_scalar;
+
+/* ######################################################################### */
+/*                           Implementation                                  */
+/* ######################################################################### */
+
+void prv_dsp_init(void)
+{
+#ifdef PRV_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        prv_dsp = &prv_dsp_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        prv_dsp = &prv_dsp_sse2;
+#endif
+}
+
+/* The scalar versions double as the tails of the vectorized kernels, 'from'
+ * is the first sample they handle */
+void prv_unpack_tail(const uint16_t *raw, float *buffer, int from)
+{
+    int i;
+
+    for (i=from;i<ESTRELLA_SAMPLES;i++)
+        buffer[i] = (float)raw[i+1];
+
+    for (i=ESTRELLA_SAMPLES;i<ESTRELLA_RESULT_SIZE;i++)
+        buffer[i] = 0.0;
+}
+
+void prv_accumulate_tail(uint32_t *acc, const uint16_t *raw, int from)
+{
+    int i;
+
+    for (i=from;i<ESTRELLA_SAMPLES;i++)
+        acc[i] += raw[i+1];
+}
+
+void prv_average_tail(const uint32_t *acc, int count, float dark, float *buffer, int from)
+{
+    int i;
+
+    for (i=from;i<ESTRELLA_SAMPLES;i++)
+        buffer[i] = (float)acc[i]/(float)count - dark;
+
+    for (i=ESTRELLA_SAMPLES;i<ESTRELLA_RESULT_SIZE;i++)
+        buffer[i] = 0.0;
+}
+
+/* Builds the prefix sums and handles the edges where the window shrinks.
+ * prefix[k] is the sum of samples 0 to k-1. It will wrap around for large
+ * sums, but the difference of two prefix sums is still right as long as the
+ * sum of a window fits into 32 bits, which it does by far. */
+void prv_smooth_prepare(const uint32_t *acc, int count, int half, float dark, float *buffer, uint32_t *prefix)
+{
+    int i;
+
+    prefix[0] = 0;
+    for (i=0;i<ESTRELLA_SAMPLES;i++)
+        prefix[i+1] = prefix[i] + acc[i];
+
+    for (i=0;i<ESTRELLA_SAMPLES;i++) {
+        int lo, hi;
+
+        /* Skip the middle part, that's what the kernels do */
+        if (i == half)
+            i = ESTRELLA_SAMPLES-half;
+
+        lo = (i-half < 0) ? 0 : i-half;
+        hi = (i+half >= ESTRELLA_SAMPLES) ? ESTRELLA_SAMPLES-1 : i+half;
+
+        buffer[i] = (float)((double)(prefix[hi+1] - prefix[lo])/((double)count*(hi-lo+1))) - dark;
+    }
+
+    for (i=ESTRELLA_SAMPLES;i<ESTRELLA_RESULT_SIZE;i++)
+        buffer[i] = 0.0;
+}
+
+/* Full windows from sample 'from' up to ESTRELLA_SAMPLES-half */
+void prv_smooth_tail(const uint32_t *prefix, double div, int half, float dark, float *buffer, int from)
+{
+    int i;
+
+    for (i=from;i<ESTRELLA_SAMPLES-half;i++)
+        buffer[i] = (float)((double)(prefix[i+half+1] - prefix[i-half])/div) - dark;
+}
+
+void prv_unpack_scalar(const uint16_t *raw, float *buffer)
+{
+    prv_unpack_tail(raw, buffer, 0);
+}
+
+void prv_accumulate_scalar(uint32_t *acc, const uint16_t *raw)
+{
+    prv_accumulate_tail(acc, raw, 0);
+}
+
+void prv_average_scalar(const uint32_t *acc, int count, float dark, float *buffer)
+{
+    prv_average_tail(acc, count, dark, buffer, 0);
+}
+
+void prv_smooth_scalar(const uint32_t *acc, int count, int half, float dark, float *buffer)
+{
+    uint32_t prefix[ESTRELLA_SAMPLES+1];
+
+    prv_smooth_prepare(acc, count, half, dark, buffer, prefix);
+    prv_smooth_tail(prefix, (double)count*(2*half+1), half, dark, buffer, half);
+}
+
+#ifdef PRV_X86
+/* 8 samples per iteration, zero extended to 32 bit */
+__attribute__((target("sse2")))
+void prv_unpack_sse2(const uint16_t *raw, float *buffer)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i;
+
+    for (i=0;i+8<=ESTRELLA_SAMPLES;i+=8) {
+        __m128i words = _mm_loadu_si128((const __m128i*)&raw[i+1]);
+
+        _mm_storeu_ps(&buffer[i], _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero)));
+        _mm_storeu_ps(&buffer[i+4], _mm_cvtepi32_ps(_mm_unpackhi_epi16(words, zero)));
+    }
+
+    prv_unpack_tail(raw, buffer, i);
+}
+
+__attribute__((target("sse2")))
+void prv_accumulate_sse2(uint32_t *acc, const uint16_t *raw)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i;
+
+    for (i=0;i+8<=ESTRELLA_SAMPLES;i+=8) {
+        __m128i words = _mm_loadu_si128((const __m128i*)&raw[i+1]);
+        __m128i *lo = (__m128i*)&acc[i];
+        __m128i *hi = (__m128i*)&acc[i+4];
+
+        _mm_storeu_si128(lo, _mm_add_epi32(_mm_loadu_si128(lo), _mm_unpacklo_epi16(words, zero)));
+        _mm_storeu_si128(hi, _mm_add_epi32(_mm_loadu_si128(hi), _mm_unpackhi_epi16(words, zero)));
+    }
+
+    prv_accumulate_tail(acc, raw, i);
+}
+
+/* Sums are way below 2^31, so the signed conversion is fine */
+__attribute__((target("sse2")))
+void prv_average_sse2(const uint32_t *acc, int count, float dark, float *buffer)
+{
+    const __m128 div = _mm_set1_ps((float)count);
+    const __m128 sub = _mm_set1_ps(dark);
+    int i;
+
+    for (i=0;i+4<=ESTRELLA_SAMPLES;i+=4) {
+        __m128 sum = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)&acc[i]));
+        _mm_storeu_ps(&buffer[i], _mm_sub_ps(_mm_div_ps(sum, div), sub));
+    }
+
+    prv_average_tail(acc, count, dark, buffer, i);
+}
+
+/* Window sums are below 2^31 and convert to double exactly. Two samples per
+ * iteration. */
+__attribute__((target("sse2")))
+void prv_smooth_sse2(const uint32_t *acc, int count, int half, float dark, float *buffer)
+{
+    uint32_t prefix[ESTRELLA_SAMPLES+1];
+    double divs = (double)count*(2*half+1);
+    const __m128d div = _mm_set1_pd(divs);
+    const __m128 sub = _mm_set1_ps(dark);
+    int i;
+
+    prv_smooth_prepare(acc, count, half, dark, buffer, prefix);
+
+    for (i=half;i+4<=ESTRELLA_SAMPLES-half;i+=4) {
+        __m128i sum = _mm_sub_epi32(
+                _mm_loadu_si128((const __m128i*)&prefix[i+half+1]),
+                _mm_loadu_si128((const __m128i*)&prefix[i-half]));
+        __m128 lo = _mm_cvtpd_ps(_mm_div_pd(_mm_cvtepi32_pd(sum), div));
+        __m128 hi = _mm_cvtpd_ps(_mm_div_pd(_mm_cvtepi32_pd(_mm_srli_si128(sum, 8)), div));
+
+        _mm_storeu_ps(&buffer[i], _mm_sub_ps(_mm_movelh_ps(lo, hi), sub));
+    }
+
+    prv_smooth_tail(prefix, divs, half, dark, buffer, i);
+}
+
+/* 16 samples per iteration */
+__attribute__((target("avx2")))
+void prv_unpack_avx2(const uint16_t *raw, float *buffer)
+{
+    int i;
+
+    for (i=0;i+16<=ESTRELLA_SAMPLES;i+=16) {
+        __m128i lo = _mm_loadu_si128((const __m128i*)&raw[i+1]);
+        __m128i hi = _mm_loadu_si128((const __m128i*)&raw[i+9]);
+
+        _mm256_storeu_ps(&buffer[i], _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(lo)));
+        _mm256_storeu_ps(&buffer[i+8], _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(hi)));
+    }
+
+    prv_unpack_tail(raw, buffer, i);
+}
+
+__attribute__((target("avx2")))
+void prv_accumulate_avx2(uint32_t *acc, const uint16_t *raw)
+{
+    int i;
+
+    for (i=0;i+16<=ESTRELLA_SAMPLES;i+=16) {
+        __m256i lo = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&raw[i+1]));
+        __m256i hi = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&raw[i+9]));
+        __m256i *acclo = (__m256i*)&acc[i];
+        __m256i *acchi = (__m256i*)&acc[i+8];
+
+        _mm256_storeu_si256(acclo, _mm256_add_epi32(_mm256_loadu_si256(acclo), lo));
+        _mm256_storeu_si256(acchi, _mm256_add_epi32(_mm256_loadu_si256(acchi), hi));
+    }
+
+    prv_accumulate_tail(acc, raw, i);
+}
+
+__attribute__((target("avx2")))
+void prv_average_avx2(const uint32_t *acc, int count, float dark, float *buffer)
+{
+    const __m256 div = _mm256_set1_ps((float)count);
+    const __m256 sub = _mm256_set1_ps(dark);
+    int i;
+
+    for (i=0;i+8<=ESTRELLA_SAMPLES;i+=8) {
+        __m256 sum = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)&acc[i]));
+        _mm256_storeu_ps(&buffer[i], _mm256_sub_ps(_mm256_div_ps(sum, div), sub));
+    }
+
+    prv_average_tail(acc, count, dark, buffer, i);
+}
+
+__attribute__((target("avx2")))
+void prv_smooth_avx2(const uint32_t *acc, int count, int half, float dark, float *buffer)
+{
+    uint32_t prefix[ESTRELLA_SAMPLES+1];
+    double divs = (double)count*(2*half+1);
+    const __m256d div = _mm256_set1_pd(divs);
+    const __m256 sub = _mm256_set1_ps(dark);
+    int i;
+
+    prv_smooth_prepare(acc, count, half, dark, buffer, prefix);
+
+    for (i=half;i+8<=ESTRELLA_SAMPLES-half;i+=8) {
+        __m256i sum = _mm256_sub_epi32(
+                _mm256_loadu_si256((const __m256i*)&prefix[i+half+1]),
+                _mm256_loadu_si256((const __m256i*)&prefix[i-half]));
+        __m128 lo = _mm256_cvtpd_ps(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(sum)), div));
+        __m128 hi = _mm256_cvtpd_ps(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(sum, 1)), div));
+
+        _mm256_storeu_ps(&buffer[i], _mm256_sub_ps(_mm256_set_m128(hi, lo), sub));
+    }
+
+    prv_smooth_tail(prefix, divs, half, dark, buffer, i);
+}
+#endif
+
+void estrella_le16(uint16_t *raw, int words)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    UNUSED(raw);
+    UNUSED(words);
+#else
+    unsigned char *bytes = (unsigned char*)raw;
+    int i;
+
+    for (i=0;i<words;i++)
+        raw[i] = (uint16_t)(bytes[2*i] | (bytes[2*i+1] << 8));
+#endif
+}
+
+void estrella_unpack(const uint16_t *raw, float *buffer)
+{
+    pthread_once(&prv_dsp_once, prv_dsp_init);
+    prv_dsp->unpack(raw, buffer);
+}
+
+void estrella_accumulate(uint32_t *acc, const uint16_t *raw)
+{
+    pthread_once(&prv_dsp_once, prv_dsp_init);
+    prv_dsp->accumulate(acc, raw);
+}
+
+void estrella_average(const uint32_t *acc, int count, float dark, float *buffer)
+{
+    pthread_once(&prv_dsp_once, prv_dsp_init);
+    prv_dsp->average(acc, count, dark, buffer);
+}
+
+void estrella_smooth(const uint32_t *acc, int count, int half, float dark, float *buffer)
+{
+    pthread_once(&prv_dsp_once, prv_dsp_init);
+    prv_dsp->smooth(acc, count, half, dark, buffer);
+}
+
+float estrella_dark(const uint32_t *acc, int count)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i=0;i<ESTRELLA_DARK_PIXELS;i++)
+        sum += acc[i];
+
+    return (float)((double)sum/((double)count*ESTRELLA_DARK_PIXELS));
+}
+
+int estrella_dsp_kernels(const char *name, estrella_dsp_t *dsp)
+{
+    if (strcmp(name, "scalar") == 0) {
+        *dsp = prv_dsp_scalar;
+        return ESTROK;
+    }
+
+#ifdef PRV_X86
+    __builtin_cpu_init();
+
+    if ((strcmp(name, "sse2") == 0) && __builtin_cpu_supports("sse2")) {
+        *dsp = prv_dsp_sse2;
+        return ESTROK;
+    }
+    if ((strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        *dsp = prv_dsp_avx2;
+        return ESTROK;
+    }
+#endif
+
+    return ESTRNOTIMPL;
+}
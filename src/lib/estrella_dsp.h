@@ -0,0 +1,162 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/** @file estrella_dsp.h
+ *
+ * @brief Private sample processing interface
+ *
+ * Conversion of the raw detector payload into spectra. Where the CPU supports
+ * it vectorized kernels are used, the ones to use are picked at runtime.
+ *
+ * */
+
+#ifndef _ESTRELLA_DSP_H
+#define _ESTRELLA_DSP_H
+
+#include <stdint.h>
+#include "estrella.h"
+#include "estrella_private.h"
+
+/* ######################################################################### */
+/*                            TODO / Notes                                   */
+/* ######################################################################### */
+
+/* ######################################################################### */
+/*                            Types & Defines                                */
+/* ######################################################################### */
+
+/** Size of the raw bulk payload of a scan (bytes) */
+#define ESTRELLA_RAW_SIZE       (ESTRELLA_RAW_WORDS*2)
+
+/** Number of useful samples in a scan, the first 16 bit word is no sample */
+#define ESTRELLA_SAMPLES        (ESTRELLA_RAW_WORDS-1)
+
+/** Number of optically masked pixels at the start of the array. They see no
+ * light and follow the dark current of the detector, which drifts with
+ * temperature. */
+#define ESTRELLA_DARK_PIXELS    (16)
+
+/** Number of elements in a float result buffer */
+#define ESTRELLA_RESULT_SIZE    (2051)
+
+/** A set of processing kernels, see the functions of the same name below */
+typedef struct {
+    void (*unpack)(const uint16_t *raw, float *buffer);
+    void (*accumulate)(uint32_t *acc, const uint16_t *raw);
+    void (*average)(const uint32_t *acc, int count, float dark, float *buffer);
+    void (*smooth)(const uint32_t *acc, int count, int half, float dark, float *buffer);
+} estrella_dsp_t;
+
+/* ######################################################################### */
+/*                           Private interface (Lib)                         */
+/* ######################################################################### */
+
+/** Convert raw scan data to host byte order
+ *
+ * The detector delivers little endian words. This is a no-op on little endian
+ * hosts.
+ *
+ * @param raw           Raw scan data, converted in place
+ * @param words         Number of words
+ */
+void estrella_le16(uint16_t *raw, int words);
+
+/** Unpack raw scan data
+ *
+ * Converts raw scan data into a float result buffer. The header word is left
+ * out which makes for 2047 samples in indices 0 to 2046. Indices 2047 to 2050
+ * are set to 0.
+ *
+ * @param raw           Raw scan data in host byte order, ESTRELLA_RAW_WORDS
+ *                      words
+ * @param buffer        Result buffer, ESTRELLA_RESULT_SIZE elements
+ */
+void estrella_unpack(const uint16_t *raw, float *buffer);
+
+/** Add the samples of a raw scan to an accumulator
+ *
+ * 32 bits are plenty, even 99 scans of saturated pixels add up to less than
+ * 2^23.
+ *
+ * @param acc           Accumulator, ESTRELLA_SAMPLES elements
+ * @param raw           Raw scan data in host byte order, ESTRELLA_RAW_WORDS
+ *                      words
+ */
+void estrella_accumulate(uint32_t *acc, const uint16_t *raw);
+
+/** Turn an accumulator into an averaged float result buffer
+ *
+ * Every sample is divided exactly once. Sums below 2^24 convert to float
+ * without loss, so this is the correctly rounded average.
+ *
+ * @param acc           Accumulator, ESTRELLA_SAMPLES elements
+ * @param count         Number of scans accumulated
+ * @param dark          Dark level subtracted from every sample, 0.0 for none
+ * @param buffer        Result buffer, ESTRELLA_RESULT_SIZE elements
+ */
+void estrella_average(const uint32_t *acc, int count, float dark, float *buffer);
+
+/** Turn an accumulator into an averaged and smoothed float result buffer
+ *
+ * Boxcar smoothing, every sample is replaced by the mean of the samples from
+ * i-half to i+half. Near the edges the window shrinks to the samples which are
+ * there, so sample 0 is the mean of samples 0 to half. The window is moved
+ * along using prefix sums, so the cost does not depend on its width. Sums are
+ * exact and divided only once, like in estrella_average().
+ *
+ * @param acc           Accumulator, ESTRELLA_SAMPLES elements
+ * @param count         Number of scans accumulated
+ * @param half          Half the window width, (width-1)/2
+ * @param dark          Dark level subtracted from every sample, 0.0 for none
+ * @param buffer        Result buffer, ESTRELLA_RESULT_SIZE elements
+ */
+void estrella_smooth(const uint32_t *acc, int count, int half, float dark, float *buffer);
+
+/** Get the dark level of an accumulator
+ *
+ * Mean of the ESTRELLA_DARK_PIXELS masked pixels per scan. Subtracting it
+ * from every sample compensates the temperature drift of the dark current.
+ *
+ * @param acc           Accumulator, ESTRELLA_SAMPLES elements
+ * @param count         Number of scans accumulated
+ *
+ * @return Dark level
+ */
+float estrella_dark(const uint32_t *acc, int count);
+
+/** Get a specific set of kernels
+ *
+ * @param name          "scalar", "sse2" or "avx2"
+ * @param dsp           Returns the kernels
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRNOTIMPL  No such kernels or not supported by this CPU
+ */
+int estrella_dsp_kernels(const char *name, estrella_dsp_t *dsp);
+
+#endif /* _ESTRELLA_DSP_H */
@@ -0,0 +1,303 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "estrella.h"
+#include "estrella_private.h"
+#include "estrella_usb.h"
+#include "estrella_firmware.h"
+
+/* ######################################################################### */
+/*                            TODO / Notes                                   */
+/* ######################################################################### */
+
+/* ######################################################################### */
+/*                            Types & Defines                                */
+/* ######################################################################### */
+
+/* Intel HEX record types */
+#define PRV_IHEX_DATA       (0x00)
+#define PRV_IHEX_EOF        (0x01)
+
+#define PRV_USED(fw, addr)  ((fw)->used[(addr)>>3] & (1<<((addr)&7)))
+
+/* ######################################################################### */
+/*                           Private interface (Module)                      */
+/* ######################################################################### */
+
+static int prv_fw_nibble(char c);
+static int prv_fw_byte(const char *s, unsigned char *byte);
+static void prv_fw_write(estrella_fw_t *fw, unsigned int addr, const unsigned char *data, unsigned int size);
+
+/* The image used for uploads, the built in one is created when needed */
+static estrella_fw_t *prv_fw = NULL;
+static pthread_mutex_t prv_fw_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* ######################################################################### */
+/*                           Implementation                                  */
+/* ######################################################################### */
+
+/* The built in image is taken from the captured USB traffic of the windows
+ * driver */
+extern estrella_usb_request_t usb_preup_req[];
+extern size_t usb_preup_req_size;
+
+int prv_fw_nibble(char c)
+{
+    if ((c >= '0') && (c <= '9'))
+        return c - '0';
+    if ((c >= 'a') && (c <= 'f'))
+        return c - 'a' + 10;
+    if ((c >= 'A') && (c <= 'F'))
+        return c - 'A' + 10;
+
+    return -1;
+}
+
+int prv_fw_byte(const char *s, unsigned char *byte)
+{
+    int hi, lo;
+
+    hi = prv_fw_nibble(s[0]);
+    lo = prv_fw_nibble(s[1]);
+    if ((hi < 0) || (lo < 0))
+        return ESTRINV;
+
+    *byte = (unsigned char)((hi<<4) | lo);
+
+    return ESTROK;
+}
+
+void prv_fw_write(estrella_fw_t *fw, unsigned int addr, const unsigned char *data, unsigned int size)
+{
+    unsigned int i;
+
+    memcpy(&fw->data[addr], data, size);
+    for (i=addr;i<addr+size;i++)
+        fw->used[i>>3] |= (unsigned char)(1<<(i&7));
+}
+
+int estrella_fw_parse(estrella_fw_t *fw, const char *hex, size_t len)
+{
+    size_t pos = 0;
+
+    memset(fw, 0, sizeof(estrella_fw_t));
+
+    while (pos < len) {
+        const char *line = &hex[pos];
+        size_t linelen = 0;
+        unsigned char record[5+255];
+        unsigned char sum = 0;
+        unsigned int i, count;
+
+        while ((pos+linelen < len) && (line[linelen] != '\n'))
+            linelen++;
+        pos += linelen+1;
+
+        /* Strip trailing whitespace, DOS line endings included */
+        while ((linelen > 0) && ((line[linelen-1] == '\r') ||
+                    (line[linelen-1] == ' ') || (line[linelen-1] == '\t')))
+            linelen--;
+
+        if ((linelen == 0) || (line[0] == '#'))
+            continue;
+
+        /* :LLAAAATT<data>CC, at least 11 characters */
+        if ((line[0] != ':') || (linelen < 11) || ((linelen-1)%2 != 0))
+            return ESTRINV;
+
+        count = (unsigned int)(linelen-1)/2;
+        for (i=0;i<count;i++) {
+            if (prv_fw_byte(&line[1+2*i], &record[i]) != ESTROK)
+                return ESTRINV;
+            sum = (unsigned char)(sum + record[i]);
+        }
+
+        /* Length must match and all bytes including the checksum add up to
+         * zero */
+        if ((count != (unsigned int)record[0]+5) || (sum != 0))
+            return ESTRINV;
+
+        switch (record[3]) {
+            case PRV_IHEX_DATA:
+            {
+                unsigned int addr = ((unsigned int)record[1]<<8) | record[2];
+
+                if (addr + record[0] > ESTRELLA_FW_SIZE)
+                    return ESTRINV;
+
+                prv_fw_write(fw, addr, &record[4], record[0]);
+                break;
+            }
+            case PRV_IHEX_EOF:
+                return ESTROK;
+            default:
+                return ESTRNOTIMPL;
+        }
+    }
+
+    /* No end of file record, we'll take it anyway */
+    return ESTROK;
+}
+
+int estrella_fw_read(estrella_fw_t *fw, const char *path)
+{
+    FILE *file;
+    char *hex;
+    long len;
+    int rc;
+
+    file = fopen(path, "rb");
+    if (file == NULL)
+        return ESTRERR;
+
+    if ((fseek(file, 0, SEEK_END) != 0) || ((len = ftell(file)) < 0) ||
+            (fseek(file, 0, SEEK_SET) != 0)) {
+        fclose(file);
+        return ESTRERR;
+    }
+
+    hex = (char*)estrella_malloc((size_t)len + 1);
+    if (hex == NULL) {
+        fclose(file);
+        return ESTRNOMEM;
+    }
+
+    if (fread(hex, 1, (size_t)len, file) != (size_t)len) {
+        estrella_free(hex);
+        fclose(file);
+        return ESTRERR;
+    }
+
+    fclose(file);
+
+    rc = estrella_fw_parse(fw, hex, (size_t)len);
+    estrella_free(hex);
+
+    return rc;
+}
+
+int estrella_fw_builtin(estrella_fw_t *fw)
+{
+    int i;
+
+    memset(fw, 0, sizeof(estrella_fw_t));
+
+    /* Take the RAM writes from the captured traffic, the CPU reset sequence
+     * is done separately. */
+    for (i=0;i<(usb_preup_req_size/sizeof(estrella_usb_request_t));i++) {
+        estrella_usb_request_t *req = &usb_preup_req[i];
+
+        if (req->request != ESTRELLA_FW_REQUEST)
+            continue;
+
+        if ((req->value == ESTRELLA_FW_CPUCS_FX) || (req->value == ESTRELLA_FW_CPUCS_FX2))
+            continue;
+
+        prv_fw_write(fw, (unsigned int)req->value, req->data, (unsigned int)req->size);
+    }
+
+    return ESTROK;
+}
+
+int estrella_fw_segment(const estrella_fw_t *fw, unsigned int *addr, unsigned int *size)
+{
+    unsigned int start = *addr, end;
+
+    /* Skip whole unused bytes of the bitmap quickly */
+    while ((start < ESTRELLA_FW_SIZE) && !PRV_USED(fw, start)) {
+        if (((start & 7) == 0) && (fw->used[start>>3] == 0))
+            start += 8;
+        else
+            start++;
+    }
+
+    if (start >= ESTRELLA_FW_SIZE)
+        return ESTRINV;
+
+    end = start;
+    while ((end < ESTRELLA_FW_SIZE) && (end-start < ESTRELLA_FW_CHUNK) && PRV_USED(fw, end))
+        end++;
+
+    *addr = start;
+    *size = end-start;
+
+    return ESTROK;
+}
+
+int estrella_fw_select(const char *path)
+{
+    estrella_fw_t *fw;
+    int rc;
+
+    fw = (estrella_fw_t*)estrella_malloc(sizeof(estrella_fw_t));
+    if (fw == NULL)
+        return ESTRNOMEM;
+
+    if (path)
+        rc = estrella_fw_read(fw, path);
+    else
+        rc = estrella_fw_builtin(fw);
+
+    if (rc != ESTROK) {
+        estrella_free(fw);
+        return rc;
+    }
+
+    pthread_mutex_lock(&prv_fw_mutex);
+    estrella_free(prv_fw);
+    prv_fw = fw;
+    pthread_mutex_unlock(&prv_fw_mutex);
+
+    return ESTROK;
+}
+
+const estrella_fw_t *estrella_fw_acquire(void)
+{
+    pthread_mutex_lock(&prv_fw_mutex);
+
+    if (prv_fw == NULL) {
+        prv_fw = (estrella_fw_t*)estrella_malloc(sizeof(estrella_fw_t));
+        if (prv_fw == NULL) {
+            pthread_mutex_unlock(&prv_fw_mutex);
+            return NULL;
+        }
+
+        estrella_fw_builtin(prv_fw);
+    }
+
+    return prv_fw;
+}
+
+void estrella_fw_release(void)
+{
+    pthread_mutex_unlock(&prv_fw_mutex);
+}
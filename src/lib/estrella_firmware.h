@@ -0,0 +1,155 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/** @file estrella_firmware.h
+ *
+ * @brief Private firmware image interface
+ *
+ * Uninitialized USB2EPP adapters are Cypress EZ-USB chips which need their
+ * firmware written to RAM using vendor request 0xa0 while the CPU is being
+ * held in reset. This module keeps the image to be written, either built in or
+ * read from an Intel HEX file, and hands it out as contiguous segments so it
+ * can be written with as few control transfers as possible.
+ *
+ * */
+
+#ifndef _ESTRELLA_FIRMWARE_H
+#define _ESTRELLA_FIRMWARE_H
+
+#include <stddef.h>
+#include "estrella.h"
+#include "estrella_private.h"
+
+/* ######################################################################### */
+/*                            TODO / Notes                                   */
+/* ######################################################################### */
+
+/* ######################################################################### */
+/*                            Types & Defines                                */
+/* ######################################################################### */
+
+/** EZ-USB RAM download/upload request */
+#define ESTRELLA_FW_REQUEST     (0xa0)
+
+/** CPU control and status registers of the EZ-USB FX and FX2. Writing 1 holds
+ * the CPU in reset, writing 0 releases it. */
+#define ESTRELLA_FW_CPUCS_FX    (0x7f92)
+#define ESTRELLA_FW_CPUCS_FX2   (0xe600)
+
+/** Largest single firmware write */
+#define ESTRELLA_FW_CHUNK       (4096)
+
+/** Address space covered by a firmware image */
+#define ESTRELLA_FW_SIZE        (0x10000)
+
+/** A firmware image, contents and which addresses are actually used */
+typedef struct {
+    unsigned char data[ESTRELLA_FW_SIZE];
+    unsigned char used[ESTRELLA_FW_SIZE/8];
+} estrella_fw_t;
+
+/* ######################################################################### */
+/*                           Private interface (Lib)                         */
+/* ######################################################################### */
+
+/** Parse an Intel HEX image
+ *
+ * Only data and end of file records are supported, which is all that's needed
+ * for the 16 bit address space of the EZ-USB. Lines starting with '#' are
+ * ignored like fxload does.
+ *
+ * @param fw            Image to be populated
+ * @param hex           Intel HEX text
+ * @param len           Length of hex
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      Malformed record or checksum mismatch
+ * @return ESTRNOTIMPL  Unsupported record type
+ */
+int estrella_fw_parse(estrella_fw_t *fw, const char *hex, size_t len);
+
+/** Read an Intel HEX file
+ *
+ * @param fw            Image to be populated
+ * @param path          File to read
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRERR      Unable to read the file
+ * @return ESTRNOMEM    Out of memory
+ * @return ESTRINV      Malformed file
+ * @return ESTRNOTIMPL  Unsupported record type
+ */
+int estrella_fw_read(estrella_fw_t *fw, const char *path);
+
+/** Build the compiled in image
+ *
+ * @param fw            Image to be populated
+ *
+ * @return ESTROK       No errors occured
+ */
+int estrella_fw_builtin(estrella_fw_t *fw);
+
+/** Get the next segment to be written
+ *
+ * Finds the next contiguous run of used addresses at or above addr, at most
+ * ESTRELLA_FW_CHUNK bytes long.
+ *
+ * @param fw            Image
+ * @param addr          Where to start looking, returns the segment address
+ * @param size          Returns the segment size
+ *
+ * @return ESTROK       Segment found
+ * @return ESTRINV      No more segments
+ */
+int estrella_fw_segment(const estrella_fw_t *fw, unsigned int *addr, unsigned int *size);
+
+/** Select the image used for firmware uploads
+ *
+ * @param path          Intel HEX file, NULL for the built in image
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRERR      Unable to read the file
+ * @return ESTRNOMEM    Out of memory
+ * @return ESTRINV      Malformed file
+ * @return ESTRNOTIMPL  Unsupported record type
+ */
+int estrella_fw_select(const char *path);
+
+/** Get the image used for firmware uploads
+ *
+ * The image can't be replaced until estrella_fw_release() has been called.
+ *
+ * @return NULL         Out of memory
+ * @return ptr          Current image
+ */
+const estrella_fw_t *estrella_fw_acquire(void);
+
+/** Release the image obtained by estrella_fw_acquire() */
+void estrella_fw_release(void);
+
+#endif /* _ESTRELLA_FIRMWARE_H */
@@ -0,0 +1,283 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+#include <pthread.h>
+
+#include "estrella.h"
+#include "estrella_private.h"
+
+/* ######################################################################### */
+/*                            TODO / Notes                                   */
+/* ######################################################################### */
+
+/* ######################################################################### */
+/*                            Types & Defines                                */
+/* ######################################################################### */
+
+/* A session of the group and the thread driving it */
+typedef struct {
+    estrella_group_t *group;
+    int index;
+    pthread_t thread;
+} prv_member_t;
+
+/* Every session gets a thread of its own which sleeps until the next group
+ * scan. Bumping 'generation' releases all of them at once, so the scan start
+ * requests hit the bus in parallel rather than one round trip after the
+ * other. 'pending' counts the threads still busy with the current scan. */
+struct estrella_group_s {
+    estrella_session_t **sessions;
+    prv_member_t *members;
+    int count;
+    int threads;
+
+    float **buffers;
+    int *results;
+
+    unsigned long generation;
+    int pending;
+    int quit;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t go;
+    pthread_cond_t done;
+};
+
+/* ######################################################################### */
+/*                           Private interface (Module)                      */
+/* ######################################################################### */
+
+static void *prv_group_thread(void *arg);
+static void prv_group_free(estrella_group_t *group);
+
+/* ######################################################################### */
+/*                           Implementation                                  */
+/* ######################################################################### */
+
+void *prv_group_thread(void *arg)
+{
+    int rc;
+    unsigned long seen = 0;
+    prv_member_t *member = (prv_member_t*)arg;
+    estrella_group_t *group = member->group;
+    estrella_session_t *session = group->sessions[member->index];
+
+    pthread_mutex_lock(&group->mutex);
+    for (;;) {
+        while ((group->generation == seen) && !group->quit)
+            pthread_cond_wait(&group->go, &group->mutex);
+
+        if (group->quit)
+            break;
+
+        seen = group->generation;
+        pthread_mutex_unlock(&group->mutex);
+
+        rc = estrella_start(session);
+        if (rc == ESTROK)
+            rc = estrella_result(session, group->buffers[member->index]);
+        group->results[member->index] = rc;
+
+        pthread_mutex_lock(&group->mutex);
+        if (--group->pending == 0)
+            pthread_cond_signal(&group->done);
+    }
+    pthread_mutex_unlock(&group->mutex);
+
+    return NULL;
+}
+
+void prv_group_free(estrella_group_t *group)
+{
+    int i;
+
+    /* Get rid of the threads which made it */
+    pthread_mutex_lock(&group->mutex);
+    group->quit = 1;
+    pthread_cond_broadcast(&group->go);
+    pthread_mutex_unlock(&group->mutex);
+
+    for (i=0;i<group->threads;i++)
+        pthread_join(group->members[i].thread, NULL);
+
+    pthread_cond_destroy(&group->done);
+    pthread_cond_destroy(&group->go);
+    pthread_mutex_destroy(&group->mutex);
+    estrella_free(group->results);
+    estrella_free(group->members);
+    estrella_free(group->sessions);
+    estrella_free(group);
+}
+
+int estrella_group_create(estrella_group_t **group, estrella_session_t **sessions, int count)
+{
+    int i, j;
+    estrella_group_t *newgroup;
+
+    if (!group)
+        return ESTRINV;
+
+    if (!sessions)
+        return ESTRINV;
+
+    if (count < 1)
+        return ESTRINV;
+
+    /* Every session may only be in there once */
+    for (i=0;i<count;i++) {
+        if (!sessions[i])
+            return ESTRINV;
+        for (j=0;j<i;j++) {
+            if (sessions[i] == sessions[j])
+                return ESTRINV;
+        }
+    }
+
+    newgroup = (estrella_group_t*)estrella_malloc(sizeof(estrella_group_t));
+    if (!newgroup)
+        return ESTRNOMEM;
+
+    memset(newgroup, 0, sizeof(estrella_group_t));
+
+    newgroup->sessions = (estrella_session_t**)estrella_malloc(count*sizeof(estrella_session_t*));
+    newgroup->members = (prv_member_t*)estrella_malloc(count*sizeof(prv_member_t));
+    newgroup->results = (int*)estrella_malloc(count*sizeof(int));
+    if (!newgroup->sessions || !newgroup->members || !newgroup->results) {
+        estrella_free(newgroup->results);
+        estrella_free(newgroup->members);
+        estrella_free(newgroup->sessions);
+        estrella_free(newgroup);
+        return ESTRNOMEM;
+    }
+
+    memcpy(newgroup->sessions, sessions, count*sizeof(estrella_session_t*));
+    newgroup->count = count;
+    pthread_mutex_init(&newgroup->mutex, NULL);
+    pthread_cond_init(&newgroup->go, NULL);
+    pthread_cond_init(&newgroup->done, NULL);
+
+    for (i=0;i<count;i++) {
+        newgroup->members[i].group = newgroup;
+        newgroup->members[i].index = i;
+
+        if (pthread_create(&newgroup->members[i].thread, NULL, prv_group_thread, &newgroup->members[i]) != 0) {
+            prv_group_free(newgroup);
+            return ESTRERR;
+        }
+
+        newgroup->threads++;
+    }
+
+    *group = newgroup;
+
+    return ESTROK;
+}
+
+int estrella_group_scan(estrella_group_t *group, float **buffers, int *results, unsigned long *spread)
+{
+    int i, rc;
+    long long start, first, last;
+
+    if (!group)
+        return ESTRINV;
+
+    if (!buffers)
+        return ESTRINV;
+
+    for (i=0;i<group->count;i++) {
+        if (!buffers[i])
+            return ESTRINV;
+    }
+
+    /* Keep everybody else off the sessions */
+    for (i=0;i<group->count;i++) {
+        if (estrella_lock(&group->sessions[i]->lock) != ESTROK)
+            break;
+    }
+
+    if (i < group->count) {
+        while (i-- > 0)
+            estrella_unlock(&group->sessions[i]->lock);
+        return ESTRERR;
+    }
+
+    /* Off they go */
+    pthread_mutex_lock(&group->mutex);
+    group->buffers = buffers;
+    group->pending = group->count;
+    group->generation++;
+    pthread_cond_broadcast(&group->go);
+
+    while (group->pending > 0)
+        pthread_cond_wait(&group->done, &group->mutex);
+    pthread_mutex_unlock(&group->mutex);
+
+    /* The start times are taken once the device has acknowledged the start
+     * request, so this is the spread as seen by the host. They have to be
+     * read while we still hold the sessions, another thread may start a scan
+     * as soon as we let go. */
+    rc = ESTROK;
+    first = 0;
+    last = 0;
+    for (i=0;i<group->count;i++) {
+        estrella_session_t *session = group->sessions[i];
+
+        if (results)
+            results[i] = group->results[i];
+
+        if (group->results[i] != ESTROK) {
+            rc = ESTRERR;
+            continue;
+        }
+
+        start = (long long)(estrella_timestamp_ns(&session->scanstart)/1000);
+        if ((first == 0) || (start < first))
+            first = start;
+        if ((last == 0) || (start > last))
+            last = start;
+    }
+
+    for (i=0;i<group->count;i++)
+        estrella_unlock(&group->sessions[i]->lock);
+
+    if (spread)
+        *spread = (unsigned long)(last - first);
+
+    return rc;
+}
+
+int estrella_group_destroy(estrella_group_t *group)
+{
+    if (!group)
+        return ESTRINV;
+
+    prv_group_free(group);
+
+    return ESTROK;
+}
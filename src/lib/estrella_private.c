@@ -26,8 +26,13 @@
 * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include "estrella_private.h"
+#include "estrella_usb.h"
+#include "estrella_sim.h"
+#include "estrella_dsp.h"
 
 /* ######################################################################### */
 /*                            TODO / Notes                                   */
@@ -41,6 +46,8 @@
 /*                           Private interface (Module)                      */
 /* ######################################################################### */
 
+static void prv_hist_add(estr_hist_t *hist, unsigned long long ns);
+
 /* ######################################################################### */
 /*                           Implementation                                  */
 /* ######################################################################### */
@@ -63,65 +70,366 @@ int estrella_usleep(unsigned long us, unsigned long *rem)
 
 int estrella_timestamp_get(estr_timestamp_t *ts)
 {
-    int rc = gettimeofday((struct timeval*)ts, NULL);
+    int rc = clock_gettime(CLOCK_MONOTONIC, ts);
     if (rc != 0)
         return ESTRERR;
     
     return ESTROK;    
 }
 
+unsigned long long estrella_timestamp_ns(const estr_timestamp_t *ts)
+{
+    return (unsigned long long)ts->tv_sec*1000*1000*1000 + (unsigned long long)ts->tv_nsec;
+}
+
+int estrella_timestamp_realtime(const estr_timestamp_t *ts, struct timeval *tv)
+{
+    int rc;
+    unsigned long long realtime, monotonic;
+
+    rc = estrella_clock_anchor(&realtime, &monotonic);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    realtime += estrella_timestamp_ns(ts) - monotonic;
+    tv->tv_sec = (time_t)(realtime/(1000*1000*1000));
+    tv->tv_usec = (suseconds_t)((realtime%(1000*1000*1000))/1000);
+
+    return ESTROK;
+}
+
 int estrella_timestamp_diffms(estr_timestamp_t *ts1, estr_timestamp_t *ts2, unsigned long *diff)
 {
-    unsigned long ms_passed = 0;
-    unsigned long stv1_adds = 0;
-    unsigned long stv1_ussub = 0;
-    struct timeval *stv1, *stv2;
-
-    stv1 = (struct timeval*)ts1;
-    stv2 = (struct timeval*)ts2;
-
-    if (stv1->tv_sec > stv2->tv_sec) {
-        stv1 = (struct timeval*)ts2;
-        stv2 = (struct timeval*)ts1;
-    } 
-
-    if (stv2->tv_sec != stv1->tv_sec) {
-        ms_passed += ((1000*1000)-stv1->tv_usec)/1000;
-        stv1_adds = 1;
-        stv1_ussub = stv1->tv_usec;
-    } else if (stv1->tv_usec > stv2->tv_usec) {
-        stv1 = (struct timeval*)ts2;
-        stv2 = (struct timeval*)ts1; 
+    unsigned long us;
+
+    estrella_timestamp_diffus(ts1, ts2, &us);
+    *diff = us/1000;
+
+    return ESTROK;
+}
+
+int estrella_timestamp_diffus(estr_timestamp_t *ts1, estr_timestamp_t *ts2, unsigned long *diff)
+{
+    unsigned long long ns1 = estrella_timestamp_ns(ts1);
+    unsigned long long ns2 = estrella_timestamp_ns(ts2);
+
+    if (ns1 > ns2)
+        *diff = (unsigned long)((ns1 - ns2)/1000);
+    else
+        *diff = (unsigned long)((ns2 - ns1)/1000);
+
+    return ESTROK;
+}
+
+int estrella_timestamp_deadline(estr_timestamp_t *ts, unsigned long us)
+{
+    if (estrella_timestamp_get(ts) != ESTROK)
+        return ESTRERR;
+
+    ts->tv_sec += us/(1000*1000);
+    ts->tv_nsec += (long)(us%(1000*1000))*1000;
+    if (ts->tv_nsec >= 1000*1000*1000) {
+        ts->tv_sec += 1;
+        ts->tv_nsec -= 1000*1000*1000;
     }
 
-    ms_passed += (stv2->tv_sec - (stv1->tv_sec+stv1_adds))*1000;
-    ms_passed += (stv2->tv_usec - (stv1->tv_usec-stv1_ussub))/1000;
+    return ESTROK;
+}
 
-    *diff = ms_passed; 
+int estrella_cond_init(pthread_cond_t *cond)
+{
+    int rc;
+    pthread_condattr_t attr;
+
+    if (pthread_condattr_init(&attr) != 0)
+        return ESTRERR;
+
+    rc = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (rc == 0)
+        rc = pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (rc != 0)
+        return ESTRERR;
+
+    return ESTROK;
+}
+
+int estrella_wait_presleep(estrella_session_t *session)
+{
+    int rc;
+    unsigned long mspassed, msleft;
+    estr_timestamp_t ts_current;
+
+    /* We don't know when the trigger is going to hit */
+    if (session->xtmode == ESTR_XTMODE_TRIGGER)
+        return ESTROK;
+
+    /* Integration is too short to bother */
+    if (session->rate <= session->waitpolicy.guard)
+        return ESTROK;
+
+    rc = estrella_timestamp_get(&ts_current);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    rc = estrella_timestamp_diffms(&session->scanstart, &ts_current, &mspassed);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    msleft = (unsigned long)(session->rate - session->waitpolicy.guard);
+    if (mspassed >= msleft)
+        return ESTROK;
+
+    return estrella_usleep((msleft-mspassed)*1000, NULL);
+}
+
+int estrella_wait_next(estrella_session_t *session, unsigned long *interval)
+{
+    if (*interval == 0)
+        *interval = estrella_wait_advance(session, 0);
+
+    /* Don't care if the sleep is cut short, the caller polls again anyway */
+    estrella_usleep(*interval, NULL);
+
+    *interval = estrella_wait_advance(session, *interval);
+
+    return ESTROK;
+}
+
+unsigned long estrella_wait_advance(estrella_session_t *session, unsigned long interval)
+{
+    unsigned long next, max;
+
+    if (interval == 0)
+        return (unsigned long)session->waitpolicy.interval;
+
+    /* Waiting for a trigger may take forever, so back off further */
+    if (session->xtmode == ESTR_XTMODE_TRIGGER)
+        max = (unsigned long)session->triggerwait.maxinterval;
+    else
+        max = (unsigned long)session->waitpolicy.maxinterval;
+
+    next = (interval * (unsigned long)session->waitpolicy.backoff)/100;
+    if (next > max)
+        next = max;
+
+    return next;
+}
+
+int estrella_wait_check(estrella_session_t *session, unsigned long timeout)
+{
+    int rc;
+    unsigned long mspassed, cancels;
+    int trigger = (session->xtmode == ESTR_XTMODE_TRIGGER);
+
+    /* Cancellation requests are sticky, this takes them all at once */
+    cancels = __atomic_load_n(&session->cancels, __ATOMIC_SEQ_CST);
+    if (cancels != session->cancelmark) {
+        session->cancelmark = cancels;
+        if (trigger)
+            session->triggerstats.cancels++;
+        return ESTRCANCEL;
+    }
+
+    rc = estrella_timestamp_get(&session->lastbusy);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    rc = estrella_timestamp_diffms(&session->scanstart, &session->lastbusy, &mspassed);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    /* In trigger mode we don't know when integration starts, so the scan
+     * timeout doesn't apply. There may be a timeout for the trigger though. */
+    if (trigger) {
+        if (session->triggerwait.timeout < 0)
+            return ESTROK;
+        timeout = (unsigned long)session->triggerwait.timeout;
+    }
+
+    if (mspassed >= timeout) {
+        if (trigger)
+            session->triggerstats.timeouts++;
+        return ESTRTIMEOUT;
+    }
+
+    return ESTROK;
+}
+
+void prv_hist_add(estr_hist_t *hist, unsigned long long ns)
+{
+    int i = 0;
+    unsigned long long us = ns/1000;
+
+    /* Floor of log2 */
+    if (us > 0)
+        i = 63 - __builtin_clzll(us);
+    if (i >= ESTRELLA_HIST_BUCKETS)
+        i = ESTRELLA_HIST_BUCKETS-1;
+
+    hist->bucket[i]++;
+}
+
+int estrella_wait_complete(estrella_session_t *session)
+{
+    int rc;
+    estr_timestamp_t ts_current;
+
+    rc = estrella_timestamp_get(&ts_current);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    session->frametime.complete = estrella_timestamp_ns(&ts_current);
+    prv_hist_add(&session->stats.wait, session->frametime.complete - session->frametime.start);
+
+    return ESTROK;
+}
+
+int estrella_wait_done(estrella_session_t *session)
+{
+    int rc;
+    unsigned long latency;
+    estr_timestamp_t ts_current;
+    estr_triggerstats_t *stats = &session->triggerstats;
+
+    rc = estrella_timestamp_get(&ts_current);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    session->frametime.received = estrella_timestamp_ns(&ts_current);
+    prv_hist_add(&session->stats.bulk, session->frametime.received - session->frametime.complete);
+    session->stats.bulkbytes += ESTRELLA_RAW_SIZE;
+    session->stats.frames++;
+
+    if (session->xtmode != ESTR_XTMODE_TRIGGER)
+        return ESTROK;
+
+    rc = estrella_timestamp_diffus(&session->lastbusy, &ts_current, &latency);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    /* The pulse came no earlier than an integration time before the device
+     * was last seen waiting */
+    latency += (unsigned long)session->rate*1000;
+
+    if ((stats->triggers == 0) || (latency < stats->min))
+        stats->min = latency;
+    if (latency > stats->max)
+        stats->max = latency;
+    stats->last = latency;
+    stats->total += latency;
+    stats->triggers++;
 
     return ESTROK;
 }
 
 int estrella_lock(estr_lock_t *lock)
 {
-    *((int*)lock) = 1;
+    int expected = 0;
+
+    /* Atomically take the lock, but only if nobody else holds it */
+    if (!__atomic_compare_exchange_n(&lock->state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return ESTRERR;
+
     return ESTROK;
 }
 
 int estrella_unlock(estr_lock_t *lock)
 {
-    *((int*)lock) = 0;
+    __atomic_store_n(&lock->state, 0, __ATOMIC_RELEASE);
     return ESTROK;
 }
 
 int estrella_islocked(estr_lock_t *lock)
 {
-    if (*((int*)lock) == 0)
+    if (__atomic_load_n(&lock->state, __ATOMIC_ACQUIRE) == 0)
         return 0;
     else
         return 1;
 }
 
+int estrella_start(estrella_session_t *session)
+{
+    int rc;
+    estr_timestamp_t ts_issue;
+
+    estrella_timestamp_get(&ts_issue);
+
+    if (session->dev.devicetype == ESTRELLA_DEV_USB)
+        rc = estrella_usb_scan_init(session);
+    else if (session->dev.devicetype == ESTRELLA_DEV_SIM)
+        rc = estrella_sim_scan_init(session);
+    else
+        rc = ESTRNOTIMPL;
+
+    memset(&session->frametime, 0, sizeof(estr_frametime_t));
+    if (rc == ESTROK) {
+        memcpy(&session->lastbusy, &session->scanstart, sizeof(session->lastbusy));
+        session->frametime.start = estrella_timestamp_ns(&session->scanstart);
+        prv_hist_add(&session->stats.start, session->frametime.start - estrella_timestamp_ns(&ts_issue));
+    } else if (rc != ESTRNOTIMPL) {
+        session->stats.errors++;
+    }
+
+    return rc;
+}
+
+int estrella_result_raw(estrella_session_t *session, uint16_t *raw)
+{
+    int rc;
+
+    if (session->dev.devicetype == ESTRELLA_DEV_USB)
+        rc = estrella_usb_scan_result_raw(session, raw);
+    else if (session->dev.devicetype == ESTRELLA_DEV_SIM)
+        rc = estrella_sim_scan_result_raw(session, raw);
+    else
+        return ESTRNOTIMPL;
+
+    /* The scan is over. Cancellation requests which came in meanwhile were
+     * meant for it, they must not hit the next one. */
+    session->cancelmark = __atomic_load_n(&session->cancels, __ATOMIC_SEQ_CST);
+
+    session->stats.polls += session->polls;
+
+    switch (rc) {
+        case ESTROK:
+            break;
+        case ESTRTIMEOUT:
+            session->stats.timeouts++;
+            break;
+        case ESTRCANCEL:
+            session->stats.cancels++;
+            break;
+        default:
+            session->stats.errors++;
+            break;
+    }
+
+    return rc;
+}
+
+int estrella_result(estrella_session_t *session, float *buffer)
+{
+    int rc;
+    uint16_t raw[ESTRELLA_RAW_WORDS];
+
+    rc = estrella_result_raw(session, raw);
+    if (rc != ESTROK)
+        return rc;
+
+    /* For all I can see we're getting 2 bytes per value, which makes a total
+     * of 2048. I dont't know why the original API requests a 2051 elements
+     * buffer. Here's what they do anyway:
+     * Leave out the first value from the result set, which leaves us with 2047
+     * items. Those values are put into the result buffer from 0 to 2046. The
+     * remaining indices 2047 to 2050 are simply set to 0.
+     * No idea why it has to be a float buffer in the first place but well... */
+    estrella_unpack(raw, buffer);
+
+    return ESTROK;
+}
+
 void *estrella_malloc(size_t size)
 {
     return malloc(size);
@@ -30,6 +30,8 @@
 #define _ESTRELLA_PRIVATE_H
 
 #include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
 #include "estrella.h"
 
 /* ######################################################################### */
@@ -44,7 +46,8 @@
 #define UNUSED(x) ((void)(x))
 #endif
 
-typedef struct timeval estr_timestamp_t;
+/* Timestamps are CLOCK_MONOTONIC readings */
+typedef struct timespec estr_timestamp_t;
 
 /* ######################################################################### */
 /*                           Private interface (Lib)                         */
@@ -72,6 +75,26 @@ int estrella_usleep(unsigned long us, unsigned long *rem);
  */
 int estrella_timestamp_get(estr_timestamp_t *ts);
 
+/** Convert a timestamp to ns
+ *
+ * @param ts            Timestamp
+ *
+ * @return Nanoseconds on CLOCK_MONOTONIC
+ */
+unsigned long long estrella_timestamp_ns(const estr_timestamp_t *ts);
+
+/** Convert a timestamp to wall clock time
+ *
+ * Uses the anchor of estrella_clock_anchor().
+ *
+ * @param ts            Timestamp
+ * @param tv            Returns the wall clock time
+ *
+ * @return ESTROK       Success
+ * @return ESTRERR      Error
+ */
+int estrella_timestamp_realtime(const estr_timestamp_t *ts, struct timeval *tv);
+
 /** Get the difference in milliseconds between two timestamps
  *
  * @param ts1           Pointer to first timestamp
@@ -83,12 +106,126 @@ int estrella_timestamp_get(estr_timestamp_t *ts);
  */
 int estrella_timestamp_diffms(estr_timestamp_t *ts1, estr_timestamp_t *ts2, unsigned long *diff);
 
+/** Get the difference in microseconds between two timestamps
+ *
+ * @param ts1           Pointer to first timestamp
+ * @parma ts2           Pointer to second timestamp
+ * @param diff          Returns the difference in microseconds
+ *
+ * @return ESTROK       Diff successfully calculated
+ * @return ESTRERR      Diff could not be calculated
+ */
+int estrella_timestamp_diffus(estr_timestamp_t *ts1, estr_timestamp_t *ts2, unsigned long *diff);
+
+/** Get an absolute deadline for estrella_cond_init() condition variables
+ *
+ * @param ts            Returns the deadline
+ * @param us            Microseconds from now
+ *
+ * @return ESTROK       Success
+ * @return ESTRERR      Error
+ */
+int estrella_timestamp_deadline(estr_timestamp_t *ts, unsigned long us);
+
+/** Initialize a condition variable with timeouts on CLOCK_MONOTONIC
+ *
+ * Deadlines passed to pthread_cond_timedwait() have to come from
+ * estrella_timestamp_deadline(), so they don't move along with the wall clock.
+ *
+ * @param cond          Condition variable
+ *
+ * @return ESTROK       Success
+ * @return ESTRERR      Error
+ */
+int estrella_cond_init(pthread_cond_t *cond);
+
+/** Sleep until the scan in progress is about to complete
+ *
+ * Sleeps until session->waitpolicy.guard ms before the end of the integration
+ * started at session->scanstart. Returns immediately in trigger mode or if that
+ * point in time has already passed.
+ *
+ * @param session       Session
+ *
+ * @return ESTROK       Success
+ * @return ESTRERR      Error
+ */
+int estrella_wait_presleep(estrella_session_t *session);
+
+/** Sleep between two status polls
+ *
+ * Sleeps for the current polling interval and advances it according to the
+ * session's wait policy.
+ *
+ * @param session       Session
+ * @param interval      Current polling interval in us. Initialize with 0
+ *                      before the first poll of a scan.
+ *
+ * @return ESTROK       Success
+ * @return ESTRERR      Error
+ */
+int estrella_wait_next(estrella_session_t *session, unsigned long *interval);
+
+/** Advance the polling interval
+ *
+ * Grows the interval according to the session's wait policy, up to the
+ * trigger wait's maxinterval in trigger mode.
+ *
+ * @param session       Session
+ * @param interval      Current polling interval in us, 0 before the first poll
+ *
+ * @return The next polling interval in us
+ */
+unsigned long estrella_wait_advance(estrella_session_t *session, unsigned long interval);
+
+/** Check whether to keep waiting for the scan in progress
+ *
+ * To be called after every poll which found the device still busy.
+ *
+ * @param session       Session
+ * @param timeout       Time in ms after session->scanstart when to give up in
+ *                      normal operation mode
+ *
+ * @return ESTROK       Keep waiting
+ * @return ESTRTIMEOUT  Give up, the scan or the trigger wait timed out
+ * @return ESTRCANCEL   Give up, the scan has been cancelled
+ * @return ESTRERR      Error
+ */
+int estrella_wait_check(estrella_session_t *session, unsigned long timeout);
+
+/** Note that the scan in progress has completed
+ *
+ * To be called as soon as the device reports that it's done, before fetching
+ * the data.
+ *
+ * @param session       Session
+ *
+ * @return ESTROK       Success
+ * @return ESTRERR      Error
+ */
+int estrella_wait_complete(estrella_session_t *session);
+
+/** Account for a completed scan
+ *
+ * To be called once the data of a scan has been received. Takes the receive
+ * time and updates the trigger statistics in trigger mode.
+ *
+ * @param session       Session
+ *
+ * @return ESTROK       Success
+ * @return ESTRERR      Error
+ */
+int estrella_wait_done(estrella_session_t *session);
+
 /** Close a lock
+ *
+ * This does not block. Taking the lock is atomic, so if multiple threads try
+ * to lock at the same time exactly one of them succeeds.
  *
  * @param lock          The lock to be locked
  *
  * @return ESTROK       Successfully locked
- * @return ESTRERR      Unable to lock
+ * @return ESTRERR      Unable to lock, somebody else holds it
  */
 int estrella_lock(estr_lock_t *lock);
 
@@ -110,6 +247,47 @@ int estrella_unlock(estr_lock_t *lock);
  */
 int estrella_islocked(estr_lock_t *lock);
 
+/** Start a scan on a session
+ *
+ * Dispatches to the session's device backend.
+ *
+ * @param session       Session
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRTIMEOUT  Scan timed out
+ * @return ESTRNOTIMPL  Not implemented for this device
+ * @return ESTRERR      Start of scan failed
+ */
+int estrella_start(estrella_session_t *session);
+
+/** Fetch the raw results of a scan started on a session
+ *
+ * Dispatches to the session's device backend.
+ *
+ * @param session       Session
+ * @param raw           Result buffer, ESTRELLA_RAW_WORDS words
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRTIMEOUT  Scan timed out
+ * @return ESTRNOTIMPL  Not implemented for this device
+ * @return ESTRERR      Scan failed
+ */
+int estrella_result_raw(estrella_session_t *session, uint16_t *raw);
+
+/** Fetch the results of a scan started on a session as float
+ *
+ * Same as estrella_result_raw() with the samples unpacked to a float buffer.
+ *
+ * @param session       Session
+ * @param buffer        Result buffer, 2051 elements
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRTIMEOUT  Scan timed out
+ * @return ESTRNOTIMPL  Not implemented for this device
+ * @return ESTRERR      Scan failed
+ */
+int estrella_result(estrella_session_t *session, float *buffer);
+
 /** Allocate memory 
  *
  * @param size          Number of bytes to alloc
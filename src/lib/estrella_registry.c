@@ -0,0 +1,252 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+#include <pthread.h>
+
+#include "estrella.h"
+#include "estrella_private.h"
+#include "estrella_usb.h"
+#include "estrella_registry.h"
+
+/* ######################################################################### */
+/*                            TODO / Notes                                   */
+/* ######################################################################### */
+
+/* ######################################################################### */
+/*                            Types & Defines                                */
+/* ######################################################################### */
+
+/* ######################################################################### */
+/*                           Private interface (Module)                      */
+/* ######################################################################### */
+
+static int prv_registry_update(void);
+static int prv_registry_valid(void);
+static int prv_registry_copy(dll_list_t *dst, dll_list_t *src);
+
+/* The registry itself, protected by prv_mutex. prv_generation is bumped
+ * whenever the registry is known to be outdated. It's accessed atomically
+ * instead since invalidation happens from libusb event handling, which
+ * discovery itself might be waiting for while holding prv_mutex. The registry
+ * is valid as long as the generation it was built for is the current one, so
+ * an invalidation during discovery is never lost. */
+static dll_list_t prv_devices;
+static int prv_initialized = 0;
+static unsigned long prv_generation = 1;
+static unsigned long prv_built = 0;
+static pthread_mutex_t prv_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* ######################################################################### */
+/*                           Implementation                                  */
+/* ######################################################################### */
+
+int prv_registry_copy(dll_list_t *dst, dll_list_t *src)
+{
+    int rc;
+    dll_iterator_t it;
+    void *item = NULL;
+
+    dll_iterator_init(&it, src);
+    while (dll_iterator_next(&it, &item, NULL) == EDLLOK) {
+        void *newitem = NULL;
+
+        rc = dll_append(dst, &newitem, sizeof(estrella_dev_t));
+        if (rc != EDLLOK)
+            return ESTRNOMEM;
+
+        memcpy(newitem, item, sizeof(estrella_dev_t));
+    }
+
+    return ESTROK;
+}
+
+int prv_registry_update(void)
+{
+    int rc;
+    unsigned long generation;
+    dll_list_t devices;
+
+    if (!prv_initialized) {
+        dll_init(&prv_devices);
+        prv_initialized = 1;
+    }
+
+    rc = dll_init(&devices);
+    if (rc != EDLLOK)
+        return ESTRERR;
+
+    /* Whatever happens from here on is not necessarily reflected by what we
+     * find */
+    generation = __atomic_load_n(&prv_generation, __ATOMIC_ACQUIRE);
+
+    /* Discover what's there now, reusing whatever we know already */
+    rc = estrella_usb_find_devices(&devices, &prv_devices);
+    if (rc != ESTROK) {
+        dll_clear(&devices);
+        return ESTRERR;
+    }
+
+    /* We might now try to find LPT devices... */
+
+    dll_clear(&prv_devices);
+    rc = prv_registry_copy(&prv_devices, &devices);
+    dll_clear(&devices);
+    if (rc != ESTROK) {
+        dll_clear(&prv_devices);
+        prv_built = 0;
+        return rc;
+    }
+
+    prv_built = generation;
+
+    return ESTROK;
+}
+
+int prv_registry_valid(void)
+{
+    /* Build the registry on first use or when it has been invalidated */
+    if (__atomic_load_n(&prv_generation, __ATOMIC_ACQUIRE) == prv_built)
+        return ESTROK;
+
+    return prv_registry_update();
+}
+
+int estrella_registry_refresh(void)
+{
+    int rc;
+
+    pthread_mutex_lock(&prv_mutex);
+    rc = prv_registry_update();
+    pthread_mutex_unlock(&prv_mutex);
+
+    return rc;
+}
+
+void estrella_registry_invalidate(void)
+{
+    __atomic_add_fetch(&prv_generation, 1, __ATOMIC_ACQ_REL);
+}
+
+int estrella_registry_list(dll_list_t *devices)
+{
+    int rc;
+
+    pthread_mutex_lock(&prv_mutex);
+    rc = prv_registry_valid();
+    if (rc == ESTROK)
+        rc = prv_registry_copy(devices, &prv_devices);
+    pthread_mutex_unlock(&prv_mutex);
+
+    return rc;
+}
+
+int estrella_registry_count(int *num)
+{
+    int rc;
+    unsigned int count = 0;
+
+    pthread_mutex_lock(&prv_mutex);
+    rc = prv_registry_valid();
+    if (rc == ESTROK)
+        dll_count(&prv_devices, &count);
+    pthread_mutex_unlock(&prv_mutex);
+
+    *num = (int)count;
+
+    return rc;
+}
+
+int estrella_registry_get(estrella_dev_t *dev, int num)
+{
+    int rc;
+    unsigned int count = 0;
+    void *item = NULL;
+
+    pthread_mutex_lock(&prv_mutex);
+    rc = prv_registry_valid();
+    if (rc == ESTROK) {
+        dll_count(&prv_devices, &count);
+        if ((num < 0) || (num >= (int)count))
+            rc = ESTRINV;
+    }
+    if (rc == ESTROK) {
+        if (dll_get(&prv_devices, &item, NULL, (unsigned int)num) == EDLLOK)
+            memcpy(dev, item, sizeof(estrella_dev_t));
+        else
+            rc = ESTRERR;
+    }
+    pthread_mutex_unlock(&prv_mutex);
+
+    return rc;
+}
+
+int estrella_registry_serial(estrella_dev_t *dev, const char *serial)
+{
+    int rc;
+    dll_iterator_t it;
+    void *item = NULL;
+
+    pthread_mutex_lock(&prv_mutex);
+    rc = prv_registry_valid();
+    if (rc == ESTROK) {
+        rc = ESTRINV;
+        dll_iterator_init(&it, &prv_devices);
+        while (dll_iterator_next(&it, &item, NULL) == EDLLOK) {
+            estrella_dev_t *regdev = (estrella_dev_t*)item;
+
+            if ((regdev->devicetype == ESTRELLA_DEV_USB) &&
+                (strcmp(regdev->spec.usb.serialnumber, serial) == 0)) {
+                memcpy(dev, regdev, sizeof(estrella_dev_t));
+                rc = ESTROK;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&prv_mutex);
+
+    return rc;
+}
+
+estrella_dev_t *estrella_registry_lookup(dll_list_t *list, estrella_dev_t *device)
+{
+    dll_iterator_t it;
+    void *item = NULL;
+
+    dll_iterator_init(&it, list);
+    while (dll_iterator_next(&it, &item, NULL) == EDLLOK) {
+        estrella_dev_t *regdev = (estrella_dev_t*)item;
+
+        if ((regdev->devicetype == device->devicetype) &&
+            (regdev->spec.usb.devnum == device->spec.usb.devnum) &&
+            (strcmp(regdev->spec.usb.bus, device->spec.usb.bus) == 0))
+            return regdev;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,126 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/** @file estrella_registry.h
+ *
+ * @brief Private device registry interface
+ *
+ * Keeps a process wide cache of the devices found on the host so that
+ * looking up a device does not require walking all busses and opening every
+ * device again.
+ *
+ * */
+
+#ifndef _ESTRELLA_REGISTRY_H
+#define _ESTRELLA_REGISTRY_H
+
+#include "estrella.h"
+#include "estrella_private.h"
+
+/* ######################################################################### */
+/*                            TODO / Notes                                   */
+/* ######################################################################### */
+
+/* ######################################################################### */
+/*                            Types & Defines                                */
+/* ######################################################################### */
+
+/* ######################################################################### */
+/*                           Private interface (Lib)                         */
+/* ######################################################################### */
+
+/** Refresh the registry
+ *
+ * Runs device discovery. Devices which are already known are carried over
+ * without talking to them again, new ones are added and those which are gone
+ * are removed.
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRERR      Device discovery failed
+ */
+int estrella_registry_refresh(void);
+
+/** Mark the registry as outdated
+ *
+ * The next lookup is going to refresh it. This is what hotplug notifications
+ * end up calling.
+ */
+void estrella_registry_invalidate(void);
+
+/** Get a copy of all registered devices
+ *
+ * @param devices       An initialized dll_list_t which is to be populated
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRNOMEM    Out of memory
+ * @return ESTRERR      Device discovery failed
+ */
+int estrella_registry_list(dll_list_t *devices);
+
+/** Get the number of registered devices
+ *
+ * @param num           Returns the number of devices
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRERR      Device discovery failed
+ */
+int estrella_registry_count(int *num);
+
+/** Get a registered device by index
+ *
+ * @param dev           Returns the device
+ * @param num           Index into the registry
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      No such device
+ * @return ESTRERR      Device discovery failed
+ */
+int estrella_registry_get(estrella_dev_t *dev, int num);
+
+/** Get a registered device by serial number
+ *
+ * @param dev           Returns the device
+ * @param serial        Serial number
+ *
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      No such device
+ * @return ESTRERR      Device discovery failed
+ */
+int estrella_registry_serial(estrella_dev_t *dev, const char *serial);
+
+/** Look up a device in a list of devices by bus and device number
+ *
+ * @param list          List of estrella_dev_t items
+ * @param device        Device to look for
+ *
+ * @return NULL         Not found
+ * @return ptr          The matching list item
+ */
+estrella_dev_t *estrella_registry_lookup(dll_list_t *list, estrella_dev_t *device);
+
+#endif /* _ESTRELLA_REGISTRY_H */
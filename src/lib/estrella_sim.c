@@ -0,0 +1,468 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+#include <math.h>
+
+#include "estrella.h"
+#include "estrella_private.h"
+#include "estrella_usb.h"
+#include "estrella_sim.h"
+#include "estrella_dsp.h"
+
+/* ######################################################################### */
+/*                            TODO / Notes                                   */
+/* ######################################################################### */
+
+/* BR: The simulated device sits behind the same three vendor requests as the
+ * real one. 0xb4 sets rate and xtrate, 0xb2 starts integration and 0xb3
+ * reports whether integration is complete, after which the scan may be read
+ * from the bulk endpoint. Requests are handed to prv_sim_control() in the
+ * very same form the USB backends send them, and completion is waited for
+ * using the same helpers, so scans on a simulated device take about as long
+ * as on a real one and exercise the same code paths.
+ *
+ * Spectra are generated when the bulk endpoint is read. The peak profile only
+ * depends on the device description, so it is computed once per session and
+ * scaled by the rate for every scan. The bulk transfer itself is instant and
+ * the simulated data arrives in host byte order. */
+
+/* ######################################################################### */
+/*                            Types & Defines                                */
+/* ######################################################################### */
+
+/* When a scan takes (rate + PRV_DELAY)ms we consider it a timeout */
+#define PRV_DELAY           (100)
+
+/* Largest value a sample can take */
+#define PRV_SATURATION      (65535.0f)
+
+/* Simulated device state */
+struct estrella_sim_s {
+    /* Device setup as of the last 0xb4 request */
+    int rate;
+    unsigned char xtrate;
+
+    /* Integration as of the last 0xb2 request. 'done' is the time in ns
+     * integration completes, 0 if it never does. */
+    int busy;
+    unsigned long long done;
+
+    /* Trigger pulses are aligned to the time the device has been opened */
+    int trigger;
+    unsigned long long epoch;
+
+    /* Peak profile in counts per ms, dark level and noise */
+    float profile[ESTRELLA_SAMPLES];
+    float dark;
+    float noise;
+    uint64_t state;
+};
+
+/* ######################################################################### */
+/*                           Private interface (Module)                      */
+/* ######################################################################### */
+
+static int prv_sim_control(estrella_session_t *session, estrella_usb_request_t *req);
+static int prv_sim_bulk_read(struct estrella_sim_s *sim, uint16_t *raw);
+static void prv_sim_profile(struct estrella_sim_s *sim, const estrella_simdev_t *simdev);
+static float prv_sim_gauss(struct estrella_sim_s *sim);
+
+/* Request payload templates, the same the USB backends use. Nothing in here
+ * is ever written to. */
+static const unsigned char estrella_init_req_data[] = {0x00,0x12,0x10,0x1f,0xe0,0x40};
+static const unsigned char estrella_rate_req_data_reset[] = {0x00,0x00,0x04,0x20,0xe0,0x40};
+
+/* ######################################################################### */
+/*                           Implementation                                  */
+/* ######################################################################### */
+
+int prv_sim_control(estrella_session_t *session, estrella_usb_request_t *req)
+{
+    struct estrella_sim_s *sim = session->spec.sim;
+    estr_timestamp_t ts;
+    unsigned long long now, period, pulse;
+
+    if (estrella_timestamp_get(&ts) != ESTROK)
+        return -1;
+    now = estrella_timestamp_ns(&ts);
+
+    switch (req->request) {
+        /* Setup, data[0] and data[1] hold the rate in ms, data[2] xtrate */
+        case 0xb4:
+            if (req->size < 3)
+                return -1;
+            sim->rate = ((int)req->data[0] << 8) | (int)req->data[1];
+            sim->xtrate = req->data[2];
+            return req->size;
+
+        /* Start integration. The trigger input is only connected in trigger
+         * mode. */
+        case 0xb2:
+            if (session->xtmode != ESTR_XTMODE_TRIGGER) {
+                sim->done = now + (unsigned long long)sim->rate*1000000ULL;
+            } else if (sim->trigger > 0) {
+                period = (unsigned long long)sim->trigger*1000000ULL;
+                pulse = sim->epoch + ((now - sim->epoch)/period + 1)*period;
+                sim->done = pulse + (unsigned long long)sim->rate*1000000ULL;
+            } else {
+                sim->done = 0;
+            }
+            sim->busy = 1;
+            return 0;
+
+        /* Status, [0xb3,0x01] once integration is complete */
+        case 0xb3:
+            if (req->size < 2)
+                return -1;
+            req->data[0] = 0xb3;
+            req->data[1] = (sim->busy && (sim->done != 0) && (now >= sim->done)) ? 0x01 : 0x00;
+            return 2;
+
+        default:
+            break;
+    }
+
+    return -1;
+}
+
+int prv_sim_bulk_read(struct estrella_sim_s *sim, uint16_t *raw)
+{
+    float scale, value;
+    int i;
+
+    /* Nothing to read unless the status request reported completion */
+    if (!sim->busy)
+        return -1;
+
+    scale = (float)sim->rate;
+
+    /* The header word carries no data */
+    raw[0] = 0;
+    for (i=0;i<ESTRELLA_SAMPLES;i++) {
+        value = sim->dark + sim->profile[i]*scale + sim->noise*prv_sim_gauss(sim) + 0.5f;
+
+        if (value < 0.0f)
+            value = 0.0f;
+        else if (value > PRV_SATURATION)
+            value = PRV_SATURATION;
+
+        raw[i+1] = (uint16_t)value;
+    }
+
+    sim->busy = 0;
+
+    return ESTRELLA_RAW_WORDS*2;
+}
+
+void prv_sim_profile(struct estrella_sim_s *sim, const estrella_simdev_t *simdev)
+{
+    const estr_simpeak_spec_t *peak;
+    double x;
+    int i, j;
+
+    memset(sim->profile, 0, sizeof(sim->profile));
+
+    for (j=0;j<simdev->peaks;j++) {
+        peak = &simdev->peak[j];
+
+        /* Masked pixels never see any light */
+        for (i=ESTRELLA_DARK_PIXELS;i<ESTRELLA_SAMPLES;i++) {
+            /* Distance from the center in half widths */
+            x = 2.0*((double)i - peak->position)/peak->width;
+
+            if (peak->shape == ESTR_SIMPEAK_GAUSS)
+                sim->profile[i] += (float)(peak->height*exp(-0.69314718056*x*x));
+            else
+                sim->profile[i] += (float)(peak->height/(1.0 + x*x));
+        }
+    }
+}
+
+float prv_sim_gauss(struct estrella_sim_s *sim)
+{
+    float sum = 0.0f;
+    int i;
+
+    /* The sum of four uniform variates is close enough to a normal
+     * distribution for noise. xorshift64* provides them. */
+    for (i=0;i<4;i++) {
+        sim->state ^= sim->state >> 12;
+        sim->state ^= sim->state << 25;
+        sim->state ^= sim->state >> 27;
+        sum += (float)((sim->state*0x2545F4914F6CDD1DULL) >> 40)/(float)(1UL << 24);
+    }
+
+    /* Four variates have a mean of 2 and a variance of 1/3 */
+    return (sum - 2.0f)*1.7320508f;
+}
+
+int estrella_sim_device(estrella_dev_t *dev, int index)
+{
+    estrella_simdev_t *simdev;
+
+    if (!dev)
+        return ESTRINV;
+
+    if (index < 0)
+        return ESTRINV;
+
+    memset(dev, 0, sizeof(estrella_dev_t));
+    dev->devicetype = ESTRELLA_DEV_SIM;
+
+    simdev = &dev->spec.sim;
+    simdev->index = index;
+    simdev->seed = (unsigned long)index + 1;
+    simdev->dark = 1000.0f;
+    simdev->noise = 4.0f;
+    simdev->trigger = 50;
+
+    /* A couple of lines on a flat dark level */
+    simdev->peaks = 3;
+    simdev->peak[0].shape = ESTR_SIMPEAK_GAUSS;
+    simdev->peak[0].position = 600.0f;
+    simdev->peak[0].width = 8.0f;
+    simdev->peak[0].height = 150.0f;
+    simdev->peak[1].shape = ESTR_SIMPEAK_GAUSS;
+    simdev->peak[1].position = 1200.0f;
+    simdev->peak[1].width = 24.0f;
+    simdev->peak[1].height = 60.0f;
+    simdev->peak[2].shape = ESTR_SIMPEAK_LORENTZ;
+    simdev->peak[2].position = 1650.0f;
+    simdev->peak[2].width = 4.0f;
+    simdev->peak[2].height = 100.0f;
+
+    return ESTROK;
+}
+
+int estrella_sim_init(estrella_session_t *session, estrella_dev_t *device)
+{
+    const estrella_simdev_t *simdev = &device->spec.sim;
+    struct estrella_sim_s *sim;
+    estr_timestamp_t ts;
+    int i, rc;
+
+    estrella_usb_request_t sim_init_req = {
+        0x00,
+        0xb4,
+        0x0000,
+        0x0000,
+        sizeof(session->usbbuf.setup),
+        session->usbbuf.setup,
+    };
+
+    if ((simdev->peaks < 0) || (simdev->peaks > ESTRELLA_SIM_PEAKS) ||
+        (simdev->noise < 0.0f) || (simdev->trigger < 0))
+        return ESTRINV;
+
+    for (i=0;i<simdev->peaks;i++) {
+        if ((simdev->peak[i].shape < 0) ||
+            (simdev->peak[i].shape >= ESTR_SIMPEAK_TYPES) ||
+            (simdev->peak[i].width <= 0.0f))
+            return ESTRINV;
+    }
+
+    sim = (struct estrella_sim_s*)estrella_malloc(sizeof(struct estrella_sim_s));
+    if (!sim)
+        return ESTRNOMEM;
+
+    memset(sim, 0, sizeof(struct estrella_sim_s));
+
+    rc = estrella_timestamp_get(&ts);
+    if (rc != ESTROK) {
+        estrella_free(sim);
+        return ESTRERR;
+    }
+
+    sim->epoch = estrella_timestamp_ns(&ts);
+    sim->trigger = simdev->trigger;
+    sim->dark = simdev->dark;
+    sim->noise = simdev->noise;
+
+    /* xorshift must not be seeded with 0 */
+    sim->state = (uint64_t)simdev->seed*0x9E3779B97F4A7C15ULL;
+    if (sim->state == 0)
+        sim->state = 0x9E3779B97F4A7C15ULL;
+
+    prv_sim_profile(sim, simdev);
+
+    session->spec.sim = sim;
+
+    /* Initial device setup */
+    memcpy(session->usbbuf.setup, estrella_init_req_data, sizeof(session->usbbuf.setup));
+    rc = prv_sim_control(session, &sim_init_req);
+    if (rc < 0) {
+        session->spec.sim = NULL;
+        estrella_free(sim);
+        return ESTRERR;
+    }
+
+    return ESTROK;
+}
+
+int estrella_sim_close(estrella_session_t *session)
+{
+    if (session->spec.sim) {
+        estrella_free(session->spec.sim);
+        session->spec.sim = NULL;
+    }
+
+    return ESTROK;
+}
+
+int estrella_sim_rate(estrella_session_t *session, int rate, estr_xtrate_t xtrate)
+{
+    int rc;
+
+    estrella_usb_request_t sim_rate_req = {
+        0x00,
+        0xb4,
+        0x0000,
+        0x0000,
+        sizeof(session->usbbuf.setup),
+        session->usbbuf.setup,
+    };
+
+    if (session->spec.sim == NULL)
+        return ESTRINV;
+
+    /* Same payload as for the real device, see estrella_usb_rate() */
+    memcpy(session->usbbuf.setup, estrella_rate_req_data_reset, sizeof(session->usbbuf.setup));
+    session->usbbuf.setup[1] = (unsigned char)(rate & 0xFF);
+    session->usbbuf.setup[0] = (unsigned char)((rate >> 8) & 0xFF);
+
+    if (rate >= 5)
+        session->usbbuf.setup[3] -= 1;
+
+    if (xtrate == ESTR_XRES_MEDIUM)
+        session->usbbuf.setup[2] = 0x08;
+    else if (xtrate == ESTR_XRES_HIGH) 
+        session->usbbuf.setup[2] = 0x10;
+
+    rc = prv_sim_control(session, &sim_rate_req);
+    if (rc < 0)
+        return ESTRERR;
+
+    return ESTROK;
+}
+
+int estrella_sim_scan_init(estrella_session_t *session)
+{
+    int rc;
+
+    /* Scan start request */
+    estrella_usb_request_t sim_scan_req = {
+        0x00,
+        0xb2,
+        0x0000,
+        0x0000,
+        0,
+        NULL,
+    };
+
+    if (session->spec.sim == NULL)
+        return ESTRINV;
+
+    rc = prv_sim_control(session, &sim_scan_req);
+    if (rc < 0)
+        return ESTRERR;
+
+    rc = estrella_timestamp_get(&session->scanstart);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    return ESTROK;
+}
+
+int estrella_sim_scan_result_raw(estrella_session_t *session, uint16_t *raw)
+{
+    int rc, wait;
+    unsigned char response;
+    unsigned long interval;
+
+    /* Scan progress request */
+    estrella_usb_request_t sim_progress_req = {
+        0x00,
+        0xb3,
+        0x0000,
+        0x0000,
+        sizeof(session->usbbuf.status),
+        session->usbbuf.status,
+    };
+
+    if (session->spec.sim == NULL)
+        return ESTRINV;
+
+    rc = estrella_wait_presleep(session);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    response = 0;
+    interval = 0;
+    wait = ESTROK;
+    session->polls = 0;
+    while (1==1) {
+
+        rc = prv_sim_control(session, &sim_progress_req);
+        if (rc < 0)
+            break;
+
+        session->polls++;
+        session->totalpolls++;
+
+        if (session->usbbuf.status[1] == 0x01) {
+            response = 1;
+            break;
+        }
+
+        wait = estrella_wait_check(session, (unsigned long)(session->rate + PRV_DELAY));
+        if (wait != ESTROK)
+            break;
+
+        estrella_wait_next(session, &interval);
+    }
+
+    if (response != 1) {
+        if (wait != ESTROK)
+            return wait;
+        if (session->xtmode != ESTR_XTMODE_TRIGGER)
+            return ESTRTIMEOUT;
+        else 
+            return ESTRERR;
+    }
+
+    estrella_wait_complete(session);
+
+    rc = prv_sim_bulk_read(session->spec.sim, raw);
+    if (rc < 0)
+        return ESTRERR;
+
+    estrella_wait_done(session);
+
+    return ESTROK;
+}
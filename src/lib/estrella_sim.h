@@ -0,0 +1,104 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/** @file estrella_sim.h
+ *
+ * @brief Private simulated device interface
+ *
+ * Emulates a spectrometer in software. The interface is the same as the one
+ * of the USB backends, see estrella_usb.h.
+ *
+ * */
+
+#ifndef _ESTRELLA_SIM_H
+#define _ESTRELLA_SIM_H
+
+#include <stdint.h>
+#include "estrella.h"
+#include "estrella_private.h"
+
+/* ######################################################################### */
+/*                            TODO / Notes                                   */
+/* ######################################################################### */
+
+/* ######################################################################### */
+/*                            Types & Defines                                */
+/* ######################################################################### */
+
+/* ######################################################################### */
+/*                           Private interface (Lib)                         */
+/* ######################################################################### */
+
+/** Initialize a simulated device
+ * @param session       Pointer to a session which is to be bound to the
+ *                      supplied device
+ * @param dev           Device to be used in this session
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid 
+ * @return ESTRNOMEM    Out of memory
+ * @return ESTRERR      Device initialization failed 
+ */
+int estrella_sim_init(estrella_session_t *session, estrella_dev_t *device);
+
+/** Close a simulated device session
+ * @param session       Session to detach the device from
+ * @return ESTROK       No errors occured
+ */
+int estrella_sim_close(estrella_session_t *session);
+
+/** Set rate and xtrate
+ * @param session       Session for which to set these parameters
+ * @param rate          Detector integration time
+ * @param xtrate        x timing resolution
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid 
+ * @return ESTRERR      Failed to set rate 
+ */
+int estrella_sim_rate(estrella_session_t *session, int rate, estr_xtrate_t xtrate);
+
+/** Start scanning
+ * @param session       Session
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid 
+ * @return ESTRERR      Scan failed
+ */
+int estrella_sim_scan_init(estrella_session_t *session);
+
+/** Request raw results of a scan
+ * @param session       Session
+ * @param raw           Result buffer, ESTRELLA_RAW_WORDS words in host byte
+ *                      order
+ * @return ESTROK       No errors occured
+ * @return ESTRINV      A supplied input argument is invalid 
+ * @return ESTRTIMEOUT  Scan timed out
+ * @return ESTRCANCEL   Scan has been cancelled
+ * @return ESTRERR      Scan failed
+ */
+int estrella_sim_scan_result_raw(estrella_session_t *session, uint16_t *raw);
+
+#endif /* _ESTRELLA_SIM_H */
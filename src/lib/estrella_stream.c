@@ -0,0 +1,567 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "estrella.h"
+#include "estrella_usb.h"
+#include "estrella_private.h"
+
+/* ######################################################################### */
+/*                            TODO / Notes                                   */
+/* ######################################################################### */
+
+/* ######################################################################### */
+/*                            Types & Defines                                */
+/* ######################################################################### */
+
+typedef struct prv_slot_s prv_slot_t;
+
+/* Ring of frames shared between the acquisition thread (producer) and the
+ * client (consumer). head is only ever written by the producer, tail only by
+ * the consumer. Both run freely, the slot index is the counter modulo size.
+ *
+ * The frames themselves come from a pool which is allocated up front. The
+ * producer takes a free frame, fills it in place and puts it on the ring,
+ * clients lease frames off the ring and hand them back to the pool by dropping
+ * the last reference. There are never more frames on the ring than in the
+ * pool, so the ring can't overflow, the producer runs out of free frames
+ * instead.
+ *
+ * The acquisition thread never takes the mutex while the stream is running.
+ * Released frames are pushed onto the returned stack, the producer takes the
+ * whole stack at once when its own cache of free frames has run dry, so there
+ * is only ever one thread popping. A new frame is announced through the
+ * condition variable only if a consumer has registered as waiting.
+ *
+ * The mutex protects the tail when it is advanced, the number of users and
+ * the stopped flag. The stream is freed as soon as it has been stopped, no
+ * frame is leased anymore and no consumer is using it, which may well be after
+ * estrella_stream_stop() has returned. */
+struct estrella_stream_s {
+    estrella_session_t *session;
+    pthread_t thread;
+
+    prv_slot_t *pool;
+    prv_slot_t **ring;
+    prv_slot_t *cache;
+    prv_slot_t *returned;
+    estrella_frame_t scratch;
+    unsigned long size;
+    unsigned long head;
+    unsigned long tail;
+    unsigned long leased;
+    unsigned long waiters;
+    unsigned long users;
+    int stopped;
+
+    int running;
+    int error;
+    unsigned long overruns;
+    unsigned long timeouts;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+/* A frame of the pool. The frame has to be the first member, clients only ever
+ * get to see a pointer to it. */
+struct prv_slot_s {
+    estrella_frame_t frame;
+    int refs;
+    estrella_stream_t *stream;
+    prv_slot_t *next;
+};
+
+/* ######################################################################### */
+/*                           Private interface (Module)                      */
+/* ######################################################################### */
+
+static void *prv_stream_thread(void *arg);
+static void prv_stream_notify(estrella_stream_t *stream);
+static void prv_stream_free(estrella_stream_t *stream);
+static int prv_stream_done(estrella_stream_t *stream);
+static estrella_stream_t *prv_stream_get(estrella_session_t *session);
+static void prv_stream_put(estrella_stream_t *stream);
+static prv_slot_t *prv_slot_get(estrella_stream_t *stream);
+static void prv_slot_put(prv_slot_t *slot);
+
+/* Guards the stream pointer of all sessions. Clients look up the stream and
+ * register as its users while holding it, so estrella_stream_stop() can't pull
+ * the stream out from under them. */
+static pthread_mutex_t prv_stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* ######################################################################### */
+/*                           Implementation                                  */
+/* ######################################################################### */
+
+void prv_stream_notify(estrella_stream_t *stream)
+{
+    pthread_mutex_lock(&stream->mutex);
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+void prv_stream_free(estrella_stream_t *stream)
+{
+    pthread_cond_destroy(&stream->cond);
+    pthread_mutex_destroy(&stream->mutex);
+    estrella_free(stream->ring);
+    estrella_free(stream->pool);
+    estrella_free(stream);
+}
+
+/* To be called with the stream's mutex held */
+int prv_stream_done(estrella_stream_t *stream)
+{
+    return (stream->stopped && (__atomic_load_n(&stream->leased, __ATOMIC_ACQUIRE) == 0) && (stream->users == 0));
+}
+
+estrella_stream_t *prv_stream_get(estrella_session_t *session)
+{
+    estrella_stream_t *stream;
+
+    pthread_mutex_lock(&prv_stream_mutex);
+    stream = session->stream;
+    if (stream) {
+        pthread_mutex_lock(&stream->mutex);
+        stream->users++;
+        pthread_mutex_unlock(&stream->mutex);
+    }
+    pthread_mutex_unlock(&prv_stream_mutex);
+
+    return stream;
+}
+
+void prv_stream_put(estrella_stream_t *stream)
+{
+    int done;
+
+    pthread_mutex_lock(&stream->mutex);
+    stream->users--;
+    done = prv_stream_done(stream);
+    pthread_mutex_unlock(&stream->mutex);
+
+    /* The last user of a stopped stream turns off the lights */
+    if (done)
+        prv_stream_free(stream);
+}
+
+/* To be called by the acquisition thread only */
+prv_slot_t *prv_slot_get(estrella_stream_t *stream)
+{
+    prv_slot_t *slot;
+
+    /* Nobody else pops off the returned stack, so taking all of it at once
+     * can't run into a frame which is popped and pushed again meanwhile */
+    if (!stream->cache)
+        stream->cache = __atomic_exchange_n(&stream->returned, NULL, __ATOMIC_ACQUIRE);
+
+    slot = stream->cache;
+    if (slot)
+        stream->cache = slot->next;
+
+    return slot;
+}
+
+/* Hands a frame leased by a client back to the pool */
+void prv_slot_put(prv_slot_t *slot)
+{
+    int done;
+    estrella_stream_t *stream = slot->stream;
+
+    /* Back on the stack before the lease is gone, the stream may be freed
+     * right after */
+    slot->next = __atomic_load_n(&stream->returned, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&stream->returned, &slot->next, slot, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    pthread_mutex_lock(&stream->mutex);
+    __atomic_sub_fetch(&stream->leased, 1, __ATOMIC_RELEASE);
+    done = prv_stream_done(stream);
+    pthread_mutex_unlock(&stream->mutex);
+
+    /* The last frame of a stopped stream turns off the lights */
+    if (done)
+        prv_stream_free(stream);
+}
+
+void *prv_stream_thread(void *arg)
+{
+    int rc;
+    unsigned long sequence = 0;
+    estrella_stream_t *stream = (estrella_stream_t*)arg;
+    estrella_session_t *session = stream->session;
+
+    /* Kick off the first integration */
+    rc = estrella_start(session);
+
+    while ((rc == ESTROK) && __atomic_load_n(&stream->running, __ATOMIC_SEQ_CST)) {
+        estrella_frame_t *frame;
+        prv_slot_t *slot;
+        unsigned long head;
+
+        /* Get a free frame. If the clients hold on to all of them we still
+         * have to fetch the data from the device, so it goes to the scratch
+         * frame and is thrown away afterwards. */
+        slot = prv_slot_get(stream);
+        if (slot)
+            frame = &slot->frame;
+        else
+            frame = &stream->scratch;
+
+        /* The data goes straight to the frame, no copies */
+        rc = estrella_result(session, frame->data);
+        memcpy(&frame->time, &session->frametime, sizeof(estr_frametime_t));
+        frame->sequence = sequence++;
+
+        if (frame->time.received) {
+            estr_timestamp_t received;
+
+            received.tv_sec = (time_t)(frame->time.received/(1000*1000*1000));
+            received.tv_nsec = (long)(frame->time.received%(1000*1000*1000));
+            estrella_timestamp_realtime(&received, &frame->timestamp);
+        }
+
+        /* Get the detector going again before we do anything else */
+        if (__atomic_load_n(&stream->running, __ATOMIC_ACQUIRE)) {
+            if (rc == ESTRTIMEOUT) {
+                __atomic_add_fetch(&stream->timeouts, 1, __ATOMIC_RELAXED);
+                rc = ESTROK;
+            } else if (rc == ESTRCANCEL) {
+                /* Somebody gave up on this one, the stream goes on */
+                rc = ESTROK;
+            } else if ((rc == ESTROK) && !slot) {
+                __atomic_add_fetch(&stream->overruns, 1, __ATOMIC_RELAXED);
+            } else if (rc == ESTROK) {
+                /* Publish the frame, the ring holds the first reference */
+                slot->refs = 1;
+                head = stream->head;
+                stream->ring[head % stream->size] = slot;
+                __atomic_store_n(&stream->head, head+1, __ATOMIC_SEQ_CST);
+                slot = NULL;
+
+                /* Pairs with the consumer registering before it checks the
+                 * ring once more, so one of us sees the other */
+                if (__atomic_load_n(&stream->waiters, __ATOMIC_SEQ_CST) > 0)
+                    prv_stream_notify(stream);
+            }
+
+            if (rc == ESTROK)
+                rc = estrella_start(session);
+        }
+
+        /* Frames which have not been published go back to the cache */
+        if (slot) {
+            slot->next = stream->cache;
+            stream->cache = slot;
+        }
+    }
+
+    /* Let waiting consumers know that there won't be any more frames */
+    if (rc != ESTROK) {
+        __atomic_store_n(&stream->error, rc, __ATOMIC_RELEASE);
+        prv_stream_notify(stream);
+    }
+
+    return NULL;
+}
+
+int estrella_stream_start(estrella_session_t *session, int frames)
+{
+    int rc, i;
+    estrella_stream_t *stream;
+
+    if (!session)
+        return ESTRINV;
+
+    if (frames < 2)
+        return ESTRINV;
+
+    if ((session->dev.devicetype != ESTRELLA_DEV_USB) &&
+        (session->dev.devicetype != ESTRELLA_DEV_SIM))
+        return ESTRNOTIMPL;
+
+    /* Either a stream or an async scan is active */
+    if (estrella_lock(&session->lock) != ESTROK)
+        return ESTRALREADY;
+
+    stream = (estrella_stream_t*)estrella_malloc(sizeof(estrella_stream_t));
+    if (!stream) {
+        estrella_unlock(&session->lock);
+        return ESTRNOMEM;
+    }
+
+    memset(stream, 0, sizeof(estrella_stream_t));
+
+    /* All frames are allocated up front, the acquisition thread never
+     * allocates anything */
+    stream->pool = (prv_slot_t*)estrella_malloc(frames*sizeof(prv_slot_t));
+    stream->ring = (prv_slot_t**)estrella_malloc(frames*sizeof(prv_slot_t*));
+    if (!stream->pool || !stream->ring) {
+        estrella_free(stream->ring);
+        estrella_free(stream->pool);
+        estrella_free(stream);
+        estrella_unlock(&session->lock);
+        return ESTRNOMEM;
+    }
+
+    for (i=0;i<frames;i++) {
+        stream->pool[i].refs = 0;
+        stream->pool[i].stream = stream;
+        stream->pool[i].next = stream->cache;
+        stream->cache = &stream->pool[i];
+    }
+
+    stream->session = session;
+    stream->size = (unsigned long)frames;
+    stream->running = 1;
+    stream->error = ESTROK;
+    pthread_mutex_init(&stream->mutex, NULL);
+    if (estrella_cond_init(&stream->cond) != ESTROK) {
+        pthread_mutex_destroy(&stream->mutex);
+        estrella_free(stream->ring);
+        estrella_free(stream->pool);
+        estrella_free(stream);
+        estrella_unlock(&session->lock);
+        return ESTRERR;
+    }
+
+    rc = pthread_create(&stream->thread, NULL, prv_stream_thread, stream);
+    if (rc != 0) {
+        estrella_unlock(&session->lock);
+        prv_stream_free(stream);
+        return ESTRERR;
+    }
+
+    pthread_mutex_lock(&prv_stream_mutex);
+    session->stream = stream;
+    pthread_mutex_unlock(&prv_stream_mutex);
+
+    return ESTROK;
+}
+
+int estrella_frame_acquire(estrella_session_t *session, estrella_frame_t **frame, int timeout)
+{
+    int rc;
+    unsigned long head, tail;
+    estrella_stream_t *stream;
+    estr_timestamp_t deadline;
+    prv_slot_t *slot;
+
+    if (!session)
+        return ESTRINV;
+
+    if (!frame)
+        return ESTRINV;
+
+    stream = prv_stream_get(session);
+    if (!stream)
+        return ESTRINV;
+
+    /* Absolute deadline for pthread_cond_timedwait() */
+    if (timeout > 0)
+        estrella_timestamp_deadline(&deadline, (unsigned long)timeout*1000);
+
+    pthread_mutex_lock(&stream->mutex);
+    rc = 0;
+    for (;;) {
+        /* Stopped meanwhile, whatever is on the ring is going to be
+         * discarded */
+        if (!__atomic_load_n(&stream->running, __ATOMIC_ACQUIRE)) {
+            rc = ESTRINV;
+            break;
+        }
+
+        tail = stream->tail;
+        head = __atomic_load_n(&stream->head, __ATOMIC_ACQUIRE);
+        if (head != tail) {
+            rc = ESTROK;
+            break;
+        }
+
+        /* The acquisition thread is gone, nothing more to come */
+        if (__atomic_load_n(&stream->error, __ATOMIC_ACQUIRE) != ESTROK) {
+            rc = ESTRERR;
+            break;
+        }
+
+        /* Clients hold every single frame, waiting won't help */
+        if (__atomic_load_n(&stream->leased, __ATOMIC_ACQUIRE) == stream->size) {
+            rc = ESTRBUSY;
+            break;
+        }
+
+        if ((timeout == 0) || (rc == ETIMEDOUT)) {
+            rc = ESTRTIMEOUT;
+            break;
+        }
+
+        /* Let the producer know that we need a wakeup call, then make sure
+         * nothing has come in before it could see us */
+        __atomic_add_fetch(&stream->waiters, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&stream->head, __ATOMIC_SEQ_CST) == tail) {
+            if (timeout < 0)
+                rc = pthread_cond_wait(&stream->cond, &stream->mutex);
+            else
+                rc = pthread_cond_timedwait(&stream->cond, &stream->mutex, &deadline);
+        }
+        __atomic_sub_fetch(&stream->waiters, 1, __ATOMIC_RELAXED);
+    }
+
+    /* Take over the reference of the ring. The tail is only advanced with the
+     * mutex held, so estrella_stream_stop() can't discard the frame
+     * meanwhile. */
+    if (rc == ESTROK) {
+        slot = stream->ring[tail % stream->size];
+        __atomic_add_fetch(&stream->leased, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&stream->tail, tail+1, __ATOMIC_RELEASE);
+        *frame = &slot->frame;
+    }
+    pthread_mutex_unlock(&stream->mutex);
+
+    prv_stream_put(stream);
+
+    return rc;
+}
+
+int estrella_frame_retain(estrella_frame_t *frame)
+{
+    prv_slot_t *slot = (prv_slot_t*)frame;
+
+    if (!frame)
+        return ESTRINV;
+
+    __atomic_add_fetch(&slot->refs, 1, __ATOMIC_RELAXED);
+
+    return ESTROK;
+}
+
+int estrella_frame_release(estrella_frame_t *frame)
+{
+    prv_slot_t *slot = (prv_slot_t*)frame;
+
+    if (!frame)
+        return ESTRINV;
+
+    if (__atomic_sub_fetch(&slot->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        prv_slot_put(slot);
+
+    return ESTROK;
+}
+
+int estrella_stream_read(estrella_session_t *session, estrella_frame_t *frame, int timeout)
+{
+    int rc;
+    estrella_frame_t *leased;
+
+    if (!frame)
+        return ESTRINV;
+
+    rc = estrella_frame_acquire(session, &leased, timeout);
+    if (rc != ESTROK)
+        return rc;
+
+    memcpy(frame, leased, sizeof(estrella_frame_t));
+    estrella_frame_release(leased);
+
+    return ESTROK;
+}
+
+int estrella_stream_status(estrella_session_t *session, unsigned long *overruns, unsigned long *timeouts)
+{
+    estrella_stream_t *stream;
+
+    if (!session)
+        return ESTRINV;
+
+    stream = prv_stream_get(session);
+    if (!stream)
+        return ESTRINV;
+
+    if (overruns)
+        *overruns = __atomic_load_n(&stream->overruns, __ATOMIC_RELAXED);
+    if (timeouts)
+        *timeouts = __atomic_load_n(&stream->timeouts, __ATOMIC_RELAXED);
+
+    prv_stream_put(stream);
+
+    return ESTROK;
+}
+
+int estrella_stream_stop(estrella_session_t *session)
+{
+    int done;
+    estrella_stream_t *stream;
+
+    if (!session)
+        return ESTRINV;
+
+    /* Nobody gets to see this stream anymore */
+    pthread_mutex_lock(&prv_stream_mutex);
+    stream = session->stream;
+    session->stream = NULL;
+    pthread_mutex_unlock(&prv_stream_mutex);
+
+    if (!stream)
+        return ESTRINV;
+
+    /* The thread finishes the scan in progress and leaves the device idle.
+     * Don't wait for a trigger pulse which may never come though. The thread
+     * checks 'running' after starting a scan, so either it sees the flag or
+     * the scan gets cancelled. Consumers waiting for a frame give up as
+     * well. */
+    __atomic_store_n(&stream->running, 0, __ATOMIC_SEQ_CST);
+    if (session->xtmode == ESTR_XTMODE_TRIGGER)
+        estrella_cancel(session);
+    prv_stream_notify(stream);
+    pthread_join(stream->thread, NULL);
+
+    /* Our own cancellation request may not have found a scan to cancel */
+    session->cancelmark = __atomic_load_n(&session->cancels, __ATOMIC_SEQ_CST);
+
+    estrella_unlock(&session->lock);
+
+    /* Frames not yet read are simply dropped along with the stream. Frames
+     * leased by clients stay valid until they are released, consumers still
+     * on their way out of estrella_frame_acquire() keep the stream itself
+     * around. */
+    pthread_mutex_lock(&stream->mutex);
+    stream->tail = stream->head;
+    stream->stopped = 1;
+    done = prv_stream_done(stream);
+    pthread_mutex_unlock(&stream->mutex);
+
+    if (done)
+        prv_stream_free(stream);
+
+    return ESTROK;
+}
@@ -27,10 +27,15 @@
 */
 
 #include <string.h>
+#include <pthread.h>
+#include <usb.h>
 
 #include "estrella.h"
 #include "estrella_private.h"
 #include "estrella_usb.h"
+#include "estrella_registry.h"
+#include "estrella_dsp.h"
+#include "estrella_firmware.h"
 
 /* ######################################################################### */
 /*                            TODO / Notes                                   */
@@ -43,39 +48,52 @@
 /* When a scan takes (rate + PRV_DELAY)ms we consider it a timeout */
 #define PRV_DELAY           (100)
 
-/* This is how long we wait (ms) for devices to reenumerate after firmware
- * upload */
+/* This is how long we wait (ms) at most for devices to reenumerate after
+ * firmware upload, and how often (ms) we look for them meanwhile */
 #define PRV_WAITFORDEVICE   (2000)
+#define PRV_POLLDEVICE      (50)
 
 struct usb_ident {
     int id_vendor;
     int id_product;
 };
 
+/* One firmware upload running in its own thread */
+typedef struct {
+    struct usb_device *dev;
+    const estrella_fw_t *fw;
+    pthread_t thread;
+    int started;
+    estrella_upload_t report;
+} prv_upload_job_t;
+
 /* ######################################################################### */
 /*                           Private interface (Module)                      */
 /* ######################################################################### */
 
-static int prv_usb_preup(void);
-static int prv_usb_upload_firmware(struct usb_device *dev);
-static int prv_usb_find_devices(dll_list_t *devices);
+static int prv_usb_preup(dll_list_t *reports, int *uploaded);
+static int prv_usb_count_devices(void);
+static int prv_usb_wait_devices(int expected);
+static int prv_usb_cpucs(struct usb_dev_handle *usb_handle, char hold, int *step);
+static int prv_usb_upload_firmware(struct usb_device *dev, const estrella_fw_t *fw, int *failed);
+static void *prv_usb_upload_thread(void *arg);
+static int prv_usb_find_devices(dll_list_t *devices, dll_list_t *known);
+static struct usb_device *prv_usb_lookup(estrella_dev_t *device);
 static int prv_usb_get_handle(estrella_dev_t *device, struct usb_dev_handle **handle);
 static int prv_usb_device_info(struct usb_device *dev, estrella_dev_t *device);
 
-static unsigned char estrella_init_req_data[] = {0x00,0x12,0x10,0x1f,0xe0,0x40};
-static unsigned char estrella_rate_req_data_reset[] = {0x00,0x00,0x04,0x20,0xe0,0x40};
-static unsigned char estrella_rate_req_data[] = {0x00,0x00,0x04,0x20,0xe0,0x40};
-static unsigned char progress[2];
+/* Request payload templates. These are copied to the session's usbbuf before
+ * being modified or sent, nothing in here is ever written to. */
+static const unsigned char estrella_init_req_data[] = {0x00,0x12,0x10,0x1f,0xe0,0x40};
+static const unsigned char estrella_rate_req_data_reset[] = {0x00,0x00,0x04,0x20,0xe0,0x40};
 
 /* ######################################################################### */
 /*                           Implementation                                  */
 /* ######################################################################### */
 
-/* To upload the firmware to the usb devices we pretty much just roll back the
- * sniffed transactions from the windows driver. These are the necessary
- * requests. */
-extern estrella_usb_request_t usb_preup_req[];
-extern size_t usb_preup_req_size;
+/* CPU control registers to write when resetting the device's CPU for firmware
+ * upload */
+static const int usb_cpucs[] = {ESTRELLA_FW_CPUCS_FX, ESTRELLA_FW_CPUCS_FX2};
 
 /* These are the uninitialized usb devices on the bus. */
 static struct usb_ident usb_devices_preup[] = {
@@ -135,15 +153,10 @@ int prv_usb_device_info(struct usb_device *dev, estrella_dev_t *device)
     return ESTROK;
 }
 
-int prv_usb_get_handle(estrella_dev_t *device, struct usb_dev_handle **handle)
+struct usb_device *prv_usb_lookup(estrella_dev_t *device)
 {
     struct usb_bus *usb_bus;
     struct usb_device *dev;
-    struct usb_dev_handle *usb_handle = NULL;
-
-    /* Update bus and device information */
-    usb_find_busses();
-    usb_find_devices();
 
     /* Find the requested bus */
     for (usb_bus=usb_busses;usb_bus;usb_bus=usb_bus->next) {
@@ -152,7 +165,7 @@ int prv_usb_get_handle(estrella_dev_t *device, struct usb_dev_handle **handle)
     }
 
     if (usb_bus == NULL)
-        return ESTRINV;
+        return NULL;
 
     /* Find the requested device */
     for (dev=usb_bus->devices;dev;dev=dev->next) {
@@ -160,6 +173,23 @@ int prv_usb_get_handle(estrella_dev_t *device, struct usb_dev_handle **handle)
             break;
     }
 
+    return dev;
+}
+
+int prv_usb_get_handle(estrella_dev_t *device, struct usb_dev_handle **handle)
+{
+    struct usb_device *dev;
+    struct usb_dev_handle *usb_handle = NULL;
+
+    /* The bus information libusb still holds from discovery is usually good
+     * enough. Only rescan the busses if the device is not in there. */
+    dev = prv_usb_lookup(device);
+    if (dev == NULL) {
+        usb_find_busses();
+        usb_find_devices();
+        dev = prv_usb_lookup(device);
+    }
+
     if (dev == NULL)
         return ESTRINV;
 
@@ -174,11 +204,27 @@ int prv_usb_get_handle(estrella_dev_t *device, struct usb_dev_handle **handle)
     return ESTROK;
 }
 
-int prv_usb_preup(void)
+int prv_usb_preup(dll_list_t *reports, int *uploaded)
 {
     struct usb_bus *usb_bus;
     struct usb_device *dev;
-    int i;
+    const estrella_fw_t *fw;
+    size_t len;
+    dll_list_t jobs;
+    dll_iterator_t it;
+    void *item = NULL;
+    int rc, i;
+
+    *uploaded = 0;
+
+    rc = dll_init(&jobs);
+    if (rc != EDLLOK)
+        return ESTRERR;
+
+    /* All devices get the same image which must not change meanwhile */
+    fw = estrella_fw_acquire();
+    if (fw == NULL)
+        return ESTRNOMEM;
 
     /* Update bus and device information */
     usb_find_busses();
@@ -193,23 +239,158 @@ int prv_usb_preup(void)
 
                 if ((dev->descriptor.idVendor == usb_devices_preup[i].id_vendor) &&
                     (dev->descriptor.idProduct == usb_devices_preup[i].id_product)) {
+                    prv_upload_job_t *job = NULL;
 
-                    /* Load the firmware. We don't really care if it fails or
-                     * succeeds at this point, we'll see later. */
-                    prv_usb_upload_firmware(dev);
+                    rc = dll_append(&jobs, (void**)&job, sizeof(prv_upload_job_t));
+                    if (rc != EDLLOK) {
+                        dll_clear(&jobs);
+                        estrella_fw_release();
+                        return ESTRNOMEM;
+                    }
+
+                    memset(job, 0, sizeof(prv_upload_job_t));
+                    job->dev = dev;
+                    job->fw = fw;
+                    len = strlen(usb_bus->dirname);
+                    if (len >= ESTRELLA_PATH_MAX)
+                        len = ESTRELLA_PATH_MAX-1;
+                    memcpy(job->report.bus, usb_bus->dirname, len);
+                    job->report.devnum = dev->devnum;
                 }
             }
         }
     }
 
+    /* Every device gets its own thread since each upload is a long series of
+     * synchronous control transfers. Should we fail to create a thread we do
+     * that upload right here instead. */
+    dll_iterator_init(&it, &jobs);
+    while (dll_iterator_next(&it, &item, NULL) == EDLLOK) {
+        prv_upload_job_t *job = (prv_upload_job_t*)item;
+
+        if (pthread_create(&job->thread, NULL, prv_usb_upload_thread, job) == 0)
+            job->started = 1;
+        else
+            prv_usb_upload_thread(job);
+    }
+
+    /* Collect the results. We need to know how many devices are going to
+     * show up again. */
+    dll_iterator_init(&it, &jobs);
+    while (dll_iterator_next(&it, &item, NULL) == EDLLOK) {
+        prv_upload_job_t *job = (prv_upload_job_t*)item;
+
+        if (job->started)
+            pthread_join(job->thread, NULL);
+
+        if (job->report.result == ESTROK)
+            (*uploaded)++;
+
+        if (reports) {
+            void *newitem = NULL;
+
+            if (dll_append(reports, &newitem, sizeof(estrella_upload_t)) == EDLLOK)
+                memcpy(newitem, &job->report, sizeof(estrella_upload_t));
+        }
+    }
+
+    dll_clear(&jobs);
+    estrella_fw_release();
+
+    return ESTROK;
+}
+
+void *prv_usb_upload_thread(void *arg)
+{
+    prv_upload_job_t *job = (prv_upload_job_t*)arg;
+    estr_timestamp_t ts_start, ts_end;
+
+    estrella_timestamp_get(&ts_start);
+    job->report.result = prv_usb_upload_firmware(job->dev, job->fw, &job->report.failed);
+    estrella_timestamp_get(&ts_end);
+
+    estrella_timestamp_diffms(&ts_start, &ts_end, &job->report.elapsed);
+
+    return NULL;
+}
+
+int prv_usb_count_devices(void)
+{
+    struct usb_bus *usb_bus;
+    struct usb_device *dev;
+    int i, count = 0;
+
+    /* Update bus and device information */
+    usb_find_busses();
+    usb_find_devices();
+
+    for (usb_bus=usb_busses;usb_bus;usb_bus=usb_bus->next) {
+        for (dev=usb_bus->devices;dev;dev=dev->next) {
+            for (i=0;i<(sizeof(usb_devices)/sizeof(struct usb_ident));i++) {
+                if ((dev->descriptor.idVendor == usb_devices[i].id_vendor) &&
+                    (dev->descriptor.idProduct == usb_devices[i].id_product))
+                    count++;
+            }
+        }
+    }
+
+    return count;
+}
+
+int prv_usb_wait_devices(int expected)
+{
+    int rc;
+    unsigned long mspassed = 0;
+    estr_timestamp_t ts_start, ts_current;
+
+    rc = estrella_timestamp_get(&ts_start);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    /* Poll the busses until all devices are back or we run out of time. If
+     * some of them don't show up we just carry on with those that did. */
+    while (prv_usb_count_devices() < expected) {
+        if (mspassed >= PRV_WAITFORDEVICE)
+            return ESTRTIMEOUT;
+
+        estrella_usleep(PRV_POLLDEVICE*1000, NULL);
+
+        rc = estrella_timestamp_get(&ts_current);
+        if (rc != ESTROK)
+            return ESTRERR;
+
+        rc = estrella_timestamp_diffms(&ts_start, &ts_current, &mspassed);
+        if (rc != ESTROK)
+            return ESTRERR;
+    }
+
+    return ESTROK;
+}
+
+int prv_usb_cpucs(struct usb_dev_handle *usb_handle, char hold, int *step)
+{
+    int rc, i;
+
+    for (i=0;i<(sizeof(usb_cpucs)/sizeof(int));i++) {
+        rc = usb_control_msg(usb_handle, USB_TYPE_VENDOR, ESTRELLA_FW_REQUEST,
+                usb_cpucs[i], 0, &hold, 1, 5000);
+        if (rc < 0)
+            return ESTRERR;
+
+        (*step)++;
+    }
+
     return ESTROK;
 }
 
-int prv_usb_upload_firmware(struct usb_device *dev)
+int prv_usb_upload_firmware(struct usb_device *dev, const estrella_fw_t *fw, int *failed)
 {
     struct usb_dev_handle *usb_handle = NULL;
+    unsigned int addr = 0, size;
     int rc;
-    int i;
+    int step = 0;
+
+    *failed = -1;
 
     if (!dev)
         return ESTRINV;
@@ -219,30 +400,34 @@ int prv_usb_upload_firmware(struct usb_device *dev)
     if (usb_handle == NULL)
         return ESTRERR;
 
-    /* Replay the captured USB traffic from the windows driver */
-    for (i=0;i<(usb_preup_req_size/sizeof(estrella_usb_request_t));i++) {
-        rc = usb_control_msg(
-                usb_handle,
-                usb_preup_req[i].requesttype | USB_TYPE_VENDOR, 
-                usb_preup_req[i].request, 
-                usb_preup_req[i].value, 
-                usb_preup_req[i].index, 
-                (char*)usb_preup_req[i].data, 
-                usb_preup_req[i].size, 
-                5000);
+    /* Hold the CPU in reset, write the image in as few transfers as possible
+     * and let the CPU run again. Transfers are counted so we can tell where an
+     * upload failed. */
+    rc = prv_usb_cpucs(usb_handle, 1, &step);
 
-        if (rc < 0) {
-            usb_close(usb_handle);
-            return ESTRERR;
+    while ((rc == ESTROK) && (estrella_fw_segment(fw, &addr, &size) == ESTROK)) {
+        if (usb_control_msg(usb_handle, USB_TYPE_VENDOR, ESTRELLA_FW_REQUEST,
+                    (int)addr, 0, (char*)&fw->data[addr], (int)size, 5000) < 0) {
+            rc = ESTRERR;
+            break;
         }
-    }    
+
+        addr += size;
+        step++;
+    }
+
+    if (rc == ESTROK)
+        rc = prv_usb_cpucs(usb_handle, 0, &step);
+
+    if (rc != ESTROK)
+        *failed = step;
 
     /* Close the device */
     usb_close(usb_handle);
-    return ESTROK;
+    return rc;
 }
 
-int prv_usb_find_devices(dll_list_t *devices)
+int prv_usb_find_devices(dll_list_t *devices, dll_list_t *known)
 {
     struct usb_bus *usb_bus = NULL;
     struct usb_device *dev = NULL;
@@ -264,6 +449,7 @@ int prv_usb_find_devices(dll_list_t *devices)
 
                     void *tmpdev = NULL;
                     estrella_dev_t *newdev = NULL;
+                    estrella_dev_t *olddev = NULL;
 
                     /* Create a new list entry for this device */
                     rc = dll_append(devices, &tmpdev, sizeof(estrella_dev_t));
@@ -279,6 +465,15 @@ int prv_usb_find_devices(dll_list_t *devices)
                     newdev->spec.usb.devnum = dev->devnum;
                     strncpy(newdev->spec.usb.bus, usb_bus->dirname, ESTRELLA_PATH_MAX);
 
+                    /* If we have seen this device before there's no need to
+                     * open it again */
+                    if (known)
+                        olddev = estrella_registry_lookup(known, newdev);
+                    if (olddev) {
+                        memcpy(newdev, olddev, sizeof(estrella_dev_t));
+                        continue;
+                    }
+
                     /* Add some additional info from the device descriptor */
                     rc = prv_usb_device_info(dev, newdev);
                     if (rc != ESTROK) {
@@ -293,29 +488,53 @@ int prv_usb_find_devices(dll_list_t *devices)
     return ESTROK;
 }
 
-int estrella_usb_find_devices(dll_list_t *devices)
+int estrella_usb_upload(dll_list_t *reports)
+{
+    int rc;
+    int present, uploaded;
+
+    /* Call usb_init, we don't know if the library has already been initialized */
+    usb_init();
+
+    present = prv_usb_count_devices();
+
+    rc = prv_usb_preup(reports, &uploaded);
+    if (rc != ESTROK)
+        return rc;
+
+    if (uploaded > 0)
+        prv_usb_wait_devices(present + uploaded);
+
+    return ESTROK;
+}
+
+int estrella_usb_find_devices(dll_list_t *devices, dll_list_t *known)
 {
     int rc;
+    int present, uploaded;
 
     /* Call usb_init, we don't know if the library has already been initialized */
     usb_init();
+
+    /* Devices which already have their firmware */
+    present = prv_usb_count_devices();
   
     /* Iterate all the busses and devices and in a first run try to find
      * uninitialized USB devices. If we find any we try to provide them with the
      * necessary firmware.*/
-    rc = prv_usb_preup();
+    rc = prv_usb_preup(NULL, &uploaded);
     if (rc != ESTROK)
         return ESTRERR;
 
-    /* We need to wait a little for all the devices to reenumerate and show up
-     * on the bus. This is not particularly nice but I don't really know what
-     * else to do... apart from polling all busses for reenumerated devices
-     * maybe */
-    estrella_usleep(PRV_WAITFORDEVICE*1000, NULL);
+    /* We need to wait for the devices we just uploaded firmware to to
+     * reenumerate and show up on the bus. There's nothing to wait for if we
+     * didn't upload anything. */
+    if (uploaded > 0)
+        prv_usb_wait_devices(present + uploaded);
 
     /* Correctly initialized devices now show up on the bus with a different
      * vendor/product ID. We're now going to search for those and return them */
-    rc = prv_usb_find_devices(devices);
+    rc = prv_usb_find_devices(devices, known);
     if (rc != ESTROK)
         return ESTRERR;
 
@@ -333,10 +552,12 @@ int estrella_usb_init(estrella_session_t *session, estrella_dev_t *device)
         0xb4,
         0x0000,
         0x0000,
-        sizeof(estrella_init_req_data),
-        estrella_init_req_data,
+        sizeof(session->usbbuf.setup),
+        session->usbbuf.setup,
     };
 
+    memcpy(session->usbbuf.setup, estrella_init_req_data, sizeof(session->usbbuf.setup));
+
     /* First of all get the device handle */
     rc = prv_usb_get_handle(device, &handle);
     if (rc != ESTROK)
@@ -397,8 +618,8 @@ int estrella_usb_rate(estrella_session_t *session, int rate, estr_xtrate_t xtrat
         0xb4,
         0x0000,
         0x0000,
-        sizeof(estrella_rate_req_data),
-        estrella_rate_req_data,
+        sizeof(session->usbbuf.setup),
+        session->usbbuf.setup,
     };
 
     if (session->spec.usb_dev_handle == NULL)
@@ -406,12 +627,12 @@ int estrella_usb_rate(estrella_session_t *session, int rate, estr_xtrate_t xtrat
 
     /* For whatever reason we have to subtract 1 from estrella_init_req_data[3]
      * in case we want to use integration times >= 5 ms. */
-    memcpy(estrella_rate_req_data, estrella_rate_req_data_reset, sizeof(estrella_rate_req_data));
-    estrella_rate_req_data[1] = (unsigned char)(rate & 0xFF);
-    estrella_rate_req_data[0] = (unsigned char)((rate >> 8) & 0xFF);
+    memcpy(session->usbbuf.setup, estrella_rate_req_data_reset, sizeof(session->usbbuf.setup));
+    session->usbbuf.setup[1] = (unsigned char)(rate & 0xFF);
+    session->usbbuf.setup[0] = (unsigned char)((rate >> 8) & 0xFF);
 
     if (rate >= 5)
-        estrella_rate_req_data[3] -= 1;
+        session->usbbuf.setup[3] -= 1;
 
     /* Adjust x timing resolution. It's either 0x04, 0x08 or 0x10 in data[2].
      * This is pretty much all I could figure out from the sniffed logs. There
@@ -421,9 +642,9 @@ int estrella_usb_rate(estrella_session_t *session, int rate, estr_xtrate_t xtrat
      * about 0.7 for medium and 0.6 for high resolution. Don't now if we should
      * follow suit on this one. It does not really seem necessary anyway. */
     if (xtrate == ESTR_XRES_MEDIUM)
-        estrella_rate_req_data[2] = 0x08;
+        session->usbbuf.setup[2] = 0x08;
     else if (xtrate == ESTR_XRES_HIGH) 
-        estrella_rate_req_data[2] = 0x10;
+        session->usbbuf.setup[2] = 0x10;
 
     rc = usb_control_msg(
             session->spec.usb_dev_handle,
@@ -470,17 +691,21 @@ int estrella_usb_scan_init(estrella_session_t *session)
     if (rc < 0)
         return ESTRERR;
 
+    /* Remember when integration started, estrella_usb_scan_result() uses this
+     * to decide when to start asking for completion */
+    rc = estrella_timestamp_get(&session->scanstart);
+    if (rc != ESTROK)
+        return ESTRERR;
+
     return ESTROK;
 }
 
 
-int estrella_usb_scan_result(estrella_session_t *session, float *buffer)
+int estrella_usb_scan_result_raw(estrella_session_t *session, uint16_t *raw)
 {
-    int rc;
-    int i;
+    int rc, wait;
     unsigned char response;
-    unsigned char scanbuf[4096];
-    estr_timestamp_t ts_start, ts_current;
+    unsigned long interval;
 
     /* Data is being read from this endpoint adress */
     int endpoint_bulk_in = 0x88;
@@ -494,16 +719,20 @@ int estrella_usb_scan_result(estrella_session_t *session, float *buffer)
         0xb3,
         0x0000,
         0x0000,
-        sizeof(progress),
-        progress,
+        sizeof(session->usbbuf.status),
+        session->usbbuf.status,
     };
 
-    /* Time at beginning of scan */
-    rc = estrella_timestamp_get(&ts_start);
+    /* There's no point in asking the device before integration is almost
+     * done, so sleep until then. */
+    rc = estrella_wait_presleep(session);
     if (rc != ESTROK)
         return ESTRERR;
 
     response = 0;
+    interval = 0;
+    wait = ESTROK;
+    session->polls = 0;
     while (1==1) {
 
         rc = usb_control_msg(
@@ -519,72 +748,53 @@ int estrella_usb_scan_result(estrella_session_t *session, float *buffer)
             break;    
         }
 
-        /* If we're in normal operation mode we eventually need to break with a
-         * timeout. This is being checked here. */
-        if (session->xtmode != ESTR_XTMODE_TRIGGER) {
-            unsigned long mspassed;
-
-            rc = estrella_timestamp_get(&ts_current);
-            if (rc != ESTROK)
-                return ESTRERR;
+        session->polls++;
+        session->totalpolls++;
 
-            rc = estrella_timestamp_diffms(&ts_start, &ts_current, &mspassed);
-            if (rc != ESTROK)
-                return ESTRERR;
-
-            if (mspassed >= (session->rate + PRV_DELAY))
-                break;
-        }
-
-        /* Either we're done scanning or we wait a bit to do the next request
-         * for completion. */
-        if (progress[1] == 0x01) {
+        /* We're done scanning */
+        if (session->usbbuf.status[1] == 0x01) {
             response = 1;
             break;
-        } else {
-            /* We don't care if this succeeds of fails, just go on to the next
-             * ieration. */
-            estrella_usleep(500, NULL);
         }
+
+        /* We eventually need to break with a timeout, unless we're waiting
+         * for a trigger. We also may have been cancelled. */
+        wait = estrella_wait_check(session, (unsigned long)(session->rate + PRV_DELAY));
+        if (wait != ESTROK)
+            break;
+
+        /* Wait a bit to do the next request for completion, backing off
+         * according to the session's wait policy. */
+        estrella_wait_next(session, &interval);
     }
 
     /* We did not get a valid response from the device. Return a timeout only in
-     * normal operations mode */
+     * normal operations mode, unless we gave up waiting for a reason. */
     if (response != 1) {
+        if (wait != ESTROK)
+            return wait;
         if (session->xtmode != ESTR_XTMODE_TRIGGER)
             return ESTRTIMEOUT;
         else 
             return ESTRERR;
     }
+
+    estrella_wait_complete(session);
         
     /* Now get the data */
     rc = usb_bulk_read(
             session->spec.usb_dev_handle, 
             endpoint_bulk_in, 
-            (char*)scanbuf, 
-            sizeof(scanbuf), 
+            (char*)raw, 
+            ESTRELLA_RAW_WORDS*2, 
             4096);
     if (rc < 0)
         return ESTRERR;
 
-    /* Put the data that we got into the supplied buffer. For all I can see
-     * we're getting 2 bytes per value, which makes a total of 2048. I dont't
-     * know why the original API requests a 2051 elements buffer. Here's what
-     * they do anyway:
-     * Leave out the first value from the result set, which leaves us with 2047
-     * items. Those values are put into the result buffer from 0 to 2046. The
-     * remaining indices 2047 to 2050 are simply set to 0.
-     * No idea why it has to be a float buffer in the first place but well... */
-    for (i=2; i<4096;i+=2) {
-        unsigned short val = 0;
-        val |= scanbuf[i+1];
-        val = (val << 8);
-        val |= scanbuf[i];
-
-        buffer[(i-2)/2] = (float)val;
-    }
-    for (i=2047;i<2051;i++)
-        buffer[i] = 0.0;
+    /* For all I can see we're getting 2 bytes per value, which makes a total
+     * of 2048. The first one is a header word rather than a sample. */
+    estrella_le16(raw, ESTRELLA_RAW_WORDS);
+    estrella_wait_done(session);
 
     return ESTROK;
 }
@@ -38,6 +38,7 @@
 #define _ESTRELLA_USB_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include "estrella.h"
 #include "estrella_private.h"
 
@@ -82,13 +83,32 @@ typedef struct
  * Anyway, since the USB LPT adapter cable is the only cypress device on my USB
  * bus I'll stick with the automatic firmware uploading for now.
  *
+ * Devices which can be found in 'known' (matched by bus and device number)
+ * are taken from there instead of being opened to read their string
+ * descriptors, which makes refreshing a list of devices cheap.
+ *
  * @param devices       An initialized dll_list_t which is to be populated with
  *                      found devices
+ * @param known         Devices found previously, may be NULL
  *
  * @return ESTROK       No errors occured
  * @return ESTRERR      Device discovery failed    
  */
-int estrella_usb_find_devices(dll_list_t *devices);
+int estrella_usb_find_devices(dll_list_t *devices, dll_list_t *known);
+
+/** Upload firmware to uninitialized USB devices
+ *
+ * Uploads run concurrently, one thread per device. Waits for the devices
+ * which have been provided with firmware to reenumerate.
+ *
+ * @param reports       An initialized dll_list_t which is to be populated with
+ *                      one estrella_upload_t per device
+ *
+ * @return ESTROK       No errors occured, see reports for individual results
+ * @return ESTRNOMEM    Out of memory
+ * @return ESTRERR      Device discovery failed
+ */
+int estrella_usb_upload(dll_list_t *reports);
 
 /** Initialize a usb connected device
  *
@@ -139,17 +159,18 @@ int estrella_usb_rate(estrella_session_t *session, int rate, estr_xtrate_t xtrat
  */
 int estrella_usb_scan_init(estrella_session_t *session);
 
-/** Request results of a scan
+/** Request raw results of a scan
  *
  * @param session       Session
- * @param buffer        result buffer, array of float, 2051 elements wide
+ * @param raw           Result buffer, ESTRELLA_RAW_WORDS words in host byte
+ *                      order
  *
  * @return ESTROK       No errors occured
  * @return ESTRINV      A supplied input argument is invalid 
  * @return ESTRTIMEOUT  Scan timed out
  * @return ESTRERR      Scan failed
  */
-int estrella_usb_scan_result(estrella_session_t *session, float *buffer);
+int estrella_usb_scan_result_raw(estrella_session_t *session, uint16_t *raw);
 
 #endif /* _ESTRELLA_USB_H */
 
@@ -0,0 +1,1090 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <libusb.h>
+
+#include "estrella.h"
+#include "estrella_private.h"
+#include "estrella_usb.h"
+#include "estrella_registry.h"
+#include "estrella_dsp.h"
+#include "estrella_firmware.h"
+
+/* ######################################################################### */
+/*                            TODO / Notes                                   */
+/* ######################################################################### */
+
+/* BR: This is the libusb-1.0 counterpart of estrella_usb.c. It implements the
+ * very same private interface (estrella_usb.h) but uses asynchronous
+ * transfers. A single event thread per process handles the completions for
+ * all open devices. Each device keeps a bulk IN transfer submitted on the data
+ * endpoint at all times, so the data is already on its way to the host by the
+ * time the status request tells us the scan is complete.
+ *
+ * Discovery and firmware upload are not time critical and use the
+ * synchronous API. */
+
+/* ######################################################################### */
+/*                            Types & Defines                                */
+/* ######################################################################### */
+
+/* When a scan takes (rate + PRV_DELAY)ms we consider it a timeout */
+#define PRV_DELAY           (100)
+
+/* This is how long we wait (ms) at most for devices to reenumerate after
+ * firmware upload, and how often (ms) we look for them meanwhile */
+#define PRV_WAITFORDEVICE   (2000)
+#define PRV_POLLDEVICE      (50)
+
+/* Data is being read from this endpoint adress */
+#define PRV_BULK_IN         (0x88)
+
+/* Size of a single scan on the bulk endpoint */
+#define PRV_BULK_SIZE       (4096)
+
+/* How long (ms) scan data may take to arrive once the device reports that the
+ * scan is done */
+#define PRV_BULK_TIMEOUT    (5000)
+
+/* Largest control payload we ever send or receive during operation */
+#define PRV_CTRL_SIZE       (8)
+
+/* How often (ms) the event thread checks if it is supposed to quit */
+#define PRV_EVENT_TIMEOUT   (100)
+
+struct usb_ident {
+    int id_vendor;
+    int id_product;
+};
+
+/* One firmware upload running in its own thread */
+typedef struct {
+    libusb_device *dev;
+    const estrella_fw_t *fw;
+    pthread_t thread;
+    int started;
+    estrella_upload_t report;
+} prv_upload_job_t;
+
+/* Per device state. Transfers and their buffers are allocated once when the
+ * session is created and reused for every request. */
+struct estrella_usb1_s {
+    libusb_device_handle *handle;
+
+    struct libusb_transfer *ctrl;
+    unsigned char ctrlbuf[LIBUSB_CONTROL_SETUP_SIZE + PRV_CTRL_SIZE];
+    int ctrl_done;
+
+    struct libusb_transfer *bulk;
+    unsigned char bulkbuf[PRV_BULK_SIZE];
+    int bulk_done;
+    int bulk_armed;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+/* ######################################################################### */
+/*                           Private interface (Module)                      */
+/* ######################################################################### */
+
+static void prv_usb1_context_init(void);
+static void *prv_usb1_event_thread(void *arg);
+static int prv_usb1_events_get(void);
+static void prv_usb1_events_put(void);
+static void LIBUSB_CALL prv_usb1_ctrl_cb(struct libusb_transfer *transfer);
+static void LIBUSB_CALL prv_usb1_bulk_cb(struct libusb_transfer *transfer);
+static int prv_usb1_control(struct estrella_usb1_s *dev, int requesttype, int request, int value, int index, unsigned char *data, int size, unsigned int timeout);
+static int prv_usb1_bulk_submit(struct estrella_usb1_s *dev);
+static void prv_usb1_bulk_cancel(struct estrella_usb1_s *dev);
+static int prv_usb1_bulk_wait(struct estrella_usb1_s *dev, unsigned long us);
+static int prv_usb1_preup(dll_list_t *reports, int *uploaded);
+static int prv_usb1_count_devices(void);
+static int prv_usb1_wait_devices(int expected);
+static int prv_usb1_cpucs(libusb_device_handle *usb_handle, unsigned char hold, int *step);
+static int prv_usb1_upload_firmware(libusb_device *dev, const estrella_fw_t *fw, int *failed);
+static void *prv_usb1_upload_thread(void *arg);
+static int prv_usb1_find_devices(dll_list_t *devices, dll_list_t *known);
+static int prv_usb1_get_handle(estrella_dev_t *device, libusb_device_handle **handle);
+static int prv_usb1_device_info(libusb_device *dev, estrella_dev_t *device);
+static int LIBUSB_CALL prv_usb1_hotplug_cb(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data);
+
+static const unsigned char estrella_init_req_data[] = {0x00,0x12,0x10,0x1f,0xe0,0x40};
+static const unsigned char estrella_rate_req_data_reset[] = {0x00,0x00,0x04,0x20,0xe0,0x40};
+
+/* Process wide libusb context and event thread */
+static libusb_context *prv_ctx = NULL;
+static int prv_ctx_rc = LIBUSB_SUCCESS;
+static pthread_once_t prv_ctx_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t prv_event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t prv_event_thread;
+static int prv_event_users = 0;
+static int prv_event_run = 0;
+
+/* ######################################################################### */
+/*                           Implementation                                  */
+/* ######################################################################### */
+
+/* CPU control registers to write when resetting the device's CPU for firmware
+ * upload */
+static const int usb_cpucs[] = {ESTRELLA_FW_CPUCS_FX, ESTRELLA_FW_CPUCS_FX2};
+
+/* These are the uninitialized usb devices on the bus. */
+static struct usb_ident usb_devices_preup[] = {
+    {0x04b4,0x8613},    
+};
+
+/* This is how they look after firmware upload and reenumeration */
+static struct usb_ident usb_devices[] = {
+    {0x0bd7,0xa012},
+};
+
+void prv_usb1_context_init(void)
+{
+    prv_ctx_rc = libusb_init(&prv_ctx);
+    if (prv_ctx_rc != LIBUSB_SUCCESS)
+        return;
+
+    /* Have the device registry rebuilt whenever something is plugged in or
+     * removed. Callbacks are delivered by the event thread, so without open
+     * sessions the registry is only refreshed on request. */
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        libusb_hotplug_register_callback(prv_ctx,
+                LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                LIBUSB_HOTPLUG_NO_FLAGS, LIBUSB_HOTPLUG_MATCH_ANY,
+                LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+                prv_usb1_hotplug_cb, NULL, NULL);
+}
+
+int LIBUSB_CALL prv_usb1_hotplug_cb(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+    UNUSED(ctx);
+    UNUSED(dev);
+    UNUSED(event);
+    UNUSED(user_data);
+
+    estrella_registry_invalidate();
+
+    /* Stay registered */
+    return 0;
+}
+
+void *prv_usb1_event_thread(void *arg)
+{
+    UNUSED(arg);
+
+    while (__atomic_load_n(&prv_event_run, __ATOMIC_ACQUIRE)) {
+        struct timeval tv;
+
+        tv.tv_sec = 0;
+        tv.tv_usec = PRV_EVENT_TIMEOUT*1000;
+
+        /* Completion callbacks are being called from in here */
+        libusb_handle_events_timeout_completed(prv_ctx, &tv, NULL);
+    }
+
+    return NULL;
+}
+
+int prv_usb1_events_get(void)
+{
+    int rc = ESTROK;
+
+    pthread_mutex_lock(&prv_event_mutex);
+
+    /* First device to be opened starts the event thread */
+    if (prv_event_users == 0) {
+        __atomic_store_n(&prv_event_run, 1, __ATOMIC_RELEASE);
+        if (pthread_create(&prv_event_thread, NULL, prv_usb1_event_thread, NULL) != 0)
+            rc = ESTRERR;
+    }
+
+    if (rc == ESTROK)
+        prv_event_users++;
+
+    pthread_mutex_unlock(&prv_event_mutex);
+
+    return rc;
+}
+
+void prv_usb1_events_put(void)
+{
+    pthread_mutex_lock(&prv_event_mutex);
+
+    /* Last device to be closed stops it again */
+    prv_event_users--;
+    if (prv_event_users == 0) {
+        __atomic_store_n(&prv_event_run, 0, __ATOMIC_RELEASE);
+        pthread_join(prv_event_thread, NULL);
+    }
+
+    pthread_mutex_unlock(&prv_event_mutex);
+}
+
+void LIBUSB_CALL prv_usb1_ctrl_cb(struct libusb_transfer *transfer)
+{
+    struct estrella_usb1_s *dev = (struct estrella_usb1_s*)transfer->user_data;
+
+    pthread_mutex_lock(&dev->mutex);
+    dev->ctrl_done = 1;
+    pthread_cond_broadcast(&dev->cond);
+    pthread_mutex_unlock(&dev->mutex);
+}
+
+void LIBUSB_CALL prv_usb1_bulk_cb(struct libusb_transfer *transfer)
+{
+    struct estrella_usb1_s *dev = (struct estrella_usb1_s*)transfer->user_data;
+
+    pthread_mutex_lock(&dev->mutex);
+    __atomic_store_n(&dev->bulk_done, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&dev->cond);
+    pthread_mutex_unlock(&dev->mutex);
+}
+
+int prv_usb1_control(struct estrella_usb1_s *dev, int requesttype, int request, int value, int index, unsigned char *data, int size, unsigned int timeout)
+{
+    int rc;
+
+    if (size > PRV_CTRL_SIZE)
+        return -1;
+
+    /* Setup packet first, payload follows */
+    libusb_fill_control_setup(dev->ctrlbuf, (uint8_t)requesttype, (uint8_t)request, (uint16_t)value, (uint16_t)index, (uint16_t)size);
+    if (!(requesttype & LIBUSB_ENDPOINT_IN) && (size > 0))
+        memcpy(dev->ctrlbuf + LIBUSB_CONTROL_SETUP_SIZE, data, size);
+
+    libusb_fill_control_transfer(dev->ctrl, dev->handle, dev->ctrlbuf, prv_usb1_ctrl_cb, dev, timeout);
+
+    dev->ctrl_done = 0;
+    rc = libusb_submit_transfer(dev->ctrl);
+    if (rc != LIBUSB_SUCCESS)
+        return -1;
+
+    /* libusb takes care of the timeout, the callback is always called */
+    pthread_mutex_lock(&dev->mutex);
+    while (!dev->ctrl_done)
+        pthread_cond_wait(&dev->cond, &dev->mutex);
+    pthread_mutex_unlock(&dev->mutex);
+
+    if (dev->ctrl->status != LIBUSB_TRANSFER_COMPLETED)
+        return -1;
+
+    if ((requesttype & LIBUSB_ENDPOINT_IN) && (dev->ctrl->actual_length > 0))
+        memcpy(data, libusb_control_transfer_get_data(dev->ctrl), dev->ctrl->actual_length);
+
+    return dev->ctrl->actual_length;
+}
+
+int prv_usb1_bulk_submit(struct estrella_usb1_s *dev)
+{
+    int rc;
+
+    /* No timeout, this transfer just waits for the next scan */
+    libusb_fill_bulk_transfer(dev->bulk, dev->handle, PRV_BULK_IN, dev->bulkbuf, sizeof(dev->bulkbuf), prv_usb1_bulk_cb, dev, 0);
+
+    pthread_mutex_lock(&dev->mutex);
+    dev->bulk_done = 0;
+    pthread_mutex_unlock(&dev->mutex);
+
+    rc = libusb_submit_transfer(dev->bulk);
+    if (rc != LIBUSB_SUCCESS) {
+        dev->bulk_done = 1;
+        dev->bulk_armed = 0;
+        return ESTRERR;
+    }
+
+    /* Whatever arrives from now on belongs to the scan being started */
+    dev->bulk_armed = 1;
+
+    return ESTROK;
+}
+
+void prv_usb1_bulk_cancel(struct estrella_usb1_s *dev)
+{
+    if (!dev->bulk_armed)
+        return;
+
+    /* The transfer may complete any time, in which case this fails. Either
+     * way the callback is going to be called, only then is it ours again. */
+    libusb_cancel_transfer(dev->bulk);
+
+    pthread_mutex_lock(&dev->mutex);
+    while (!dev->bulk_done)
+        pthread_cond_wait(&dev->cond, &dev->mutex);
+    pthread_mutex_unlock(&dev->mutex);
+
+    /* Data which made it anyway is thrown away */
+    dev->bulk_armed = 0;
+}
+
+int prv_usb1_bulk_wait(struct estrella_usb1_s *dev, unsigned long us)
+{
+    int rc = 0;
+    int done;
+    estr_timestamp_t deadline;
+
+    estrella_timestamp_deadline(&deadline, us);
+
+    pthread_mutex_lock(&dev->mutex);
+    while (!dev->bulk_done && (rc != ETIMEDOUT))
+        rc = pthread_cond_timedwait(&dev->cond, &dev->mutex, &deadline);
+    done = dev->bulk_done;
+    pthread_mutex_unlock(&dev->mutex);
+
+    return done;
+}
+
+int prv_usb1_device_info(libusb_device *dev, estrella_dev_t *device)
+{
+    int rc;
+    struct libusb_device_descriptor desc;
+    libusb_device_handle *usb_handle = NULL;
+
+    rc = libusb_get_device_descriptor(dev, &desc);
+    if (rc != LIBUSB_SUCCESS)
+        return ESTRERR;
+
+    /* Set product- and vendor id */
+    device->spec.usb.vendorid = desc.idVendor;
+    device->spec.usb.productid = desc.idProduct;
+
+    rc = libusb_open(dev, &usb_handle);
+    if (rc != LIBUSB_SUCCESS)
+        return ESTRERR;
+
+    /* Set manufacturer/product/serial number strings */
+    rc = libusb_get_string_descriptor_ascii(usb_handle, desc.iManufacturer, (unsigned char*)device->spec.usb.manufacturer, sizeof(device->spec.usb.manufacturer));
+    if (rc < 0) {
+        libusb_close(usb_handle);
+        return ESTRERR;
+    }
+    rc = libusb_get_string_descriptor_ascii(usb_handle, desc.iProduct, (unsigned char*)device->spec.usb.product, sizeof(device->spec.usb.product));
+    if (rc < 0) {
+        libusb_close(usb_handle);
+        return ESTRERR;
+    }
+
+    /* We don't get a serial number, so a failure here is not lethal */
+    rc = libusb_get_string_descriptor_ascii(usb_handle, desc.iSerialNumber, (unsigned char*)device->spec.usb.serialnumber, sizeof(device->spec.usb.serialnumber));
+    if (rc < 0) {
+        strncpy(device->spec.usb.serialnumber, "?", sizeof(device->spec.usb.serialnumber));
+    }
+
+    libusb_close(usb_handle);
+
+    return ESTROK;
+}
+
+int prv_usb1_get_handle(estrella_dev_t *device, libusb_device_handle **handle)
+{
+    int rc = ESTRINV;
+    ssize_t i, num;
+    libusb_device **list;
+
+    num = libusb_get_device_list(prv_ctx, &list);
+    if (num < 0)
+        return ESTRERR;
+
+    /* Find the requested device, busses are named like libusb-0.1 does */
+    for (i=0;i<num;i++) {
+        char bus[ESTRELLA_PATH_MAX];
+
+        snprintf(bus, sizeof(bus), "%03d", libusb_get_bus_number(list[i]));
+        if ((strcmp(bus, device->spec.usb.bus) != 0) ||
+            (libusb_get_device_address(list[i]) != device->spec.usb.devnum))
+            continue;
+
+        /* Open the device */
+        if (libusb_open(list[i], handle) == LIBUSB_SUCCESS)
+            rc = ESTROK;
+        else
+            rc = ESTRERR;
+        break;
+    }
+
+    libusb_free_device_list(list, 1);
+
+    return rc;
+}
+
+int prv_usb1_preup(dll_list_t *reports, int *uploaded)
+{
+    ssize_t num, j;
+    libusb_device **list;
+    const estrella_fw_t *fw;
+    dll_list_t jobs;
+    dll_iterator_t it;
+    void *item = NULL;
+    int rc, i;
+
+    *uploaded = 0;
+
+    rc = dll_init(&jobs);
+    if (rc != EDLLOK)
+        return ESTRERR;
+
+    num = libusb_get_device_list(prv_ctx, &list);
+    if (num < 0)
+        return ESTRERR;
+
+    /* All devices get the same image which must not change meanwhile */
+    fw = estrella_fw_acquire();
+    if (fw == NULL) {
+        libusb_free_device_list(list, 1);
+        return ESTRNOMEM;
+    }
+
+    /* Look at every device */
+    for (j=0;j<num;j++) {
+        struct libusb_device_descriptor desc;
+
+        if (libusb_get_device_descriptor(list[j], &desc) != LIBUSB_SUCCESS)
+            continue;
+
+        /* Check if the device is one of those that need firmware loaded */
+        for (i=0;i<(sizeof(usb_devices_preup)/sizeof(struct usb_ident));i++) {
+
+            if ((desc.idVendor == usb_devices_preup[i].id_vendor) &&
+                (desc.idProduct == usb_devices_preup[i].id_product)) {
+                prv_upload_job_t *job = NULL;
+
+                rc = dll_append(&jobs, (void**)&job, sizeof(prv_upload_job_t));
+                if (rc != EDLLOK) {
+                    dll_clear(&jobs);
+                    estrella_fw_release();
+                    libusb_free_device_list(list, 1);
+                    return ESTRNOMEM;
+                }
+
+                memset(job, 0, sizeof(prv_upload_job_t));
+                job->dev = list[j];
+                job->fw = fw;
+                snprintf(job->report.bus, ESTRELLA_PATH_MAX, "%03d", libusb_get_bus_number(list[j]));
+                job->report.devnum = libusb_get_device_address(list[j]);
+            }
+        }
+    }
+
+    /* Upload to all devices at once, one thread each. Should we fail to create
+     * a thread we do that upload right here instead. */
+    dll_iterator_init(&it, &jobs);
+    while (dll_iterator_next(&it, &item, NULL) == EDLLOK) {
+        prv_upload_job_t *job = (prv_upload_job_t*)item;
+
+        if (pthread_create(&job->thread, NULL, prv_usb1_upload_thread, job) == 0)
+            job->started = 1;
+        else
+            prv_usb1_upload_thread(job);
+    }
+
+    /* Collect the results and count the devices which are going to
+     * reenumerate */
+    dll_iterator_init(&it, &jobs);
+    while (dll_iterator_next(&it, &item, NULL) == EDLLOK) {
+        prv_upload_job_t *job = (prv_upload_job_t*)item;
+
+        if (job->started)
+            pthread_join(job->thread, NULL);
+
+        if (job->report.result == ESTROK)
+            (*uploaded)++;
+
+        if (reports) {
+            void *newitem = NULL;
+
+            if (dll_append(reports, &newitem, sizeof(estrella_upload_t)) == EDLLOK)
+                memcpy(newitem, &job->report, sizeof(estrella_upload_t));
+        }
+    }
+
+    dll_clear(&jobs);
+    estrella_fw_release();
+    libusb_free_device_list(list, 1);
+
+    return ESTROK;
+}
+
+void *prv_usb1_upload_thread(void *arg)
+{
+    prv_upload_job_t *job = (prv_upload_job_t*)arg;
+    estr_timestamp_t ts_start, ts_end;
+
+    estrella_timestamp_get(&ts_start);
+    job->report.result = prv_usb1_upload_firmware(job->dev, job->fw, &job->report.failed);
+    estrella_timestamp_get(&ts_end);
+
+    estrella_timestamp_diffms(&ts_start, &ts_end, &job->report.elapsed);
+
+    return NULL;
+}
+
+int prv_usb1_count_devices(void)
+{
+    ssize_t num, j;
+    libusb_device **list;
+    int i, count = 0;
+
+    num = libusb_get_device_list(prv_ctx, &list);
+    if (num < 0)
+        return 0;
+
+    for (j=0;j<num;j++) {
+        struct libusb_device_descriptor desc;
+
+        if (libusb_get_device_descriptor(list[j], &desc) != LIBUSB_SUCCESS)
+            continue;
+
+        for (i=0;i<(sizeof(usb_devices)/sizeof(struct usb_ident));i++) {
+            if ((desc.idVendor == usb_devices[i].id_vendor) &&
+                (desc.idProduct == usb_devices[i].id_product))
+                count++;
+        }
+    }
+
+    libusb_free_device_list(list, 1);
+
+    return count;
+}
+
+int prv_usb1_wait_devices(int expected)
+{
+    int rc;
+    unsigned long mspassed = 0;
+    estr_timestamp_t ts_start, ts_current;
+
+    rc = estrella_timestamp_get(&ts_start);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    /* Poll until all devices are back or we run out of time */
+    while (prv_usb1_count_devices() < expected) {
+        if (mspassed >= PRV_WAITFORDEVICE)
+            return ESTRTIMEOUT;
+
+        estrella_usleep(PRV_POLLDEVICE*1000, NULL);
+
+        rc = estrella_timestamp_get(&ts_current);
+        if (rc != ESTROK)
+            return ESTRERR;
+
+        rc = estrella_timestamp_diffms(&ts_start, &ts_current, &mspassed);
+        if (rc != ESTROK)
+            return ESTRERR;
+    }
+
+    return ESTROK;
+}
+
+int prv_usb1_cpucs(libusb_device_handle *usb_handle, unsigned char hold, int *step)
+{
+    int rc, i;
+
+    for (i=0;i<(sizeof(usb_cpucs)/sizeof(int));i++) {
+        rc = libusb_control_transfer(usb_handle, LIBUSB_REQUEST_TYPE_VENDOR,
+                ESTRELLA_FW_REQUEST, (uint16_t)usb_cpucs[i], 0, &hold, 1, 5000);
+        if (rc < 0)
+            return ESTRERR;
+
+        (*step)++;
+    }
+
+    return ESTROK;
+}
+
+int prv_usb1_upload_firmware(libusb_device *dev, const estrella_fw_t *fw, int *failed)
+{
+    libusb_device_handle *usb_handle = NULL;
+    unsigned int addr = 0, size;
+    int rc;
+    int step = 0;
+
+    *failed = -1;
+
+    if (!dev)
+        return ESTRINV;
+
+    /* Open the device */
+    rc = libusb_open(dev, &usb_handle);
+    if (rc != LIBUSB_SUCCESS)
+        return ESTRERR;
+
+    /* Hold the CPU in reset, write the image in as few transfers as possible
+     * and let the CPU run again */
+    rc = prv_usb1_cpucs(usb_handle, 1, &step);
+
+    while ((rc == ESTROK) && (estrella_fw_segment(fw, &addr, &size) == ESTROK)) {
+        if (libusb_control_transfer(usb_handle, LIBUSB_REQUEST_TYPE_VENDOR,
+                    ESTRELLA_FW_REQUEST, (uint16_t)addr, 0,
+                    (unsigned char*)&fw->data[addr], (uint16_t)size, 5000) < 0) {
+            rc = ESTRERR;
+            break;
+        }
+
+        addr += size;
+        step++;
+    }
+
+    if (rc == ESTROK)
+        rc = prv_usb1_cpucs(usb_handle, 0, &step);
+
+    if (rc != ESTROK)
+        *failed = step;
+
+    /* Close the device */
+    libusb_close(usb_handle);
+    return rc;
+}
+
+int prv_usb1_find_devices(dll_list_t *devices, dll_list_t *known)
+{
+    ssize_t num, j;
+    libusb_device **list;
+    int rc, i;
+
+    num = libusb_get_device_list(prv_ctx, &list);
+    if (num < 0)
+        return ESTRERR;
+
+    /* Have a look at each device */
+    for (j=0;j<num;j++) {
+        struct libusb_device_descriptor desc;
+
+        if (libusb_get_device_descriptor(list[j], &desc) != LIBUSB_SUCCESS)
+            continue;
+
+        /* Check if the device is one of ours */
+        for (i=0;i<(sizeof(usb_devices)/sizeof(struct usb_ident));i++) {
+
+            if ((desc.idVendor == usb_devices[i].id_vendor) &&
+                (desc.idProduct == usb_devices[i].id_product)) {
+
+                void *tmpdev = NULL;
+                estrella_dev_t *newdev = NULL;
+                estrella_dev_t *olddev = NULL;
+
+                /* Create a new list entry for this device */
+                rc = dll_append(devices, &tmpdev, sizeof(estrella_dev_t));
+                if (rc != EDLLOK) {
+                    libusb_free_device_list(list, 1);
+                    dll_clear(devices);
+                    return ESTRNOMEM;
+                }
+    
+                newdev = (estrella_dev_t*)tmpdev;
+    
+                /* Very basic device info */
+                newdev->devicetype = ESTRELLA_DEV_USB;
+                newdev->spec.usb.devnum = libusb_get_device_address(list[j]);
+                snprintf(newdev->spec.usb.bus, ESTRELLA_PATH_MAX, "%03d", libusb_get_bus_number(list[j]));
+
+                /* If we have seen this device before there's no need to
+                 * open it again */
+                if (known)
+                    olddev = estrella_registry_lookup(known, newdev);
+                if (olddev) {
+                    memcpy(newdev, olddev, sizeof(estrella_dev_t));
+                    continue;
+                }
+
+                /* Add some additional info from the device descriptor */
+                rc = prv_usb1_device_info(list[j], newdev);
+                if (rc != ESTROK) {
+                    libusb_free_device_list(list, 1);
+                    dll_clear(devices);
+                    return ESTRERR;
+                }
+            }
+        }
+    }
+
+    libusb_free_device_list(list, 1);
+
+    return ESTROK;
+}
+
+int estrella_usb_upload(dll_list_t *reports)
+{
+    int rc;
+    int present, uploaded;
+
+    pthread_once(&prv_ctx_once, prv_usb1_context_init);
+    if (prv_ctx_rc != LIBUSB_SUCCESS)
+        return ESTRERR;
+
+    present = prv_usb1_count_devices();
+
+    rc = prv_usb1_preup(reports, &uploaded);
+    if (rc != ESTROK)
+        return rc;
+
+    if (uploaded > 0)
+        prv_usb1_wait_devices(present + uploaded);
+
+    return ESTROK;
+}
+
+int estrella_usb_find_devices(dll_list_t *devices, dll_list_t *known)
+{
+    int rc;
+    int present, uploaded;
+
+    /* There's only one libusb context for the whole process */
+    pthread_once(&prv_ctx_once, prv_usb1_context_init);
+    if (prv_ctx_rc != LIBUSB_SUCCESS)
+        return ESTRERR;
+
+    /* Devices which already have their firmware */
+    present = prv_usb1_count_devices();
+  
+    /* Iterate all the busses and devices and in a first run try to find
+     * uninitialized USB devices. If we find any we try to provide them with the
+     * necessary firmware.*/
+    rc = prv_usb1_preup(NULL, &uploaded);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    /* Wait for the devices we uploaded firmware to to show up again */
+    if (uploaded > 0)
+        prv_usb1_wait_devices(present + uploaded);
+
+    /* Correctly initialized devices now show up on the bus with a different
+     * vendor/product ID. We're now going to search for those and return them */
+    rc = prv_usb1_find_devices(devices, known);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    return 0;
+}
+
+int estrella_usb_init(estrella_session_t *session, estrella_dev_t *device)
+{
+    int rc;
+    libusb_device_handle *handle;
+    struct estrella_usb1_s *dev;
+
+    pthread_once(&prv_ctx_once, prv_usb1_context_init);
+    if (prv_ctx_rc != LIBUSB_SUCCESS)
+        return ESTRERR;
+
+    /* First of all get the device handle */
+    rc = prv_usb1_get_handle(device, &handle);
+    if (rc != ESTROK)
+        return ESTRINV;
+
+    /* Select configuration 0x01 and claim interface 0x00, see estrella_usb.c */
+    rc = libusb_set_configuration(handle, 0x01);
+    if (rc < 0) {
+        libusb_close(handle);
+        return ESTRERR;
+    }
+
+    rc = libusb_claim_interface(handle, 0x00);
+    if (rc < 0) {
+        libusb_close(handle);
+        return ESTRERR;
+    }
+
+    /* Initial device setup. Nothing else is going on yet, so this can just as
+     * well be synchronous. */
+    memcpy(session->usbbuf.setup, estrella_init_req_data, sizeof(session->usbbuf.setup));
+    rc = libusb_control_transfer(
+            handle,
+            LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT,
+            0xb4,
+            0x0000,
+            0x0000,
+            session->usbbuf.setup,
+            sizeof(session->usbbuf.setup),
+            5000);
+    if (rc < 0) {
+        libusb_release_interface(handle, 0x00);
+        libusb_close(handle);
+        return ESTRERR;
+    }
+
+    /* Set up the device state and the transfers we're going to reuse */
+    dev = (struct estrella_usb1_s*)estrella_malloc(sizeof(struct estrella_usb1_s));
+    if (!dev) {
+        libusb_release_interface(handle, 0x00);
+        libusb_close(handle);
+        return ESTRNOMEM;
+    }
+
+    memset(dev, 0, sizeof(struct estrella_usb1_s));
+    dev->handle = handle;
+    dev->bulk_done = 1;
+    pthread_mutex_init(&dev->mutex, NULL);
+    if (estrella_cond_init(&dev->cond) != ESTROK) {
+        pthread_mutex_destroy(&dev->mutex);
+        estrella_free(dev);
+        libusb_release_interface(handle, 0x00);
+        libusb_close(handle);
+        return ESTRERR;
+    }
+
+    dev->ctrl = libusb_alloc_transfer(0);
+    dev->bulk = libusb_alloc_transfer(0);
+    if (!dev->ctrl || !dev->bulk)
+        rc = ESTRNOMEM;
+    else
+        rc = prv_usb1_events_get();
+
+    /* Keep the data endpoint busy from now on */
+    if (rc == ESTROK) {
+        rc = prv_usb1_bulk_submit(dev);
+        if (rc != ESTROK)
+            prv_usb1_events_put();
+    }
+
+    if (rc != ESTROK) {
+        if (dev->ctrl)
+            libusb_free_transfer(dev->ctrl);
+        if (dev->bulk)
+            libusb_free_transfer(dev->bulk);
+        pthread_cond_destroy(&dev->cond);
+        pthread_mutex_destroy(&dev->mutex);
+        estrella_free(dev);
+        libusb_release_interface(handle, 0x00);
+        libusb_close(handle);
+        return rc;
+    }
+
+    /* Store the device inside this session */
+    session->spec.usb1 = dev;
+
+    return ESTROK;
+}
+
+int estrella_usb_rate(estrella_session_t *session, int rate, estr_xtrate_t xtrate)
+{
+    int rc;
+
+    if (session->spec.usb1 == NULL)
+        return ESTRINV;
+
+    /* Same encoding as in estrella_usb.c */
+    memcpy(session->usbbuf.setup, estrella_rate_req_data_reset, sizeof(session->usbbuf.setup));
+    session->usbbuf.setup[1] = (unsigned char)(rate & 0xFF);
+    session->usbbuf.setup[0] = (unsigned char)((rate >> 8) & 0xFF);
+
+    if (rate >= 5)
+        session->usbbuf.setup[3] -= 1;
+
+    if (xtrate == ESTR_XRES_MEDIUM)
+        session->usbbuf.setup[2] = 0x08;
+    else if (xtrate == ESTR_XRES_HIGH) 
+        session->usbbuf.setup[2] = 0x10;
+
+    rc = prv_usb1_control(
+            session->spec.usb1,
+            LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT,
+            0xb4,
+            0x0000,
+            0x0000,
+            session->usbbuf.setup,
+            sizeof(session->usbbuf.setup),
+            5000);
+    if (rc < 0)
+        return ESTRERR;
+
+    return ESTROK;
+}
+
+int estrella_usb_scan_init(estrella_session_t *session)
+{
+    int rc;
+    struct estrella_usb1_s *dev = session->spec.usb1;
+
+    if (dev == NULL)
+        return ESTRINV;
+
+    /* Start the scan */
+    rc = prv_usb1_control(
+            dev,
+            LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT,
+            0xb2,
+            0x0000,
+            0x0000,
+            NULL,
+            0,
+            5000);
+    if (rc < 0)
+        return ESTRERR;
+
+    /* The last scan was abandoned and took its transfer along, we need a new
+     * one for this scan's data */
+    if (!dev->bulk_armed) {
+        rc = prv_usb1_bulk_submit(dev);
+        if (rc != ESTROK)
+            return ESTRERR;
+    }
+
+    rc = estrella_timestamp_get(&session->scanstart);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    return ESTROK;
+}
+
+int estrella_usb_scan_result_raw(estrella_session_t *session, uint16_t *raw)
+{
+    int rc, wait;
+    unsigned char response;
+    unsigned long interval;
+    struct estrella_usb1_s *dev = session->spec.usb1;
+
+    if (dev == NULL)
+        return ESTRINV;
+
+    /* No scan has been started */
+    if (!dev->bulk_armed)
+        return ESTRERR;
+
+    rc = estrella_wait_presleep(session);
+    if (rc != ESTROK) {
+        prv_usb1_bulk_cancel(dev);
+        return ESTRERR;
+    }
+
+    response = 0;
+    interval = 0;
+    wait = ESTROK;
+    session->polls = 0;
+    while (1==1) {
+
+        /* The data might already be here */
+        if (__atomic_load_n(&dev->bulk_done, __ATOMIC_ACQUIRE)) {
+            response = 1;
+            break;
+        }
+
+        rc = prv_usb1_control(
+                dev,
+                LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN,
+                0xb3,
+                0x0000,
+                0x0000,
+                session->usbbuf.status,
+                sizeof(session->usbbuf.status),
+                5000);
+        if (rc < 0)
+            break;
+
+        session->polls++;
+        session->totalpolls++;
+
+        if (session->usbbuf.status[1] == 0x01) {
+            response = 1;
+            break;
+        }
+
+        wait = estrella_wait_check(session, (unsigned long)(session->rate + PRV_DELAY));
+        if (wait != ESTROK)
+            break;
+
+        /* Wait for the next poll according to the session's wait policy.
+         * Unlike the libusb-0.1 backend we don't just sleep but wake up as soon
+         * as the bulk transfer completes. */
+        if (interval == 0)
+            interval = estrella_wait_advance(session, 0);
+
+        prv_usb1_bulk_wait(dev, interval);
+
+        interval = estrella_wait_advance(session, interval);
+    }
+
+    if (response != 1) {
+        /* Nobody is going to pick up this scan's data. Should it still
+         * arrive it must not be mistaken for that of the next scan. */
+        prv_usb1_bulk_cancel(dev);
+
+        if (wait != ESTROK)
+            return wait;
+        if (session->xtmode != ESTR_XTMODE_TRIGGER)
+            return ESTRTIMEOUT;
+        else 
+            return ESTRERR;
+    }
+
+    estrella_wait_complete(session);
+
+    /* The bulk transfer has been pending all along, wait for it to finish */
+    if (!prv_usb1_bulk_wait(dev, PRV_BULK_TIMEOUT*1000)) {
+        prv_usb1_bulk_cancel(dev);
+        return ESTRERR;
+    }
+
+    /* A failed transfer is resubmitted with the next scan */
+    if ((dev->bulk->status != LIBUSB_TRANSFER_COMPLETED) ||
+        (dev->bulk->actual_length != PRV_BULK_SIZE)) {
+        dev->bulk_armed = 0;
+        return ESTRERR;
+    }
+
+    memcpy(raw, dev->bulkbuf, PRV_BULK_SIZE);
+    estrella_le16(raw, ESTRELLA_RAW_WORDS);
+    estrella_wait_done(session);
+
+    /* Get ready for the next scan */
+    rc = prv_usb1_bulk_submit(dev);
+    if (rc != ESTROK)
+        return ESTRERR;
+
+    return ESTROK;
+}
+
+int estrella_usb_close(estrella_session_t *session)
+{
+    struct estrella_usb1_s *dev = session->spec.usb1;
+
+    if (!dev)
+        return ESTROK;
+
+    /* Get the pending bulk transfer back */
+    prv_usb1_bulk_cancel(dev);
+
+    prv_usb1_events_put();
+
+    libusb_free_transfer(dev->ctrl);
+    libusb_free_transfer(dev->bulk);
+    libusb_release_interface(dev->handle, 0x00);
+    libusb_close(dev->handle);
+
+    pthread_cond_destroy(&dev->cond);
+    pthread_mutex_destroy(&dev->mutex);
+    estrella_free(dev);
+
+    session->spec.usb1 = NULL;
+
+    return ESTROK;
+}
@@ -0,0 +1,110 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Compares the effective frame rate of sequential and pipelined averaging
+ * against a simulated device. Bulk transfers of scan data take
+ * BENCH_BULK_US each, roughly what 4k take on a full speed bus. */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "estrella.h"
+#include "estrella_usbsim.h"
+
+#define BENCH_BULK_US       (3000)
+#define BENCH_SCANSTOAVG    (10)
+#define BENCH_FRAMES        (200)
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+}
+
+static int bench_run(estrella_session_t *session, estr_avgmode_t avgmode, double *fps)
+{
+    float buffer[2051];
+    double start;
+    int i;
+
+    if (estrella_avgmode(session, avgmode) != ESTROK)
+        return ESTRERR;
+
+    start = bench_now();
+    for (i=0;i<BENCH_FRAMES/BENCH_SCANSTOAVG;i++) {
+        if (estrella_scan(session, buffer) != ESTROK)
+            return ESTRERR;
+    }
+
+    *fps = (double)BENCH_FRAMES/(bench_now() - start);
+
+    return ESTROK;
+}
+
+int main(int argc, char *argv[])
+{
+    const int rates[] = {2, 10, 50};
+    estrella_dev_t dev;
+    estrella_session_t session;
+    int i;
+
+    usbsim_bulk_us = BENCH_BULK_US;
+
+    if (estrella_get_device(&dev, 0) != ESTROK) {
+        printf("No simulated device\n");
+        return 1;
+    }
+
+    if (estrella_init(&session, &dev) != ESTROK) {
+        printf("Unable to create session\n");
+        return 1;
+    }
+
+    estrella_update(&session, BENCH_SCANSTOAVG, ESTR_XSMOOTH_NONE, ESTR_TEMPCOMP_OFF);
+
+    printf("rate (ms)   sequential (fps)   pipelined (fps)\n");
+    for (i=0;i<sizeof(rates)/sizeof(int);i++) {
+        double seq, pipe;
+
+        if ((estrella_rate(&session, rates[i], ESTR_XRES_LOW) != ESTROK) ||
+            (bench_run(&session, ESTR_AVGMODE_SEQUENTIAL, &seq) != ESTROK) ||
+            (bench_run(&session, ESTR_AVGMODE_PIPELINED, &pipe) != ESTROK)) {
+            printf("Scan failed\n");
+            estrella_close(&session);
+            return 1;
+        }
+
+        printf("%9d   %16.1f   %15.1f\n", rates[i], seq, pipe);
+    }
+
+    estrella_close(&session);
+
+    return 0;
+}
@@ -0,0 +1,237 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Checks the vectorized processing kernels against the scalar reference.
+ * Kernels the CPU doesn't support are skipped. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "estrella.h"
+#include "estrella_dsp.h"
+
+#define DSP_PATTERNS    (4)
+#define DSP_SCANS       (99)
+
+static uint16_t raw[ESTRELLA_RAW_WORDS];
+static float ref[ESTRELLA_RESULT_SIZE];
+static float result[ESTRELLA_RESULT_SIZE];
+static uint32_t refacc[ESTRELLA_SAMPLES];
+static uint32_t acc[ESTRELLA_SAMPLES];
+
+static void dsp_pattern(int pattern, unsigned long *seed)
+{
+    int i;
+
+    for (i=0;i<ESTRELLA_RAW_WORDS;i++) {
+        switch (pattern) {
+            case 0: raw[i] = 0x0000; break;
+            case 1: raw[i] = 0xffff; break;
+            case 2: raw[i] = (uint16_t)(i*33); break;
+            default:
+                *seed = *seed*1103515245 + 12345;
+                raw[i] = (uint16_t)(*seed >> 12);
+                break;
+        }
+    }
+}
+
+static int dsp_check_unpack(void)
+{
+    int i;
+
+    /* The reference itself against the documented layout */
+    for (i=0;i<ESTRELLA_SAMPLES;i++) {
+        if (ref[i] != (float)raw[i+1])
+            return 1;
+    }
+    for (i=ESTRELLA_SAMPLES;i<ESTRELLA_RESULT_SIZE;i++) {
+        if (ref[i] != 0.0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Naive boxcar across refacc minus the dark level, the window shrinks at the
+ * edges */
+static void dsp_smooth_ref(int count, int half, float dark)
+{
+    int i, j;
+
+    for (i=0;i<ESTRELLA_SAMPLES;i++) {
+        unsigned long long sum = 0;
+        int n = 0;
+
+        for (j=i-half;j<=i+half;j++) {
+            if ((j < 0) || (j >= ESTRELLA_SAMPLES))
+                continue;
+            sum += refacc[j];
+            n++;
+        }
+
+        ref[i] = (float)((double)sum/((double)count*n)) - dark;
+    }
+
+    for (i=ESTRELLA_SAMPLES;i<ESTRELLA_RESULT_SIZE;i++)
+        ref[i] = 0.0;
+}
+
+/* Runs the given kernels, or the dispatched ones if dsp is NULL */
+static int dsp_test(const char *name, estrella_dsp_t *dsp, int pattern)
+{
+    estrella_dsp_t scalar;
+    const int halves[] = {2, 4, 8, 16};
+    unsigned long seed = 12345;
+    int failures = 0;
+    int i, n, d;
+
+    /* Single scan */
+    dsp_pattern(pattern, &seed);
+
+    memset(ref, 0x55, sizeof(ref));
+    estrella_dsp_kernels("scalar", &scalar);
+    scalar.unpack(raw, ref);
+    if (dsp_check_unpack()) {
+        printf("Reference unpack, pattern %d: wrong result\n", pattern);
+        failures++;
+    }
+
+    /* Garbage in the buffer makes sure everything is written */
+    memset(result, 0x55, sizeof(result));
+    if (dsp)
+        dsp->unpack(raw, result);
+    else
+        estrella_unpack(raw, result);
+
+    if (memcmp(ref, result, sizeof(ref)) != 0) {
+        printf("Unpack %s, pattern %d: mismatch\n", name, pattern);
+        failures++;
+    }
+
+    /* Averaging, the reference sums up in 64 bit */
+    memset(refacc, 0, sizeof(refacc));
+    memset(acc, 0, sizeof(acc));
+    seed = 12345;
+    for (n=0;n<DSP_SCANS;n++) {
+        dsp_pattern(pattern, &seed);
+
+        for (i=0;i<ESTRELLA_SAMPLES;i++)
+            refacc[i] = (uint32_t)((unsigned long long)refacc[i] + raw[i+1]);
+
+        if (dsp)
+            dsp->accumulate(acc, raw);
+        else
+            estrella_accumulate(acc, raw);
+    }
+
+    if (memcmp(refacc, acc, sizeof(acc)) != 0) {
+        printf("Accumulate %s, pattern %d: mismatch\n", name, pattern);
+        failures++;
+    }
+
+    /* Once plain and once with the dark level taken off */
+    for (d=0;d<2;d++) {
+        unsigned long long darksum = 0;
+        float dark = 0.0;
+
+        if (d) {
+            for (i=0;i<ESTRELLA_DARK_PIXELS;i++)
+                darksum += refacc[i];
+            dark = (float)((double)darksum/((double)DSP_SCANS*ESTRELLA_DARK_PIXELS));
+
+            if (estrella_dark(acc, DSP_SCANS) != dark) {
+                printf("Dark level, pattern %d: mismatch\n", pattern);
+                failures++;
+            }
+        }
+
+        memset(result, 0x55, sizeof(result));
+        if (dsp)
+            dsp->average(acc, DSP_SCANS, dark, result);
+        else
+            estrella_average(acc, DSP_SCANS, dark, result);
+
+        for (i=0;i<ESTRELLA_RESULT_SIZE;i++) {
+            float expected = (i < ESTRELLA_SAMPLES) ? (float)refacc[i]/(float)DSP_SCANS - dark : 0.0;
+
+            if (result[i] != expected) {
+                printf("Average %s, pattern %d, dark %d: mismatch at %d\n", name, pattern, d, i);
+                failures++;
+                break;
+            }
+        }
+
+        /* Smoothing of the averaged scans, for every window width */
+        for (n=0;n<sizeof(halves)/sizeof(int);n++) {
+            memset(result, 0x55, sizeof(result));
+            if (dsp)
+                dsp->smooth(acc, DSP_SCANS, halves[n], dark, result);
+            else
+                estrella_smooth(acc, DSP_SCANS, halves[n], dark, result);
+
+            dsp_smooth_ref(DSP_SCANS, halves[n], dark);
+            if (memcmp(ref, result, sizeof(ref)) != 0) {
+                printf("Smooth %s, pattern %d, dark %d, half %d: mismatch\n", name, pattern, d, halves[n]);
+                failures++;
+            }
+        }
+    }
+
+    return failures;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *kernels[] = {"scalar", "sse2", "avx2"};
+    estrella_dsp_t dsp;
+    int failures = 0;
+    int k, p;
+
+    for (k=0;k<sizeof(kernels)/sizeof(char*);k++) {
+        if (estrella_dsp_kernels(kernels[k], &dsp) != ESTROK) {
+            printf("Kernels %s not supported, skipped\n", kernels[k]);
+            continue;
+        }
+
+        for (p=0;p<DSP_PATTERNS;p++)
+            failures += dsp_test(kernels[k], &dsp, p);
+    }
+
+    /* And whatever the dispatcher picks */
+    for (p=0;p<DSP_PATTERNS;p++)
+        failures += dsp_test("dispatched", NULL, p);
+
+    if (failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}
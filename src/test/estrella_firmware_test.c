@@ -0,0 +1,186 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Checks the Intel HEX parser and the segments firmware is uploaded in. The
+ * firmware file shipped with the sources has to match the image built into
+ * the library. Pass the path to usb2epp_firmware.hex. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "estrella.h"
+#include "estrella_firmware.h"
+
+/* Start and length of a synthetic image spanning several chunks */
+#define FW_RUN_ADDR     (0x1000)
+#define FW_RUN_SIZE     (10000)
+
+static estrella_fw_t fw_hex, fw_builtin, fw_run;
+static char fw_text[(FW_RUN_SIZE/16 + 2)*48];
+
+/* Number of segments an image has to be split into, counted the hard way */
+static unsigned int fw_expected_segments(const estrella_fw_t *fw, unsigned int *used)
+{
+    unsigned int addr, run = 0, segments = 0;
+
+    *used = 0;
+    for (addr=0;addr<=ESTRELLA_FW_SIZE;addr++) {
+        if ((addr < ESTRELLA_FW_SIZE) && (fw->used[addr>>3] & (1<<(addr&7)))) {
+            run++;
+            (*used)++;
+            continue;
+        }
+
+        segments += (run + ESTRELLA_FW_CHUNK - 1)/ESTRELLA_FW_CHUNK;
+        run = 0;
+    }
+
+    return segments;
+}
+
+/* Walks the segments, checking order, size and contents */
+static int fw_segments(const estrella_fw_t *fw, unsigned int *count, unsigned int *bytes)
+{
+    unsigned int addr = 0, size, i;
+
+    *count = 0;
+    *bytes = 0;
+    while (estrella_fw_segment(fw, &addr, &size) == ESTROK) {
+        if ((size == 0) || (size > ESTRELLA_FW_CHUNK) || (addr + size > ESTRELLA_FW_SIZE))
+            return 1;
+
+        for (i=addr;i<addr+size;i++) {
+            if (!(fw->used[i>>3] & (1<<(i&7))))
+                return 1;
+        }
+
+        (*count)++;
+        *bytes += size;
+        addr += size;
+    }
+
+    return 0;
+}
+
+/* Builds an Intel HEX image with a single run of data bytes */
+static size_t fw_make_run(char *text)
+{
+    unsigned int addr;
+    size_t len = 0;
+
+    len += sprintf(&text[len], "# %d bytes at 0x%04x\n", FW_RUN_SIZE, FW_RUN_ADDR);
+    for (addr=FW_RUN_ADDR;addr<FW_RUN_ADDR+FW_RUN_SIZE;addr+=16) {
+        unsigned int i, count = FW_RUN_ADDR + FW_RUN_SIZE - addr;
+        unsigned char sum;
+
+        if (count > 16)
+            count = 16;
+
+        sum = (unsigned char)(count + (addr >> 8) + (addr & 0xff));
+        len += sprintf(&text[len], ":%02X%04X00", count, addr);
+        for (i=0;i<count;i++) {
+            unsigned char byte = (unsigned char)(addr + i);
+
+            sum = (unsigned char)(sum + byte);
+            len += sprintf(&text[len], "%02X", byte);
+        }
+        len += sprintf(&text[len], "%02X\r\n", (unsigned char)(0x100 - sum));
+    }
+    len += sprintf(&text[len], ":00000001FF\n");
+
+    return len;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int count, bytes, expected, used;
+    size_t len;
+    int failures = 0;
+    const char *bad_checksum = ":0100000000FE\n";
+    const char *bad_type = ":020000040000FA\n";
+    const char *good = ":0100000000FF\n";
+
+    if (argc != 2) {
+        printf("Usage: %s usb2epp_firmware.hex\n", argv[0]);
+        return 1;
+    }
+
+    /* The shipped file and the built in image are the same */
+    if (estrella_fw_read(&fw_hex, argv[1]) != ESTROK) {
+        printf("Unable to parse %s\n", argv[1]);
+        return 1;
+    }
+
+    estrella_fw_builtin(&fw_builtin);
+    if (memcmp(fw_hex.used, fw_builtin.used, sizeof(fw_hex.used)) ||
+        memcmp(fw_hex.data, fw_builtin.data, sizeof(fw_hex.data))) {
+        printf("%s differs from the built in image\n", argv[1]);
+        failures++;
+    }
+
+    /* Every byte goes out exactly once, in as few writes as possible */
+    expected = fw_expected_segments(&fw_hex, &used);
+    if (fw_segments(&fw_hex, &count, &bytes) || (count != expected) || (bytes != used)) {
+        printf("Image split into %u segments of %u bytes, expected %u of %u\n", count, bytes, expected, used);
+        failures++;
+    }
+
+    /* A long run is split at the transfer limit */
+    len = fw_make_run(fw_text);
+    if ((estrella_fw_parse(&fw_run, fw_text, len) != ESTROK) ||
+        fw_segments(&fw_run, &count, &bytes) ||
+        (count != (FW_RUN_SIZE + ESTRELLA_FW_CHUNK - 1)/ESTRELLA_FW_CHUNK) ||
+        (bytes != FW_RUN_SIZE) || (fw_run.data[FW_RUN_ADDR + 17] != (unsigned char)(FW_RUN_ADDR + 17))) {
+        printf("Long run not split at %d bytes\n", ESTRELLA_FW_CHUNK);
+        failures++;
+    }
+
+    /* Broken and unsupported records */
+    if (estrella_fw_parse(&fw_run, good, strlen(good)) != ESTROK) {
+        printf("Valid record rejected\n");
+        failures++;
+    }
+
+    if (estrella_fw_parse(&fw_run, bad_checksum, strlen(bad_checksum)) != ESTRINV) {
+        printf("Checksum mismatch not detected\n");
+        failures++;
+    }
+
+    if (estrella_fw_parse(&fw_run, bad_type, strlen(bad_type)) != ESTRNOTIMPL) {
+        printf("Unsupported record type not detected\n");
+        failures++;
+    }
+
+    if (failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+
+    printf("OK, %u segments\n", expected);
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Checks the device registry against the simulated devices of
+ * estrella_usbsim.c: lookups served from the cache, refreshes which don't
+ * open known devices again, lookups by serial number, devices showing up
+ * unannounced and invalidation while the registry is being rebuilt. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "estrella.h"
+#include "estrella_registry.h"
+#include "estrella_usbsim.h"
+
+/* Serial number of a simulated device, see usb_get_string_simple() */
+static void registry_serial(char *serial, size_t size, int index)
+{
+    snprintf(serial, size, "sim%d-3", index);
+}
+
+int main(int argc, char *argv[])
+{
+    int num, failures = 0;
+    unsigned long opens, finds;
+    estrella_dev_t dev;
+    char serial[ESTRELLA_PATH_MAX];
+
+    /* Built on first use, every device is opened once */
+    if ((estrella_num_devices(&num) != ESTROK) || (num != USBSIM_DEVICES) ||
+        (usbsim_opens != USBSIM_DEVICES)) {
+        printf("Registry not built\n");
+        return 1;
+    }
+
+    /* Served from the cache, the busses are left alone */
+    finds = usbsim_finds;
+    if ((estrella_num_devices(&num) != ESTROK) || (num != USBSIM_DEVICES) ||
+        (estrella_get_device(&dev, 3) != ESTROK) || (dev.spec.usb.devnum != 4) ||
+        (usbsim_finds != finds)) {
+        printf("Lookup not served from the cache\n");
+        failures++;
+    }
+
+    /* A refresh scans the busses but doesn't open known devices again */
+    opens = usbsim_opens;
+    if ((estrella_refresh_devices() != ESTROK) || (usbsim_finds == finds) ||
+        (usbsim_opens != opens)) {
+        printf("Refresh went wrong\n");
+        failures++;
+    }
+
+    /* Serial numbers don't depend on enumeration order */
+    finds = usbsim_finds;
+    registry_serial(serial, sizeof(serial), 5);
+    if ((estrella_get_device_by_serial(&dev, serial) != ESTROK) ||
+        (dev.spec.usb.devnum != 6) || (usbsim_finds != finds)) {
+        printf("Lookup by serial number failed\n");
+        failures++;
+    }
+
+    /* Half of the devices are unplugged, and plugged back in without anybody
+     * being told. Looking one of those up misses the cache, which is
+     * refreshed then. Only the devices which are new are opened. */
+    usbsim_present = USBSIM_DEVICES/2;
+    if ((estrella_refresh_devices() != ESTROK) || (estrella_num_devices(&num) != ESTROK) ||
+        (num != USBSIM_DEVICES/2)) {
+        printf("Unplugged devices still registered\n");
+        failures++;
+    }
+
+    usbsim_present = USBSIM_DEVICES;
+    opens = usbsim_opens;
+    finds = usbsim_finds;
+    registry_serial(serial, sizeof(serial), USBSIM_DEVICES-1);
+    if ((estrella_get_device_by_serial(&dev, serial) != ESTROK) ||
+        (dev.spec.usb.devnum != USBSIM_DEVICES) || (usbsim_finds == finds) ||
+        (usbsim_opens != opens + USBSIM_DEVICES/2)) {
+        printf("Miss did not refresh the registry\n");
+        failures++;
+    }
+
+    if (estrella_get_device_by_serial(&dev, "nosuchdevice") != ESTRINV) {
+        printf("Found a device which does not exist\n");
+        failures++;
+    }
+
+    /* Devices come and go while the registry is being rebuilt, as hotplug
+     * notifications would tell. What was found may be outdated already, so
+     * the next lookup has to rebuild it again. */
+    usbsim_find_hook = estrella_registry_invalidate;
+    estrella_refresh_devices();
+    usbsim_find_hook = NULL;
+
+    finds = usbsim_finds;
+    if ((estrella_num_devices(&num) != ESTROK) || (usbsim_finds == finds)) {
+        printf("Invalidation during a rebuild got lost\n");
+        failures++;
+    }
+
+    finds = usbsim_finds;
+    if ((estrella_num_devices(&num) != ESTROK) || (usbsim_finds != finds)) {
+        printf("Registry not valid after the rebuild\n");
+        failures++;
+    }
+
+    if (failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Checks the simulated device: spectra, noise, timing, trigger mode and
+ * streaming. Unlike estrella_stress_test this works with either USB backend,
+ * there is no USB involved at all. */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "estrella.h"
+
+#define SIM_RATE        (10)
+#define SIM_FRAMES      (10)
+
+/* Mean and standard deviation of buffer[from..to) */
+static void sim_moments(const float *buffer, int from, int to, double *mean, double *sdev)
+{
+    double sum = 0.0, sq = 0.0;
+    int i;
+
+    for (i=from;i<to;i++) {
+        sum += buffer[i];
+        sq += (double)buffer[i]*buffer[i];
+    }
+
+    *mean = sum/(to - from);
+    *sdev = sqrt(sq/(to - from) - *mean**mean);
+}
+
+static int sim_argmax(const float *buffer)
+{
+    int i, max = 0;
+
+    for (i=1;i<2047;i++) {
+        if (buffer[i] > buffer[max])
+            max = i;
+    }
+
+    return max;
+}
+
+int main(int argc, char *argv[])
+{
+    estrella_dev_t dev;
+    estrella_session_t session, twin;
+    estrella_frame_t frame;
+    estr_frametime_t frametime;
+    estr_triggerwait_t triggerwait;
+    float buffer[2051], other[2051];
+    double mean, sdev;
+    int i, failures = 0;
+
+    if (estrella_sim_device(&dev, 0) != ESTROK) {
+        printf("Unable to describe a simulated device\n");
+        return 1;
+    }
+
+    /* A single lorentzian line, 40 counts per ms on 1000 counts dark */
+    dev.spec.sim.peaks = 1;
+    dev.spec.sim.peak[0].shape = ESTR_SIMPEAK_LORENTZ;
+    dev.spec.sim.peak[0].position = 1000.0f;
+    dev.spec.sim.peak[0].width = 10.0f;
+    dev.spec.sim.peak[0].height = 40.0f;
+
+    if ((estrella_init(&session, &dev) != ESTROK) ||
+        (estrella_init(&twin, &dev) != ESTROK)) {
+        printf("Unable to create sessions\n");
+        return 1;
+    }
+
+    estrella_rate(&session, SIM_RATE, ESTR_XRES_HIGH);
+    estrella_rate(&twin, SIM_RATE, ESTR_XRES_HIGH);
+
+    /* Integration takes as long as it takes on a real device */
+    if ((estrella_scan(&session, buffer) != ESTROK) ||
+        (estrella_frametime(&session, &frametime) != ESTROK) ||
+        (frametime.complete - frametime.start < SIM_RATE*1000000ULL)) {
+        printf("Scan failed\n");
+        failures++;
+    }
+
+    /* Peak on top of the dark level, half height at half width */
+    sim_moments(buffer, 0, 500, &mean, &sdev);
+    if ((sim_argmax(buffer) != 1000) ||
+        (fabs(buffer[1000] - 1400.0) > 20.0) ||
+        (fabs(buffer[995] - 1200.0) > 20.0) ||
+        (fabs(mean - 1000.0) > 2.0) || (sdev < 3.0) || (sdev > 5.0)) {
+        printf("Unexpected spectrum\n");
+        failures++;
+    }
+
+    /* Same seed, same spectrum */
+    if ((estrella_scan(&twin, other) != ESTROK) ||
+        (memcmp(buffer, other, sizeof(buffer)) != 0)) {
+        printf("Spectra not reproducible\n");
+        failures++;
+    }
+
+    /* Averaging reduces the noise, temperature compensation removes the dark
+     * level read from the masked pixels */
+    estrella_update(&session, 16, ESTR_XSMOOTH_NONE, ESTR_TEMPCOMP_ON);
+    if (estrella_scan(&session, buffer) != ESTROK) {
+        printf("Averaging failed\n");
+        failures++;
+    }
+
+    sim_moments(buffer, 16, 500, &mean, &sdev);
+    if ((fabs(mean) > 1.0) || (sdev > 2.0) || (fabs(buffer[1000] - 400.0) > 10.0)) {
+        printf("Unexpected averaged spectrum\n");
+        failures++;
+    }
+    estrella_update(&session, 1, ESTR_XSMOOTH_NONE, ESTR_TEMPCOMP_OFF);
+
+    /* Peaks grow with the integration time */
+    estrella_rate(&session, 2*SIM_RATE, ESTR_XRES_HIGH);
+    if ((estrella_scan(&session, buffer) != ESTROK) ||
+        (fabs(buffer[1000] - 1800.0) > 20.0)) {
+        printf("Rate not applied\n");
+        failures++;
+    }
+
+    /* Stream a couple of frames */
+    if (estrella_stream_start(&session, 4) == ESTROK) {
+        for (i=0;i<SIM_FRAMES;i++) {
+            if ((estrella_stream_read(&session, &frame, 1000) != ESTROK) ||
+                (sim_argmax(frame.data) != 1000)) {
+                printf("Streaming failed\n");
+                failures++;
+                break;
+            }
+        }
+        estrella_stream_stop(&session);
+    } else {
+        printf("Unable to start a stream\n");
+        failures++;
+    }
+
+    /* In trigger mode integration starts on the next trigger pulse */
+    estrella_mode(&session, ESTR_XTMODE_TRIGGER);
+    triggerwait.timeout = 500;
+    triggerwait.maxinterval = 1000;
+    estrella_triggerwait(&session, &triggerwait);
+    if (estrella_scan(&session, buffer) != ESTROK) {
+        printf("Trigger never arrived\n");
+        failures++;
+    }
+    estrella_close(&session);
+
+    /* Without a trigger we give up at the deadline */
+    dev.spec.sim.trigger = 0;
+    triggerwait.timeout = 50;
+    if ((estrella_init(&session, &dev) != ESTROK) ||
+        (estrella_mode(&session, ESTR_XTMODE_TRIGGER) != ESTROK) ||
+        (estrella_triggerwait(&session, &triggerwait) != ESTROK) ||
+        (estrella_scan(&session, buffer) != ESTRTIMEOUT)) {
+        printf("Trigger wait did not time out\n");
+        failures++;
+    }
+    estrella_close(&session);
+    estrella_close(&twin);
+
+    /* Nonsense configurations are refused */
+    dev.spec.sim.peak[0].width = 0.0f;
+    if (estrella_init(&session, &dev) == ESTROK) {
+        printf("Invalid configuration accepted\n");
+        failures++;
+        estrella_close(&session);
+    }
+
+    if (failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}
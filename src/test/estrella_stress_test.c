@@ -0,0 +1,414 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Drives a number of sessions from separate threads at the same time. There is
+ * no hardware involved, the simulated devices of estrella_usbsim.c are used
+ * instead. Each of them encodes its own index and current integration time
+ * into the scan data, so results leaking from one session into another are
+ * detected. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "estrella.h"
+#include "estrella_usbsim.h"
+
+/* Number of sessions, one per simulated device, and scans per session */
+#define STRESS_SESSIONS     (USBSIM_DEVICES)
+#define STRESS_SCANS        (100)
+
+typedef struct {
+    int index;
+    estrella_session_t *session;
+    int failures;
+} stress_arg_t;
+
+static int stress_check(int index, int rate, float *buffer)
+{
+    int i;
+
+    if ((buffer[0] != (float)index) || (buffer[1] != (float)rate))
+        return 1;
+
+    for (i=2;i<2047;i++) {
+        if (buffer[i] != (float)(i+1))
+            return 1;
+    }
+
+    return 0;
+}
+
+static unsigned long stress_hist_count(estr_hist_t *hist)
+{
+    int i;
+    unsigned long count = 0;
+
+    for (i=0;i<ESTRELLA_HIST_BUCKETS;i++)
+        count += hist->bucket[i];
+
+    return count;
+}
+
+static void *stress_thread(void *arg)
+{
+    int rc, i;
+    float buffer[2051];
+    stress_arg_t *sarg = (stress_arg_t*)arg;
+
+    for (i=0;i<STRESS_SCANS;i++) {
+        int rate = 2 + ((sarg->index + i) % 4);
+
+        rc = estrella_rate(sarg->session, rate, ESTR_XRES_LOW);
+        if (rc != ESTROK) {
+            sarg->failures++;
+            continue;
+        }
+
+        /* Alternate between the compound and the async interface */
+        if (i % 2) {
+            rc = estrella_scan(sarg->session, buffer);
+        } else {
+            rc = estrella_async_scan(sarg->session);
+            if (rc == ESTROK)
+                rc = estrella_async_result(sarg->session, buffer);
+        }
+
+        if ((rc != ESTROK) || stress_check(sarg->index, rate, buffer))
+            sarg->failures++;
+    }
+
+    return NULL;
+}
+
+static void *race_thread(void *arg)
+{
+    stress_arg_t *sarg = (stress_arg_t*)arg;
+
+    if (estrella_async_scan(sarg->session) == ESTROK)
+        sarg->failures = 0;
+    else
+        sarg->failures = 1;
+
+    return NULL;
+}
+
+/* Scans and waits forever, for the trigger tests */
+static void *trigger_thread(void *arg)
+{
+    float buffer[2051];
+    stress_arg_t *sarg = (stress_arg_t*)arg;
+
+    sarg->failures = estrella_scan(sarg->session, buffer);
+
+    return NULL;
+}
+
+/* Waits forever for a frame which never comes, for the stream stop tests */
+static void *acquire_thread(void *arg)
+{
+    estrella_frame_t *frame;
+    stress_arg_t *sarg = (stress_arg_t*)arg;
+
+    sarg->failures = estrella_frame_acquire(sarg->session, &frame, -1);
+    if (sarg->failures == ESTROK)
+        estrella_frame_release(frame);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[]) 
+{
+    int rc, i, n, winners, failures;
+    dll_list_t devices;
+    unsigned int numdevices = 0;
+    estrella_session_t sessions[STRESS_SESSIONS];
+    stress_arg_t args[STRESS_SESSIONS];
+    pthread_t threads[STRESS_SESSIONS];
+    float buffer[2051];
+    uint16_t raw[ESTRELLA_RAW_WORDS];
+    estrella_frame_t *frames[3];
+    estr_frametime_t frametime;
+    estr_stats_t stats;
+    estr_triggerwait_t triggerwait;
+    estrella_group_t *group;
+    estrella_session_t *members[4];
+    float groupdata[4][2051];
+    float *groupbufs[4];
+    int groupresults[4];
+    unsigned long spread;
+    estr_triggerstats_t triggerstats;
+
+    dll_init(&devices);
+
+    rc = estrella_find_devices(&devices);
+    if (rc != ESTROK) {
+        printf("Unable to search for usb devices\n");
+        dll_clear(&devices);
+        return 1;
+    }
+   
+    rc = dll_count(&devices, &numdevices);
+    if ((rc != EDLLOK) || (numdevices != STRESS_SESSIONS)) {
+        printf("Expected %d simulated devices, found %u\n", STRESS_SESSIONS, numdevices);
+        dll_clear(&devices);
+        return 1;
+    }
+
+    for (i=0;i<STRESS_SESSIONS;i++) {
+        void *device = NULL;
+
+        dll_get(&devices, &device, NULL, i);
+        rc = estrella_init(&sessions[i], (estrella_dev_t*)device);
+        if (rc != ESTROK) {
+            printf("Unable to create session %d\n", i);
+            return 1;
+        }
+        estrella_update(&sessions[i], 1 + (i % 2), ESTR_XSMOOTH_NONE, ESTR_TEMPCOMP_OFF);
+
+        args[i].index = i;
+        args[i].session = &sessions[i];
+        args[i].failures = 0;
+    }
+
+    /* Hammer all sessions at the same time */
+    for (i=0;i<STRESS_SESSIONS;i++)
+        pthread_create(&threads[i], NULL, stress_thread, &args[i]);
+
+    failures = 0;
+    for (i=0;i<STRESS_SESSIONS;i++) {
+        pthread_join(threads[i], NULL);
+        if (args[i].failures) {
+            printf("Session %d: %d of %d scans failed\n", i, args[i].failures, STRESS_SCANS);
+            failures++;
+        }
+    }
+
+    /* Now have all threads race for the same session. Exactly one of them may
+     * start a scan. */
+    for (i=0;i<STRESS_SESSIONS;i++) {
+        args[i].session = &sessions[0];
+        pthread_create(&threads[i], NULL, race_thread, &args[i]);
+    }
+
+    winners = 0;
+    for (i=0;i<STRESS_SESSIONS;i++) {
+        pthread_join(threads[i], NULL);
+        if (args[i].failures == 0)
+            winners++;
+    }
+
+    if (winners != 1) {
+        printf("%d threads started a scan on the same session\n", winners);
+        failures++;
+    }
+
+    if ((estrella_async_result(&sessions[0], buffer) != ESTROK) || stress_check(0, sessions[0].rate, buffer)) {
+        printf("Unable to fetch the contended scan\n");
+        failures++;
+    }
+
+    /* Raw scans deliver the header word and the counts as they are */
+    estrella_stats_reset(&sessions[1]);
+    if ((estrella_scan_raw(&sessions[1], raw) != ESTROK) ||
+        (raw[0] != 0) || (raw[1] != 1) || (raw[2] != sessions[1].rate) || (raw[2047] != 2047)) {
+        printf("Raw scan failed\n");
+        failures++;
+    }
+
+    /* That scan has been counted */
+    if ((estrella_stats_get(&sessions[1], &stats) != ESTROK) ||
+        (stats.frames != 1) || (stats.bulkbytes != 4096) || (stats.polls < 1) ||
+        (stats.errors != 0) || (stress_hist_count(&stats.start) != 1) ||
+        (stress_hist_count(&stats.wait) != 1) || (stress_hist_count(&stats.bulk) != 1)) {
+        printf("Performance counters wrong\n");
+        failures++;
+    }
+
+    /* Every scan is stamped in order */
+    if ((estrella_frametime(&sessions[1], &frametime) != ESTROK) ||
+        (frametime.start == 0) || (frametime.complete < frametime.start) ||
+        (frametime.received < frametime.complete)) {
+        printf("Scan timing wrong\n");
+        failures++;
+    }
+
+    /* Lease every frame of a stream, the pool is exhausted then. Leased
+     * frames have to survive the stream. */
+    if (estrella_stream_start(&sessions[2], 2) == ESTROK) {
+        if ((estrella_frame_acquire(&sessions[2], &frames[0], -1) != ESTROK) ||
+            (estrella_frame_acquire(&sessions[2], &frames[1], -1) != ESTROK) ||
+            (estrella_frame_acquire(&sessions[2], &frames[2], 1000) != ESTRBUSY)) {
+            printf("Frame pool not exhausted\n");
+            failures++;
+            estrella_stream_stop(&sessions[2]);
+        } else {
+            estrella_frame_retain(frames[0]);
+            estrella_frame_release(frames[1]);
+            if (estrella_frame_acquire(&sessions[2], &frames[1], 1000) != ESTROK) {
+                printf("Released frame did not come back\n");
+                failures++;
+            }
+            estrella_stream_stop(&sessions[2]);
+
+            if (stress_check(2, sessions[2].rate, frames[0]->data) ||
+                stress_check(2, sessions[2].rate, frames[1]->data) ||
+                (frames[0]->sequence >= frames[1]->sequence) ||
+                (frames[0]->time.received < frames[0]->time.start) ||
+                (frames[1]->time.start < frames[0]->time.received)) {
+                printf("Leased frames corrupted\n");
+                failures++;
+            }
+            estrella_frame_release(frames[0]);
+            estrella_frame_release(frames[0]);
+            estrella_frame_release(frames[1]);
+        }
+    } else {
+        printf("Unable to start a stream\n");
+        failures++;
+    }
+
+    /* Scan with the last four devices as a group */
+    for (i=0;i<4;i++)
+        members[i] = &sessions[4+i];
+
+    if (estrella_group_create(&group, &members[0], 4) == ESTROK) {
+        for (i=0;i<4;i++)
+            groupbufs[i] = groupdata[i];
+
+        for (n=0;n<10;n++) {
+            if ((estrella_group_scan(group, groupbufs, groupresults, &spread) != ESTROK) ||
+                (spread > 100*1000)) {
+                printf("Group scan failed\n");
+                failures++;
+                break;
+            }
+            for (i=0;i<4;i++) {
+                if (stress_check(4+i, sessions[4+i].rate, groupbufs[i])) {
+                    printf("Group scan data corrupted\n");
+                    failures++;
+                    break;
+                }
+            }
+        }
+        estrella_group_destroy(group);
+    } else {
+        printf("Unable to create a group\n");
+        failures++;
+    }
+
+    /* Waiting for a trigger gives up at the deadline or when cancelled from
+     * another thread. Stopping a stream must not wait for the trigger. */
+    triggerwait.timeout = 50;
+    triggerwait.maxinterval = 1000;
+    estrella_mode(&sessions[3], ESTR_XTMODE_TRIGGER);
+    estrella_triggerwait(&sessions[3], &triggerwait);
+    __atomic_store_n(&usbsim_hold, 1, __ATOMIC_RELAXED);
+
+    if (estrella_scan(&sessions[3], buffer) != ESTRTIMEOUT) {
+        printf("Trigger wait did not time out\n");
+        failures++;
+    }
+
+    /* A cancellation request made before the scan is held back for it. No
+     * matter whether the thread below is already waiting for its trigger or
+     * has not even started yet, it must not wait forever. */
+    triggerwait.timeout = -1;
+    estrella_triggerwait(&sessions[3], &triggerwait);
+    estrella_cancel(&sessions[3]);
+    if (estrella_scan(&sessions[3], buffer) != ESTRCANCEL) {
+        printf("Early cancellation request got lost\n");
+        failures++;
+    }
+
+    args[3].session = &sessions[3];
+    pthread_create(&threads[3], NULL, trigger_thread, &args[3]);
+    estrella_cancel(&sessions[3]);
+    pthread_join(threads[3], NULL);
+    if (args[3].failures != ESTRCANCEL) {
+        printf("Trigger wait not cancelled\n");
+        failures++;
+    }
+
+    if ((estrella_stream_start(&sessions[3], 2) != ESTROK) ||
+        (estrella_stream_stop(&sessions[3]) != ESTROK)) {
+        printf("Stream waiting for a trigger did not stop\n");
+        failures++;
+    }
+
+    /* Stopping a stream has to wake up consumers waiting for a frame, and
+     * must not pull the stream out from under them. Depending on timing the
+     * consumer is already waiting or finds no stream at all, the result is
+     * the same. */
+    for (i=0;i<10;i++) {
+        struct timespec pause = {0, 2*1000*1000};
+
+        if (estrella_stream_start(&sessions[3], 2) != ESTROK) {
+            printf("Unable to start a stream\n");
+            failures++;
+            break;
+        }
+
+        args[3].failures = ESTROK;
+        pthread_create(&threads[3], NULL, acquire_thread, &args[3]);
+        if (i % 2)
+            nanosleep(&pause, NULL);
+        estrella_stream_stop(&sessions[3]);
+        pthread_join(threads[3], NULL);
+
+        if (args[3].failures != ESTRINV) {
+            printf("Consumer not woken up by stopping the stream\n");
+            failures++;
+            break;
+        }
+    }
+
+    __atomic_store_n(&usbsim_hold, 0, __ATOMIC_RELAXED);
+    if ((estrella_scan(&sessions[3], buffer) != ESTROK) ||
+        (estrella_trigger_stats(&sessions[3], &triggerstats, 1) != ESTROK) ||
+        (triggerstats.triggers != (unsigned long)sessions[3].scanstoavg) ||
+        (triggerstats.timeouts != 1) || (triggerstats.cancels < 1) ||
+        (triggerstats.min < (unsigned long)sessions[3].rate*1000) ||
+        (triggerstats.min > triggerstats.max)) {
+        printf("Trigger statistics wrong\n");
+        failures++;
+    }
+
+    for (i=0;i<STRESS_SESSIONS;i++)
+        estrella_close(&sessions[i]);
+    dll_clear(&devices);
+
+    if (failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+
+    printf("OK, %d sessions x %d scans\n", STRESS_SESSIONS, STRESS_SCANS);
+    return 0;
+}
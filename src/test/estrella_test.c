@@ -27,47 +27,28 @@
 */
 
 #include <stdio.h>
-#include <time.h>
+#include <string.h>
 
 #include "estrella.h"
 
-/* Uncomment if on your platform there's no clock_gettime() */
+/* Comment out if you dont want to have the scan statistics printed */
 #define ESTRELLA_TEST_TIMING
 
 /* Uncomment if you dont want to have the scan result printed */
 /*#define ESTRELLA_TEST_RESULT*/
 
-int timestamp_diffus(struct timespec *ts1, struct timespec *ts2, unsigned long *diff)
+#ifdef ESTRELLA_TEST_TIMING
+static void print_hist(const char *name, estr_hist_t *hist)
 {
-    unsigned long us_passed = 0;
-    unsigned long stv1_adds = 0;
-    unsigned long stv1_nssub = 0;
-    struct timespec *stv1, *stv2;
-
-    stv1 = ts1;
-    stv2 = ts2;
-
-    if (stv1->tv_sec > stv2->tv_sec) {
-        stv1 = ts2;
-        stv2 = ts1;
-    } 
-
-    if (stv2->tv_sec != stv1->tv_sec) {
-        us_passed += ((1000*1000*1000)-stv1->tv_nsec)/1000;
-        stv1_adds = 1;
-        stv1_nssub = stv1->tv_nsec;
-    } else if (stv1->tv_nsec > stv2->tv_nsec) {
-        stv1 = ts2;
-        stv2 = ts1; 
-    }
-
-    us_passed += (stv2->tv_sec - (stv1->tv_sec+stv1_adds))*1000*1000;
-    us_passed += (stv2->tv_nsec - (stv1->tv_nsec-stv1_nssub))/1000;
-
-    *diff = us_passed; 
+    int i;
 
-    return ESTROK;
+    printf("%s:\n", name);
+    for (i=0;i<ESTRELLA_HIST_BUCKETS;i++) {
+        if (hist->bucket[i])
+            printf("  >= %8luus: %lu\n", (i == 0) ? 0UL : 1UL << i, hist->bucket[i]);
+    }
 }
+#endif
 
 int main(int argc, char *argv[]) 
 {
@@ -76,37 +57,43 @@ int main(int argc, char *argv[])
     void *device = NULL;
     unsigned int numdevices = 0;
     estrella_session_t esession;
+    estrella_dev_t simdev;
     int i;
     float buffer[2051];
 
 #ifdef ESTRELLA_TEST_TIMING
-    struct timespec tp_start1, tp_start2, tp_res1, tp_res2;
-    unsigned long usec_start;
-    unsigned long usec_res;
-    unsigned long diff;
+    estr_stats_t stats;
 #endif
 
     dll_init(&devices);
 
-    rc = estrella_find_devices(&devices);
-    if (rc != 0) {
-        printf("Unable to search for usb devices\n");
-        dll_clear(&devices);
-        return 1;
-    }
-   
-    rc = dll_count(&devices, &numdevices);
-    if ((rc != EDLLOK) || (numdevices == 0)) {
-        printf("No devices found\n");
-        dll_clear(&devices);
-        return 1;
+    /* -s runs the test against a simulated device */
+    if ((argc > 1) && (strcmp(argv[1], "-s") == 0)) {
+        estrella_sim_device(&simdev, 0);
+        device = &simdev;
     }
 
-    /* get the first of the found devices. */
-    rc = dll_get(&devices, &device, NULL, 0);
-    if (rc != EDLLOK) {
-        dll_clear(&devices);
-        return 1;
+    if (!device) {
+        rc = estrella_find_devices(&devices);
+        if (rc != 0) {
+            printf("Unable to search for usb devices\n");
+            dll_clear(&devices);
+            return 1;
+        }
+       
+        rc = dll_count(&devices, &numdevices);
+        if ((rc != EDLLOK) || (numdevices == 0)) {
+            printf("No devices found\n");
+            dll_clear(&devices);
+            return 1;
+        }
+
+        /* get the first of the found devices. */
+        rc = dll_get(&devices, &device, NULL, 0);
+        if (rc != EDLLOK) {
+            dll_clear(&devices);
+            return 1;
+        }
     }
 
     rc = estrella_init(&esession, (estrella_dev_t*)device);
@@ -133,38 +120,17 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    usec_start = 0;
-    usec_res = 0;
     for(i=0;i<1000;i++) {
 
         printf("i: %d\n", i);
 
-#ifdef ESTRELLA_TEST_TIMING
-        clock_gettime(CLOCK_MONOTONIC, &tp_start1);
-#endif
-
         rc = estrella_async_scan(&esession);
         if (rc != ESTROK)
             break;
 
-#ifdef ESTRELLA_TEST_TIMING
-        clock_gettime(CLOCK_MONOTONIC, &tp_start2);
-        clock_gettime(CLOCK_MONOTONIC, &tp_res1);
-#endif
-
         rc = estrella_async_result(&esession, buffer);
         if (rc != ESTROK)
             break;
-
-#ifdef ESTRELLA_TEST_TIMING
-        clock_gettime(CLOCK_MONOTONIC, &tp_res2);
-        timestamp_diffus(&tp_start1, &tp_start2, &diff);
-        usec_start += diff;
-        timestamp_diffus(&tp_res1, &tp_res2, &diff);
-        usec_res += diff;
-        printf("usec_res: %lu\n", usec_res);
-#endif
-
     }
 
     if (rc != ESTROK) {
@@ -175,7 +141,12 @@ int main(int argc, char *argv[])
     }
 
 #ifdef ESTRELLA_TEST_TIMING
-    printf("tart scan took %luus, getting results took %luus\n", usec_start/1000, usec_res/(1000));
+    estrella_stats_get(&esession, &stats);
+    printf("%lu frames, %lu timeouts, %lu errors, %lu polls, %llu bytes\n",
+            stats.frames, stats.timeouts, stats.errors, stats.polls, stats.bulkbytes);
+    print_hist("Start request", &stats.start);
+    print_hist("Completion wait", &stats.wait);
+    print_hist("Bulk read", &stats.bulk);
 #endif
 
 #ifdef ESTRELLA_TEST_RESULT
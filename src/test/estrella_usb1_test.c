@@ -0,0 +1,212 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Exercises the libusb-1.0 backend against the simulated devices of
+ * estrella_usb1sim.c: control and bulk transfers completing, failing and
+ * timing out, scans being cancelled, and sessions being closed while a
+ * transfer is still in flight. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "estrella.h"
+#include "estrella_usb1sim.h"
+
+#define USB1_RATE       (5)
+
+typedef struct {
+    estrella_session_t *session;
+    int rc;
+} usb1_arg_t;
+
+/* Did this frame come from the scan last started on the device? */
+static int usb1_check(int index, float *buffer)
+{
+    int i;
+
+    if ((buffer[0] != (float)index) || (buffer[1] != (float)USB1_RATE) ||
+        (buffer[2] != (float)(usb1sim_scans(index) & 0xffff)))
+        return 1;
+
+    for (i=3;i<2047;i++) {
+        if (buffer[i] != (float)(i+1))
+            return 1;
+    }
+
+    return 0;
+}
+
+static void usb1_sleep(long ms)
+{
+    struct timespec pause;
+
+    pause.tv_sec = ms/1000;
+    pause.tv_nsec = (ms%1000)*1000*1000;
+    nanosleep(&pause, NULL);
+}
+
+/* Scans and waits forever, for the cancellation tests */
+static void *usb1_scan_thread(void *arg)
+{
+    float buffer[2051];
+    usb1_arg_t *uarg = (usb1_arg_t*)arg;
+
+    uarg->rc = estrella_scan(uarg->session, buffer);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int rc, i, failures = 0;
+    dll_list_t devices;
+    unsigned int numdevices = 0;
+    estrella_session_t sessions[USB1SIM_DEVICES];
+    estr_triggerwait_t triggerwait;
+    float buffer[2051];
+    unsigned long cancels;
+    usb1_arg_t arg;
+    pthread_t thread;
+
+    dll_init(&devices);
+
+    rc = estrella_find_devices(&devices);
+    if ((rc != ESTROK) || (dll_count(&devices, &numdevices) != EDLLOK) ||
+        (numdevices != USB1SIM_DEVICES)) {
+        printf("Expected %d simulated devices, found %u\n", USB1SIM_DEVICES, numdevices);
+        dll_clear(&devices);
+        return 1;
+    }
+
+    for (i=0;i<USB1SIM_DEVICES;i++) {
+        void *device = NULL;
+
+        dll_get(&devices, &device, NULL, i);
+        if ((estrella_init(&sessions[i], (estrella_dev_t*)device) != ESTROK) ||
+            (estrella_update(&sessions[i], 1, ESTR_XSMOOTH_NONE, ESTR_TEMPCOMP_OFF) != ESTROK) ||
+            (estrella_rate(&sessions[i], USB1_RATE, ESTR_XRES_LOW) != ESTROK)) {
+            printf("Unable to set up session %d\n", i);
+            return 1;
+        }
+    }
+
+    /* Control transfers for setup and status, the bulk transfer for data */
+    for (i=0;i<10;i++) {
+        if ((estrella_scan(&sessions[0], buffer) != ESTROK) || usb1_check(0, buffer)) {
+            printf("Scan %d failed\n", i);
+            failures++;
+            break;
+        }
+    }
+
+    /* A failed control transfer is an error, not a hang */
+    __atomic_store_n(&usb1sim_stall, 1, __ATOMIC_RELAXED);
+    if (estrella_rate(&sessions[0], USB1_RATE, ESTR_XRES_LOW) != ESTRERR) {
+        printf("Stalled control transfer went unnoticed\n");
+        failures++;
+    }
+    __atomic_store_n(&usb1sim_stall, 0, __ATOMIC_RELAXED);
+
+    /* The device never completes, so the scan times out. Its data shows up
+     * after all once the device is let go, by then it must have been thrown
+     * away and must not be taken for the next scan's. */
+    __atomic_store_n(&usb1sim_hold, 1, __ATOMIC_RELAXED);
+    if (estrella_scan(&sessions[0], buffer) != ESTRTIMEOUT) {
+        printf("Scan did not time out\n");
+        failures++;
+    }
+    __atomic_store_n(&usb1sim_hold, 0, __ATOMIC_RELAXED);
+    usb1_sleep(2*USB1_RATE);
+
+    if ((estrella_scan(&sessions[0], buffer) != ESTROK) || usb1_check(0, buffer)) {
+        printf("Data of a timed out scan returned for the next one\n");
+        failures++;
+    }
+
+    /* Cancelling a scan waiting for its trigger. The request counts no
+     * matter whether it comes before or after the scan has started. */
+    triggerwait.timeout = -1;
+    triggerwait.maxinterval = 1000;
+    estrella_mode(&sessions[0], ESTR_XTMODE_TRIGGER);
+    estrella_triggerwait(&sessions[0], &triggerwait);
+    __atomic_store_n(&usb1sim_hold, 1, __ATOMIC_RELAXED);
+
+    cancels = __atomic_load_n(&usb1sim_cancels, __ATOMIC_RELAXED);
+    arg.session = &sessions[0];
+    arg.rc = ESTROK;
+    pthread_create(&thread, NULL, usb1_scan_thread, &arg);
+    estrella_cancel(&sessions[0]);
+    pthread_join(thread, NULL);
+    if ((arg.rc != ESTRCANCEL) ||
+        (__atomic_load_n(&usb1sim_cancels, __ATOMIC_RELAXED) != cancels + 1)) {
+        printf("Scan not cancelled or its transfer left behind\n");
+        failures++;
+    }
+
+    __atomic_store_n(&usb1sim_hold, 0, __ATOMIC_RELAXED);
+    estrella_mode(&sessions[0], ESTR_XTMODE_NORMAL);
+    usb1_sleep(2*USB1_RATE);
+
+    if ((estrella_scan(&sessions[0], buffer) != ESTROK) || usb1_check(0, buffer)) {
+        printf("Data of a cancelled scan returned for the next one\n");
+        failures++;
+    }
+
+    /* Each session keeps its bulk transfer in flight between scans. Closing
+     * has to get it back, the simulation aborts if a transfer in flight is
+     * freed. One session is left in the middle of a scan. */
+    if (estrella_async_scan(&sessions[1]) != ESTROK) {
+        printf("Unable to start a scan\n");
+        failures++;
+    }
+
+    if (usb1sim_pending() != USB1SIM_DEVICES) {
+        printf("Expected %d transfers in flight, found %d\n", USB1SIM_DEVICES, usb1sim_pending());
+        failures++;
+    }
+
+    for (i=0;i<USB1SIM_DEVICES;i++)
+        estrella_close(&sessions[i]);
+
+    if (usb1sim_pending() != 0) {
+        printf("%d transfers left in flight after close\n", usb1sim_pending());
+        failures++;
+    }
+
+    dll_clear(&devices);
+
+    if (failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,369 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <libusb.h>
+
+#include "estrella_usb1sim.h"
+
+/* Transfers which may be in flight at the same time */
+#define SIM_TRANSFERS       (16)
+
+int usb1sim_hold = 0;
+int usb1sim_stall = 0;
+unsigned long usb1sim_cancels = 0;
+
+struct libusb_context {
+    int dummy;
+};
+
+struct libusb_device {
+    int index;
+};
+
+struct libusb_device_handle {
+    int index;
+    int rate;
+    int scanning;
+    unsigned long scans;
+    struct timespec start;
+};
+
+/* A submitted transfer, it's done when the callback has been called */
+typedef struct {
+    struct libusb_transfer *transfer;
+    struct timespec submitted;
+    int cancelled;
+} sim_transfer_t;
+
+static struct libusb_context sim_ctx;
+static struct libusb_device sim_devices[USB1SIM_DEVICES];
+static struct libusb_device *sim_list[USB1SIM_DEVICES + 1];
+static struct libusb_device_handle sim_handles[USB1SIM_DEVICES];
+
+/* Protects everything above and below */
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sim_transfer_t sim_transfers[SIM_TRANSFERS];
+
+static long sim_elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec)*1000 + (now.tv_nsec - since->tv_nsec)/(1000*1000);
+}
+
+static int sim_complete(struct libusb_device_handle *h)
+{
+    if (!h->scanning || __atomic_load_n(&usb1sim_hold, __ATOMIC_RELAXED))
+        return 0;
+
+    return (sim_elapsed_ms(&h->start) >= h->rate);
+}
+
+/* Same requests as in estrella_usbsim.c */
+static int sim_control(struct libusb_device_handle *h, uint8_t request, unsigned char *data, uint16_t size)
+{
+    if (__atomic_load_n(&usb1sim_stall, __ATOMIC_RELAXED))
+        return -1;
+
+    switch (request) {
+        case 0xb4:
+            if (size != 6)
+                return -1;
+            h->rate = (data[0] << 8) | data[1];
+            return size;
+        case 0xb2:
+            h->scanning = 1;
+            h->scans++;
+            clock_gettime(CLOCK_MONOTONIC, &h->start);
+            return 0;
+        case 0xb3:
+            if (size != 2)
+                return -1;
+            data[0] = 0xb3;
+            data[1] = (unsigned char)sim_complete(h);
+            return size;
+        default:
+            return -1;
+    }
+}
+
+static void sim_scan_data(struct libusb_device_handle *h, unsigned char *data)
+{
+    int i;
+
+    /* The first word is not a sample at all */
+    for (i=0;i<2048;i++) {
+        unsigned short val;
+
+        if (i == 1)
+            val = (unsigned short)h->index;
+        else if (i == 2)
+            val = (unsigned short)h->rate;
+        else if (i == 3)
+            val = (unsigned short)h->scans;
+        else
+            val = (unsigned short)i;
+
+        data[2*i] = (unsigned char)(val & 0xff);
+        data[2*i+1] = (unsigned char)(val >> 8);
+    }
+
+    h->scanning = 0;
+}
+
+/* Decides what happens to a transfer in flight, 0 if nothing yet */
+static int sim_progress(sim_transfer_t *t)
+{
+    struct libusb_transfer *transfer = t->transfer;
+    struct libusb_device_handle *h = transfer->dev_handle;
+
+    if (t->cancelled) {
+        transfer->status = LIBUSB_TRANSFER_CANCELLED;
+        return 1;
+    }
+
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+        struct libusb_control_setup *setup = (struct libusb_control_setup*)transfer->buffer;
+        int rc;
+
+        rc = sim_control(h, setup->bRequest, transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, setup->wLength);
+        if (rc < 0) {
+            transfer->status = LIBUSB_TRANSFER_STALL;
+        } else {
+            transfer->status = LIBUSB_TRANSFER_COMPLETED;
+            transfer->actual_length = rc;
+        }
+        return 1;
+    }
+
+    if ((transfer->endpoint == 0x88) && (transfer->length == 4096) && sim_complete(h)) {
+        sim_scan_data(h, transfer->buffer);
+        transfer->status = LIBUSB_TRANSFER_COMPLETED;
+        transfer->actual_length = transfer->length;
+        return 1;
+    }
+
+    if ((transfer->timeout > 0) && (sim_elapsed_ms(&t->submitted) >= (long)transfer->timeout)) {
+        transfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+        return 1;
+    }
+
+    return 0;
+}
+
+int libusb_init(libusb_context **ctx)
+{
+    int i;
+
+    for (i=0;i<USB1SIM_DEVICES;i++) {
+        sim_devices[i].index = i;
+        sim_list[i] = &sim_devices[i];
+
+        memset(&sim_handles[i], 0, sizeof(struct libusb_device_handle));
+        sim_handles[i].index = i;
+    }
+    sim_list[USB1SIM_DEVICES] = NULL;
+
+    if (ctx)
+        *ctx = &sim_ctx;
+
+    return LIBUSB_SUCCESS;
+}
+
+/* No hotplug, the registry is refreshed on request only */
+int libusb_has_capability(uint32_t capability) { return 0; }
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+    *list = sim_list;
+    return USB1SIM_DEVICES;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices) {}
+uint8_t libusb_get_bus_number(libusb_device *dev) { return 1; }
+uint8_t libusb_get_device_address(libusb_device *dev) { return (uint8_t)(dev->index + 1); }
+void libusb_close(libusb_device_handle *dev_handle) {}
+int libusb_set_configuration(libusb_device_handle *dev, int configuration) { return 0; }
+int libusb_claim_interface(libusb_device_handle *dev, int interface_number) { return 0; }
+int libusb_release_interface(libusb_device_handle *dev, int interface_number) { return 0; }
+
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+    memset(desc, 0, sizeof(struct libusb_device_descriptor));
+    desc->idVendor = 0x0bd7;
+    desc->idProduct = 0xa012;
+    desc->iManufacturer = 1;
+    desc->iProduct = 2;
+    desc->iSerialNumber = 3;
+
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle)
+{
+    *dev_handle = &sim_handles[dev->index];
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_get_string_descriptor_ascii(libusb_device_handle *dev, uint8_t desc_index, unsigned char *data, int length)
+{
+    return snprintf((char*)data, length, "sim%d-%d", dev->index, desc_index);
+}
+
+int libusb_control_transfer(libusb_device_handle *dev_handle, uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout)
+{
+    int rc;
+
+    pthread_mutex_lock(&sim_mutex);
+    rc = sim_control(dev_handle, bRequest, data, wLength);
+    pthread_mutex_unlock(&sim_mutex);
+
+    return (rc < 0) ? LIBUSB_ERROR_IO : rc;
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+    if (iso_packets != 0)
+        return NULL;
+
+    return (struct libusb_transfer*)calloc(1, sizeof(struct libusb_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+    int i;
+
+    /* Freeing a transfer in flight is a bug in the caller */
+    pthread_mutex_lock(&sim_mutex);
+    for (i=0;i<SIM_TRANSFERS;i++) {
+        if (sim_transfers[i].transfer == transfer)
+            abort();
+    }
+    pthread_mutex_unlock(&sim_mutex);
+
+    free(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+    int i, slot = -1;
+
+    pthread_mutex_lock(&sim_mutex);
+    for (i=0;i<SIM_TRANSFERS;i++) {
+        /* Already in flight */
+        if (sim_transfers[i].transfer == transfer) {
+            pthread_mutex_unlock(&sim_mutex);
+            return LIBUSB_ERROR_BUSY;
+        }
+        if ((sim_transfers[i].transfer == NULL) && (slot < 0))
+            slot = i;
+    }
+
+    if (slot >= 0) {
+        sim_transfers[slot].transfer = transfer;
+        sim_transfers[slot].cancelled = 0;
+        clock_gettime(CLOCK_MONOTONIC, &sim_transfers[slot].submitted);
+        transfer->actual_length = 0;
+    }
+    pthread_mutex_unlock(&sim_mutex);
+
+    return (slot >= 0) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_MEM;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+    int i, rc = LIBUSB_ERROR_NOT_FOUND;
+
+    pthread_mutex_lock(&sim_mutex);
+    for (i=0;i<SIM_TRANSFERS;i++) {
+        if ((sim_transfers[i].transfer == transfer) && !sim_transfers[i].cancelled) {
+            sim_transfers[i].cancelled = 1;
+            __atomic_add_fetch(&usb1sim_cancels, 1, __ATOMIC_RELAXED);
+            rc = LIBUSB_SUCCESS;
+        }
+    }
+    pthread_mutex_unlock(&sim_mutex);
+
+    return rc;
+}
+
+int libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed)
+{
+    int i, n = 0;
+    struct libusb_transfer *done[SIM_TRANSFERS];
+    struct timespec idle = {0, 1000*1000};
+
+    pthread_mutex_lock(&sim_mutex);
+    for (i=0;i<SIM_TRANSFERS;i++) {
+        if (sim_transfers[i].transfer && sim_progress(&sim_transfers[i])) {
+            done[n++] = sim_transfers[i].transfer;
+            sim_transfers[i].transfer = NULL;
+        }
+    }
+    pthread_mutex_unlock(&sim_mutex);
+
+    /* Like libusb, completion callbacks may submit again */
+    for (i=0;i<n;i++)
+        done[i]->callback(done[i]);
+
+    if (n == 0)
+        nanosleep(&idle, NULL);
+
+    return LIBUSB_SUCCESS;
+}
+
+unsigned long usb1sim_scans(int index)
+{
+    unsigned long scans;
+
+    pthread_mutex_lock(&sim_mutex);
+    scans = sim_handles[index].scans;
+    pthread_mutex_unlock(&sim_mutex);
+
+    return scans;
+}
+
+int usb1sim_pending(void)
+{
+    int i, n = 0;
+
+    pthread_mutex_lock(&sim_mutex);
+    for (i=0;i<SIM_TRANSFERS;i++) {
+        if (sim_transfers[i].transfer)
+            n++;
+    }
+    pthread_mutex_unlock(&sim_mutex);
+
+    return n;
+}
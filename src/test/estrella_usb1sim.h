@@ -0,0 +1,58 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Simulated libusb-1.0 for testing the asynchronous backend, the counterpart
+ * of estrella_usbsim.h. Transfers are completed from within
+ * libusb_handle_events_timeout_completed(), that is on the backend's event
+ * thread, just like the real thing does. Scan data carries the device index,
+ * the integration time and the number of scans started on the device so far
+ * in samples 0 to 2, the rest counts up. */
+
+#ifndef _ESTRELLA_USB1SIM_H
+#define _ESTRELLA_USB1SIM_H
+
+/* Number of simulated devices */
+#define USB1SIM_DEVICES     (2)
+
+/* While non-zero no scan completes, as if the devices waited for a trigger
+ * pulse which never comes */
+extern int usb1sim_hold;
+
+/* While non-zero control transfers fail with a stall */
+extern int usb1sim_stall;
+
+/* Number of transfers cancelled so far */
+extern unsigned long usb1sim_cancels;
+
+/* Number of scans started on a device so far */
+unsigned long usb1sim_scans(int index);
+
+/* Number of transfers submitted which have not been completed yet */
+int usb1sim_pending(void);
+
+#endif /* _ESTRELLA_USB1SIM_H */
@@ -0,0 +1,217 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <usb.h>
+
+#include "estrella_usbsim.h"
+
+long usbsim_bulk_us = 0;
+int usbsim_hold = 0;
+int usbsim_present = USBSIM_DEVICES;
+unsigned long usbsim_opens = 0;
+unsigned long usbsim_finds = 0;
+void (*usbsim_find_hook)(void) = NULL;
+
+struct usb_dev_handle {
+    int index;
+    int rate;
+    int scanning;
+    struct timespec start;
+};
+
+struct usb_bus *usb_busses = NULL;
+
+static struct usb_bus sim_bus;
+static struct usb_device sim_devices[USBSIM_DEVICES];
+static struct usb_dev_handle sim_handles[USBSIM_DEVICES];
+
+static int sim_complete(struct usb_dev_handle *h)
+{
+    struct timespec now;
+    long ms;
+
+    if (!h->scanning || __atomic_load_n(&usbsim_hold, __ATOMIC_RELAXED))
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (now.tv_sec - h->start.tv_sec)*1000 + (now.tv_nsec - h->start.tv_nsec)/(1000*1000);
+
+    return (ms >= h->rate);
+}
+
+void usb_init(void)
+{
+    int i;
+
+    memset(&sim_bus, 0, sizeof(sim_bus));
+    strcpy(sim_bus.dirname, "001");
+
+    for (i=0;i<USBSIM_DEVICES;i++) {
+        memset(&sim_devices[i], 0, sizeof(struct usb_device));
+        sim_devices[i].bus = &sim_bus;
+        sim_devices[i].devnum = (unsigned char)(i+1);
+        sim_devices[i].descriptor.idVendor = 0x0bd7;
+        sim_devices[i].descriptor.idProduct = 0xa012;
+        if (i > 0) {
+            sim_devices[i].prev = &sim_devices[i-1];
+            sim_devices[i-1].next = &sim_devices[i];
+        }
+
+        memset(&sim_handles[i], 0, sizeof(struct usb_dev_handle));
+        sim_handles[i].index = i;
+    }
+
+    sim_bus.devices = &sim_devices[0];
+    usb_busses = &sim_bus;
+}
+
+int usb_find_busses(void) { return 0; }
+
+int usb_find_devices(void)
+{
+    int i, present = usbsim_present;
+
+    __atomic_add_fetch(&usbsim_finds, 1, __ATOMIC_RELAXED);
+
+    /* Only the first few devices are plugged in */
+    for (i=0;i<USBSIM_DEVICES;i++)
+        sim_devices[i].next = ((i+1) < present) ? &sim_devices[i+1] : NULL;
+    sim_bus.devices = (present > 0) ? &sim_devices[0] : NULL;
+
+    if (usbsim_find_hook)
+        usbsim_find_hook();
+
+    return 0;
+}
+int usb_close(usb_dev_handle *dev) { return 0; }
+int usb_set_configuration(usb_dev_handle *dev, int configuration) { return 0; }
+int usb_claim_interface(usb_dev_handle *dev, int interface) { return 0; }
+int usb_release_interface(usb_dev_handle *dev, int interface) { return 0; }
+
+usb_dev_handle *usb_open(struct usb_device *dev)
+{
+    __atomic_add_fetch(&usbsim_opens, 1, __ATOMIC_RELAXED);
+    return &sim_handles[dev - sim_devices];
+}
+
+int usb_get_descriptor(usb_dev_handle *udev, unsigned char type, unsigned char index, void *buf, int size)
+{
+    unsigned char *desc = (unsigned char*)buf;
+
+    memset(desc, 0, size);
+    desc[8] = 0xd7;
+    desc[9] = 0x0b;
+    desc[10] = 0x12;
+    desc[11] = 0xa0;
+    desc[14] = 1;
+    desc[15] = 2;
+    desc[16] = 3;
+
+    return size;
+}
+
+int usb_get_string_simple(usb_dev_handle *dev, int index, char *buf, size_t buflen)
+{
+    return snprintf(buf, buflen, "sim%d-%d", dev->index, index);
+}
+
+int usb_control_msg(usb_dev_handle *dev, int requesttype, int request, int value, int index, char *bytes, int size, int timeout)
+{
+    unsigned char *data = (unsigned char*)bytes;
+    struct timespec transfer = {0, 100*1000};
+
+    /* Control transfers take a while on a real bus, the request data has to
+     * stay put meanwhile. This also widens the window for races. */
+    nanosleep(&transfer, NULL);
+
+    switch (request) {
+        case 0xb4:
+            /* Setup, data[0] and data[1] hold the integration time */
+            if (size != 6)
+                return -1;
+            dev->rate = (data[0] << 8) | data[1];
+            return size;
+        case 0xb2:
+            /* Start scanning */
+            dev->scanning = 1;
+            clock_gettime(CLOCK_MONOTONIC, &dev->start);
+            return 0;
+        case 0xb3:
+            /* Status */
+            if (size != 2)
+                return -1;
+            data[0] = 0xb3;
+            data[1] = (unsigned char)sim_complete(dev);
+            nanosleep(&transfer, NULL);
+            return size;
+        default:
+            return -1;
+    }
+}
+
+int usb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+    int i;
+    unsigned char *data = (unsigned char*)bytes;
+
+    /* Asking for data before the device is done is an error */
+    if ((ep != 0x88) || (size != 4096) || !sim_complete(dev))
+        return -110;
+
+    if (usbsim_bulk_us > 0) {
+        struct timespec transfer;
+
+        transfer.tv_sec = usbsim_bulk_us/(1000*1000);
+        transfer.tv_nsec = (usbsim_bulk_us%(1000*1000))*1000;
+        nanosleep(&transfer, NULL);
+    }
+
+    /* Sample 0 is the device index, sample 1 the integration time, the rest
+     * counts up. The first word is not a sample at all. */
+    for (i=0;i<2048;i++) {
+        unsigned short val;
+
+        if (i == 1)
+            val = (unsigned short)dev->index;
+        else if (i == 2)
+            val = (unsigned short)dev->rate;
+        else
+            val = (unsigned short)i;
+
+        data[2*i] = (unsigned char)(val & 0xff);
+        data[2*i+1] = (unsigned char)(val >> 8);
+    }
+
+    dev->scanning = 0;
+
+    return size;
+}
+
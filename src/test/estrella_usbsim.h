@@ -0,0 +1,59 @@
+/*
+* Copyright (c) 2009, Björn Rehm (bjoern@shugaa.de)
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+* 
+*  * Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*  * Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*  * Neither the name of the author nor the names of its contributors may be
+*    used to endorse or promote products derived from this software without
+*    specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Simulated libusb-0.1 for tests and benchmarks. Since the executable's
+ * symbols take precedence over those of shared libraries, libestrella ends up
+ * talking to the simulated devices in here when this is linked in. Each device
+ * encodes its own index and current integration time into the scan data:
+ * sample 0 is the device index, sample 1 the integration time, the rest counts
+ * up. */
+
+#ifndef _ESTRELLA_USBSIM_H
+#define _ESTRELLA_USBSIM_H
+
+/* Number of simulated devices */
+#define USBSIM_DEVICES      (8)
+
+/* Time (us) a bulk read of scan data takes, 0 by default */
+extern long usbsim_bulk_us;
+
+/* While non-zero no scan completes, as if the devices waited for a trigger
+ * pulse which never comes */
+extern int usbsim_hold;
+
+/* Number of devices plugged in, all of them by default */
+extern int usbsim_present;
+
+/* Number of times devices have been opened, and busses scanned */
+extern unsigned long usbsim_opens;
+extern unsigned long usbsim_finds;
+
+/* Called whenever the busses are scanned, if set */
+extern void (*usbsim_find_hook)(void);
+
+#endif /* _ESTRELLA_USBSIM_H */